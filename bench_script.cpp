@@ -0,0 +1,543 @@
+/******************************************************************************
+ *             File : bench_script.cpp
+ *
+ * Benchmarks for the file system. Every section prints its timings; they are
+ * not compared against expected values like in the test scripts.
+ *****************************************************************************/
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+#include "lz.h"
+#include "dirscan.h"
+#include "fatscan.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+typedef std::chrono::steady_clock bench_clock;
+
+static long
+usSince(bench_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - start).count();
+}
+
+// creates <name> with the content of the given input file
+static void
+createFrom(FS& filesystem, const char *input, const std::string& name)
+{
+    int saved = dup(0);
+    int fw = open(input, O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create(name);
+    close(fw);
+    dup2(saved, 0);
+    close(saved);
+}
+
+// runs a command with its output (e.g. of cat) sent to /dev/null
+static void
+quietly(const std::function<void()>& command)
+{
+    std::cout.flush();
+    int saved = dup(1);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    command();
+    std::cout.flush();
+    dup2(saved, 1);
+    close(null);
+    close(saved);
+}
+
+static double
+mbPerSec(long bytes, long us)
+{
+    return us > 0 ? (double)bytes / us : 0;
+}
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+void
+Shell::run()
+{
+    PRINTDIV;
+    std::cout << "Starting benchmarks..." << std::endl;
+    PRINTDIV;
+
+    // 10000 small appends to one growing file; with the tail table every
+    // batch of 1000 should take about the same time
+    const int appends = 10000, batch = 1000;
+    const int features[] = { 0, FEAT_TAILS };
+    const char *names[] = { "format", "format tail" };
+    for (int f = 0; f < 2; f++)
+    {
+        std::cout << "Appending " << appends << " times to one file (" << names[f] << ")..." << std::endl;
+        filesystem.format(features[f]);
+        createFrom(filesystem, "input1.txt", "line");
+        createFrom(filesystem, "input1.txt", "log");
+
+        bench_clock::time_point total = bench_clock::now();
+        std::cout << "appends\t us/append" << std::endl;
+        for (int done = 0; done < appends; done += batch)
+        {
+            bench_clock::time_point start = bench_clock::now();
+            for (int i = 0; i < batch; i++)
+                filesystem.append("line", "log");
+            std::cout << done + batch << "\t " << (double)usSince(start) / batch << std::endl;
+        }
+        std::cout << "total: " << usSince(total) / 1000 << " ms" << std::endl;
+        filesystem.ls();
+        PRINTDIV2;
+    }
+
+    // the codec on its own, on input3.txt repeated to one chunk
+    {
+        std::ifstream in("input3.txt", std::ios::binary);
+        std::vector<uint8_t> text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::vector<uint8_t> chunk(COMPRESS_CHUNK), packed(COMPRESS_CHUNK), out(COMPRESS_CHUNK);
+        for (int i = 0; i < COMPRESS_CHUNK; i++)
+            chunk[i] = text[i % text.size()];
+
+        const int rounds = 2000;
+        int len = 0;
+        bench_clock::time_point start = bench_clock::now();
+        for (int r = 0; r < rounds; r++)
+            len = lz_compress(chunk.data(), COMPRESS_CHUNK, packed.data(), COMPRESS_CHUNK);
+        long us_c = usSince(start);
+        start = bench_clock::now();
+        for (int r = 0; r < rounds; r++)
+            lz_decompress(packed.data(), len, out.data(), COMPRESS_CHUNK);
+        long us_d = usSince(start);
+        std::cout << "Codec on " << COMPRESS_CHUNK << " bytes of input3.txt: " << len << " bytes compressed, "
+                  << mbPerSec((long)rounds * COMPRESS_CHUNK, us_c) << " MB/s compress, "
+                  << mbPerSec((long)rounds * COMPRESS_CHUNK, us_d) << " MB/s decompress" << std::endl;
+        PRINTDIV2;
+    }
+
+    // the same text file through the file system, with and without compression
+    const int copies = 60;
+    const int layouts[] = { FEAT_EXTENTS, FEAT_COMPRESS };
+    const char *layout_names[] = { "format extent", "format compress" };
+    for (int f = 0; f < 2; f++)
+    {
+        std::cout << "Building a " << copies << " x input3.txt file (" << layout_names[f] << ")..." << std::endl;
+        filesystem.format(layouts[f]);
+        createFrom(filesystem, "input3.txt", "part");
+        createFrom(filesystem, "input3.txt", "big");
+
+        bench_clock::time_point start = bench_clock::now();
+        for (int i = 1; i < copies; i++)
+            filesystem.append("part", "big");
+        long us_append = usSince(start);
+        const long bytes = (long)copies * 4129;
+
+        const int reads = 20;
+        start = bench_clock::now();
+        quietly([&]() { for (int i = 0; i < reads; i++) filesystem.cat("big"); });
+        long us_cat = usSince(start);
+
+        start = bench_clock::now();
+        filesystem.cp("big", "copy");
+        long us_cp = usSince(start);
+
+        std::cout << "append: " << us_append / (copies - 1) << " us/append, cat: "
+                  << mbPerSec(bytes * reads, us_cat) << " MB/s, cp: " << us_cp << " us" << std::endl;
+        filesystem.du("big");
+        PRINTDIV2;
+    }
+
+    // repeated cp of the same file, with and without deduplication
+    const int dups = 5;
+    const int dedup_layouts[] = { FEAT_EXTENTS, FEAT_DEDUP };
+    const char *dedup_names[] = { "format extent", "format dedup" };
+    for (int f = 0; f < 2; f++)
+    {
+        std::cout << "Copying a " << copies << " x input3.txt file " << dups << " times ("
+                  << dedup_names[f] << ")..." << std::endl;
+        filesystem.format(dedup_layouts[f]);
+        createFrom(filesystem, "input3.txt", "part");
+        createFrom(filesystem, "input3.txt", "big");
+        for (int i = 1; i < copies; i++)
+            filesystem.append("part", "big");
+
+        bench_clock::time_point start = bench_clock::now();
+        for (int i = 0; i < dups; i++)
+            filesystem.cp("big", "copy" + std::to_string(i));
+        std::cout << "cp: " << usSince(start) / dups << " us/copy" << std::endl;
+        if (dedup_layouts[f] == FEAT_DEDUP)
+            filesystem.dedup();
+        PRINTDIV2;
+    }
+
+    // directory scans on a full block, for every kernel set the CPU has;
+    // "scalar" is the plain loop the file system used before
+    {
+        dir_entry dir[BLOCK_SIZE / sizeof(dir_entry)];
+        const int n = BLOCK_SIZE / sizeof(dir_entry);
+        std::memset(dir, 0, sizeof(dir));
+        for (int i = 0; i < n; i++)
+        {
+            std::string name = "file_" + std::to_string(i);
+            std::strcpy(dir[i].file_name, name.c_str());
+            dir[i].first_blk = 100 + i;
+            dir[i].type = i % 2 ? TYPE_DIR : TYPE_FILE;
+        }
+        dir_entry empty[BLOCK_SIZE / sizeof(dir_entry)];
+        std::memset(empty, 0, sizeof(empty));
+
+        const char *sets[] = { "scalar", "sse2", "avx2" };
+        const int rounds = 200000;
+        std::string active = dir_scan_kernels();
+        std::cout << "Scanning a " << n << "-entry directory, ns per scan (default: " << active << ")" << std::endl;
+        std::cout << "kernels\t name\t free\t used\t block" << std::endl;
+        for (int k = 0; k < 3; k++)
+        {
+            if (!dir_scan_use(sets[k]))
+                continue;
+            volatile int sink = 0;
+            long ns[4];
+            for (int t = 0; t < 4; t++)
+            {
+                bench_clock::time_point start = bench_clock::now();
+                for (int r = 0; r < rounds; r++)
+                {
+                    if (t == 0)
+                        sink += dir_find_name(dir, n, "file_63");
+                    else if (t == 1)
+                        sink += dir_find_free(dir, n);
+                    else if (t == 2)
+                        sink += dir_find_used(empty, n, 1);
+                    else
+                        sink += dir_find_block(dir, n, 0, 163, TYPE_DIR);
+                }
+                ns[t] = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count() / rounds;
+            }
+            std::cout << sets[k] << "\t " << ns[0] << "\t " << ns[1] << "\t " << ns[2] << "\t " << ns[3] << std::endl;
+        }
+        dir_scan_use(active.c_str());
+        PRINTDIV2;
+    }
+
+    // FAT scans on a nearly full table of this disk's size and of the largest
+    // size an int16_t FAT can address; the only free block is the last one
+    {
+        const int sizes[] = { BLOCK_SIZE / 2, 32767 };
+        const char *sets[] = { "scalar", "sse2", "avx2" };
+        std::string active = fat_scan_kernels();
+        for (int s = 0; s < 2; s++)
+        {
+            const int n = sizes[s];
+            std::vector<int16_t> table(n);
+            for (int i = 0; i < n; i++)
+                table[i] = i % 3 ? FAT_USED : (i + 3 < n ? i + 3 : FAT_EOF);
+            table[n - 1] = FAT_FREE;
+
+            const int rounds = 20000000 / n;
+            std::cout << "Scanning a " << n << "-entry FAT, ns per scan (default: " << active << ")" << std::endl;
+            std::cout << "kernels\t free\t count\t check" << std::endl;
+            for (int k = 0; k < 3; k++)
+            {
+                if (!fat_scan_use(sets[k]))
+                    continue;
+                volatile int sink = 0;
+                long ns[3];
+                for (int t = 0; t < 3; t++)
+                {
+                    bench_clock::time_point start = bench_clock::now();
+                    for (int r = 0; r < rounds; r++)
+                    {
+                        if (t == 0)
+                            sink += fat_find(table.data(), n, 2, FAT_FREE);
+                        else if (t == 1)
+                            sink += fat_count(table.data(), n, FAT_FREE);
+                        else
+                            sink += fat_find_invalid(table.data(), n, 0);
+                    }
+                    ns[t] = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count() / rounds;
+                }
+                std::cout << sets[k] << "\t " << ns[0] << "\t " << ns[1] << "\t " << ns[2] << std::endl;
+            }
+        }
+        fat_scan_use(active.c_str());
+
+        // cp and rm of a small file on a disk that is full up to its last
+        // blocks, so every allocation scans the whole FAT
+        filesystem.format();
+        createFrom(filesystem, "input1.txt", "small");
+        for (int d = 10; d >= 5; d--)
+        {
+            std::string name = "fill" + std::to_string(d);
+            createFrom(filesystem, "input3.txt", name);
+            for (int i = 0; i < d; i++)
+                filesystem.append(name, name);
+        }
+        filesystem.df();
+        const int copies = 2000;
+        for (int k = 0; k < 3; k++)
+        {
+            if (!fat_scan_use(sets[k]))
+                continue;
+            bench_clock::time_point start = bench_clock::now();
+            for (int r = 0; r < copies; r++)
+            {
+                filesystem.cp("small", "copy");
+                filesystem.rm("copy");
+            }
+            std::cout << sets[k] << " cp + rm on the full disk: "
+                      << (double)usSince(start) / copies << " us" << std::endl;
+        }
+        fat_scan_use(active.c_str());
+        PRINTDIV2;
+    }
+
+    // two files grown in turns end up interleaved block by block; cat reads
+    // a contiguous chain with one I/O per run
+    {
+        std::cout << "Reading interleaved files before and after defrag..." << std::endl;
+        filesystem.format();
+        createFrom(filesystem, "input3.txt", "part");
+        createFrom(filesystem, "input3.txt", "a");
+        createFrom(filesystem, "input3.txt", "b");
+        for (int i = 1; i < copies; i++)
+        {
+            filesystem.append("part", "a");
+            filesystem.append("part", "b");
+        }
+        const long bytes = (long)copies * 4129;
+        const int reads = 20;
+        bench_clock::time_point start = bench_clock::now();
+        quietly([&]() { for (int i = 0; i < reads; i++) filesystem.cat("a"); });
+        long us_before = usSince(start);
+        filesystem.defrag();
+        start = bench_clock::now();
+        quietly([&]() { for (int i = 0; i < reads; i++) filesystem.cat("a"); });
+        long us_after = usSince(start);
+        std::cout << "cat: " << mbPerSec(bytes * reads, us_before) << " MB/s before, "
+                  << mbPerSec(bytes * reads, us_after) << " MB/s after" << std::endl;
+        PRINTDIV2;
+    }
+
+    // fsck on a tree of directories full of files; the directories are read
+    // and the chains followed on the thread pool
+    {
+        const int dirs = 30, files = 20;
+        std::cout << "Checking a tree of " << dirs << " directories with " << files << " files each..." << std::endl;
+        filesystem.format();
+        for (int d = 0; d < dirs; d++)
+        {
+            std::string dir = "dir" + std::to_string(d);
+            filesystem.mkdir(dir);
+            filesystem.cd(dir);
+            for (int f = 0; f < files; f++)
+                createFrom(filesystem, f % 2 ? "input1.txt" : "input3.txt", "file" + std::to_string(f));
+            filesystem.cd("..");
+        }
+        const int rounds = 20;
+        bench_clock::time_point start = bench_clock::now();
+        quietly([&]() { for (int r = 0; r < rounds; r++) filesystem.fsck(); });
+        std::cout << "fsck: " << usSince(start) / rounds << " us" << std::endl;
+        filesystem.fsck();
+        PRINTDIV2;
+    }
+
+    // a snapshot copies metadata only, so its cost depends on the number of
+    // directories and not on the amount of data
+    {
+        const int sizes[] = { 1, 64, 512 };
+        std::cout << "Taking and deleting snapshots..." << std::endl;
+        std::cout << "copies\t us/snapshot\t us/delete" << std::endl;
+        for (int k = 0; k < 3; k++)
+        {
+            filesystem.format(FEAT_EXTENTS | FEAT_SNAPSHOT);
+            createFrom(filesystem, "input3.txt", "part");
+            createFrom(filesystem, "input3.txt", "big");
+            for (int i = 1; i < sizes[k]; i++)
+                filesystem.append("part", "big");
+            const int rounds = 20;
+            long us_take = 0, us_delete = 0;
+            for (int r = 0; r < rounds; r++)
+            {
+                bench_clock::time_point start = bench_clock::now();
+                filesystem.snapshot("s");
+                us_take += usSince(start);
+                start = bench_clock::now();
+                filesystem.deleteSnapshot("s");
+                us_delete += usSince(start);
+            }
+            std::cout << sizes[k] << "\t " << us_take / rounds << "\t\t " << us_delete / rounds << std::endl;
+        }
+        PRINTDIV2;
+    }
+
+    // two logs growing in turns, without and with space reserved up front:
+    // preallocated logs take no allocator work and stay in one run each
+    {
+        const int lines = 4000;
+        for (int reserve = 0; reserve < 2; reserve++)
+        {
+            std::cout << "Appending " << lines << " lines to two logs in turns ("
+                      << (reserve ? "fallocate" : "no reservation") << ")..." << std::endl;
+            filesystem.format(FEAT_EXTENTS);
+            createFrom(filesystem, "input1.txt", "line");
+            createFrom(filesystem, "input1.txt", "a");
+            createFrom(filesystem, "input1.txt", "b");
+            if (reserve)
+            {
+                filesystem.fallocate("a", (long)(lines + 1) * 17);
+                filesystem.fallocate("b", (long)(lines + 1) * 17);
+            }
+            bench_clock::time_point start = bench_clock::now();
+            for (int i = 0; i < lines; i++)
+            {
+                filesystem.append("line", "a");
+                filesystem.append("line", "b");
+            }
+            std::cout << "append: " << (double)usSince(start) / (2 * lines) << " us" << std::endl;
+            filesystem.defrag();
+            PRINTDIV2;
+        }
+
+        std::cout << "Growing a file to 256 MB with truncate..." << std::endl;
+        filesystem.format(FEAT_EXTENTS);
+        createFrom(filesystem, "input1.txt", "sparse");
+        bench_clock::time_point start = bench_clock::now();
+        filesystem.truncate("sparse", 256L << 20);
+        std::cout << "truncate: " << usSince(start) << " us" << std::endl;
+        filesystem.du("sparse");
+        PRINTDIV2;
+    }
+
+    {
+        // 4 MB of 64-byte lines, once through the line-oriented create and
+        // once as raw bytes
+        const long size = 4L << 20;
+        std::string line(63, 'x');
+        line += "\n";
+        int fw = open("bench_input", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        for (long done = 0; done < size; done += line.size())
+            write(fw, line.data(), line.size());
+        close(fw);
+        for (int raw = 0; raw < 2; raw++)
+        {
+            std::cout << "Creating a 4 MB file (" << (raw ? "byte count" : "lines") << ")..." << std::endl;
+            filesystem.format(FEAT_EXTENTS);
+            int saved = dup(0);
+            fw = open("bench_input", O_RDONLY);
+            dup2(fw, 0);
+            bench_clock::time_point start = bench_clock::now();
+            if (raw)
+                filesystem.create("big", size);
+            else
+                quietly([this]() { filesystem.create("big"); });
+            long us = usSince(start);
+            close(fw);
+            dup2(saved, 0);
+            close(saved);
+            std::cin.clear(); // the line-oriented create ran into the end
+            std::cout << "create: " << us << " us, " << mbPerSec(size, us) << " MB/s" << std::endl;
+            PRINTDIV2;
+        }
+        unlink("bench_input");
+    }
+
+    {
+        // the file left by the byte-count create: copied out, or mapped
+        const int reads = 100;
+        std::cout << "Reading a 4 MB file " << reads << " times (copy vs mapped)..." << std::endl;
+        bench_clock::time_point start = bench_clock::now();
+        for (int i = 0; i < reads; i++)
+        {
+            std::vector<uint8_t> data;
+            filesystem.readFile("big", data);
+        }
+        long copy_us = usSince(start);
+        start = bench_clock::now();
+        size_t spans = 0;
+        for (int i = 0; i < reads; i++)
+        {
+            file_view view;
+            filesystem.mapFile("big", view);
+            spans = view.spans.size();
+        }
+        long map_us = usSince(start);
+        std::cout << "readFile: " << copy_us / reads << " us, mapFile: " << map_us / reads
+                  << " us (" << spans << " spans)" << std::endl;
+        PRINTDIV2;
+    }
+
+    {
+        // 4 directories of 200 files on a compact volume, all polled at once
+        std::cout << "Stat of 800 files (one at a time vs bulk)..." << std::endl;
+        filesystem.format(FEAT_COMPACT_DIRS);
+        std::vector<std::string> paths;
+        for (int d = 0; d < 4; d++)
+        {
+            std::string dir = "/dir" + std::to_string(d);
+            filesystem.mkdir(dir);
+            for (int i = 0; i < 200; i++)
+            {
+                paths.push_back(dir + "/file" + std::to_string(i));
+                filesystem.writeFile(paths.back(), (const uint8_t *)"x", 1);
+            }
+        }
+        bench_clock::time_point start = bench_clock::now();
+        int found = 0;
+        for (size_t i = 0; i < paths.size(); i++)
+        {
+            dir_entry e;
+            found += filesystem.entryOf(paths[i], e);
+        }
+        long single_us = usSince(start);
+        start = bench_clock::now();
+        std::vector<file_stat> stats;
+        filesystem.statPaths(paths, stats);
+        long bulk_us = usSince(start);
+        std::cout << "entryOf: " << single_us << " us (" << found << " found), statPaths: "
+                  << bulk_us << " us" << std::endl;
+        PRINTDIV2;
+    }
+
+    {
+        // the same files written with every block going to the image at
+        // once, and through the write-back cache (plus the final sync)
+        const int files = 300;
+        std::vector<uint8_t> data(4 * BLOCK_SIZE, 'w');
+        std::cout << "Writing " << files << " files of " << data.size() << " bytes (write-through vs write-back)..." << std::endl;
+        std::cout << "mode\t us/file\t us sync" << std::endl;
+        for (int on = 0; on < 2; on++)
+        {
+            filesystem.writeback(on);
+            filesystem.format(FEAT_EXTENTS);
+            bench_clock::time_point start = bench_clock::now();
+            for (int i = 0; i < files; i++)
+                filesystem.writeFile("/w" + std::to_string(i % 100), data.data(), data.size());
+            long us = usSince(start);
+            start = bench_clock::now();
+            filesystem.sync();
+            std::cout << (on ? "back" : "through") << "\t " << (double)us / files << "\t " << usSince(start) << std::endl;
+        }
+        PRINTDIV2;
+    }
+
+    std::cout << "... Benchmarks done" << std::endl;
+    PRINTDIV;
+}
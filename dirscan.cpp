@@ -0,0 +1,403 @@
+#include <cstring>
+#include <cstddef>
+#include "dirscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DIRSCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static_assert(sizeof(dir_entry) == 64, "the kernels assume 64-byte entries");
+
+// first_blk, type and access_rights share the dword at this offset
+static const int BLK_OFFSET = offsetof(dir_entry, first_blk);
+static const uint32_t BLK_TYPE_MASK = 0xffff | (uint32_t)TYPE_MASK << 16;
+
+static inline uint32_t
+load32(const void *p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// The name as it must appear in an entry, NUL included, and a bit per byte
+// of it. false if no entry can hold the name.
+struct name_key {
+    uint8_t bytes[64];
+    uint64_t need;
+    int chunks16; // 16-byte chunks covering need
+    // the dword ending with the NUL, compared first: unlike the first bytes
+    // it also tells names of different length apart
+    int probe_offset;
+    uint32_t probe, probe_mask;
+
+    bool set(const char *name)
+    {
+        size_t len = std::strlen(name);
+        if (len == 0 || len >= sizeof(((dir_entry *)0)->file_name))
+            return false;
+        std::memset(bytes, 0, sizeof(bytes));
+        std::memcpy(bytes, name, len);
+        need = (1ULL << (len + 1)) - 1;
+        chunks16 = (len + 1 + 15) / 16;
+        probe_offset = len + 1 >= 4 ? len + 1 - 4 : 0;
+        probe_mask = len + 1 >= 4 ? 0xffffffffu : (1u << 8 * (len + 1)) - 1;
+        probe = load32(bytes + probe_offset) & probe_mask;
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// scalar
+// ---------------------------------------------------------------------------
+
+static int
+scalarName(const dir_entry *dir, int n, const char *name)
+{
+    for (int i = 0; i < n; i++) {
+        if (dir[i].file_name[0] != '\0' && std::strcmp(dir[i].file_name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int
+scalarFree(const dir_entry *dir, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (dir[i].file_name[0] == '\0')
+            return i;
+    }
+    return -1;
+}
+
+static int
+scalarUsed(const dir_entry *dir, int n, int from)
+{
+    for (int i = from; i < n; i++) {
+        if (dir[i].file_name[0] != '\0')
+            return i;
+    }
+    return -1;
+}
+
+static int
+scalarBlock(const dir_entry *dir, int n, int from, uint16_t blk, uint8_t type)
+{
+    for (int i = from; i < n; i++) {
+        if (dir[i].file_name[0] != '\0' && dir[i].first_blk == blk &&
+            (dir[i].type & TYPE_MASK) == type)
+            return i;
+    }
+    return -1;
+}
+
+#ifdef DIRSCAN_X86
+
+// ---------------------------------------------------------------------------
+// SSE2: four entries per step; their dwords are collected into one register
+// ---------------------------------------------------------------------------
+
+// built with movd/unpack: _mm_setr_epi32 tends to go through the stack
+static inline __m128i
+dwords4(const dir_entry *dir, int offset)
+{
+    const char *p = (const char *)dir + offset;
+    __m128i a = _mm_unpacklo_epi32(_mm_cvtsi32_si128(load32(p)), _mm_cvtsi32_si128(load32(p + 64)));
+    __m128i b = _mm_unpacklo_epi32(_mm_cvtsi32_si128(load32(p + 128)), _mm_cvtsi32_si128(load32(p + 192)));
+    return _mm_unpacklo_epi64(a, b);
+}
+
+static inline int
+mask4(__m128i eq)
+{
+    return _mm_movemask_ps(_mm_castsi128_ps(eq));
+}
+
+static inline bool
+sse2Match(const dir_entry *e, const name_key& key)
+{
+    uint64_t eq = 0;
+    for (int c = 0; c < key.chunks16; c++) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(e->file_name + 16 * c));
+        __m128i b = _mm_loadu_si128((const __m128i *)(key.bytes + 16 * c));
+        eq |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) << (16 * c);
+    }
+    return (eq & key.need) == key.need;
+}
+
+static int
+sse2Name(const dir_entry *dir, int n, const char *name)
+{
+    name_key key;
+    if (!key.set(name))
+        return -1;
+    const __m128i pmask = _mm_set1_epi32(key.probe_mask);
+    const __m128i probe = _mm_set1_epi32(key.probe);
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_and_si128(dwords4(dir + i, key.probe_offset), pmask);
+        int hits = mask4(_mm_cmpeq_epi32(v, probe));
+        for (; hits; hits &= hits - 1) {
+            int k = i + __builtin_ctz(hits);
+            if (sse2Match(&dir[k], key))
+                return k;
+        }
+    }
+    for (; i < n; i++) {
+        if (sse2Match(&dir[i], key))
+            return i;
+    }
+    return -1;
+}
+
+// bit k set if the first byte of entry i + k is zero
+static inline int
+sse2Empty4(const dir_entry *dir)
+{
+    __m128i first = _mm_and_si128(dwords4(dir, 0), _mm_set1_epi32(0xff));
+    return mask4(_mm_cmpeq_epi32(first, _mm_setzero_si128()));
+}
+
+static int
+sse2Free(const dir_entry *dir, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        int hits = sse2Empty4(dir + i);
+        if (hits)
+            return i + __builtin_ctz(hits);
+    }
+    int k = scalarFree(dir + i, n - i);
+    return k == -1 ? -1 : i + k;
+}
+
+static int
+sse2Used(const dir_entry *dir, int n, int from)
+{
+    int i = from;
+    for (; i + 4 <= n; i += 4) {
+        int hits = ~sse2Empty4(dir + i) & 0xf;
+        if (hits)
+            return i + __builtin_ctz(hits);
+    }
+    return scalarUsed(dir, n, i);
+}
+
+static int
+sse2Block(const dir_entry *dir, int n, int from, uint16_t blk, uint8_t type)
+{
+    const __m128i mask = _mm_set1_epi32(BLK_TYPE_MASK);
+    const __m128i want = _mm_set1_epi32(blk | (uint32_t)type << 16);
+    int i = from;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_and_si128(dwords4(dir + i, BLK_OFFSET), mask);
+        int hits = mask4(_mm_cmpeq_epi32(v, want)) & ~sse2Empty4(dir + i);
+        if (hits)
+            return i + __builtin_ctz(hits);
+    }
+    return scalarBlock(dir, n, i, blk, type);
+}
+
+// ---------------------------------------------------------------------------
+// AVX2: eight entries per step with a gather; names compared 32 bytes at once
+// ---------------------------------------------------------------------------
+
+__attribute__((target("avx2"))) static inline __m256i
+dwords8(const dir_entry *dir, int offset)
+{
+    const __m256i index = _mm256_setr_epi32(0, 64, 128, 192, 256, 320, 384, 448);
+    return _mm256_i32gather_epi32((const int *)((const char *)dir + offset), index, 1);
+}
+
+__attribute__((target("avx2"))) static inline int
+mask8(__m256i eq)
+{
+    return _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+}
+
+__attribute__((target("avx2"))) static inline int
+avx2Empty8(const dir_entry *dir)
+{
+    __m256i first = _mm256_and_si256(dwords8(dir, 0), _mm256_set1_epi32(0xff));
+    return mask8(_mm256_cmpeq_epi32(first, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2"))) static inline bool
+avx2Match(const dir_entry *e, const name_key& key)
+{
+    __m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)e->file_name),
+                                   _mm256_loadu_si256((const __m256i *)key.bytes));
+    uint64_t eq = (uint32_t)_mm256_movemask_epi8(lo);
+    if (key.need >> 32) {
+        __m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(e->file_name + 32)),
+                                       _mm256_loadu_si256((const __m256i *)(key.bytes + 32)));
+        eq |= (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32;
+    }
+    return (eq & key.need) == key.need;
+}
+
+__attribute__((target("avx2"))) static int
+avx2Name(const dir_entry *dir, int n, const char *name)
+{
+    name_key key;
+    if (!key.set(name))
+        return -1;
+    const __m256i pmask = _mm256_set1_epi32(key.probe_mask);
+    const __m256i probe = _mm256_set1_epi32(key.probe);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_and_si256(dwords8(dir + i, key.probe_offset), pmask);
+        int hits = mask8(_mm256_cmpeq_epi32(v, probe));
+        for (; hits; hits &= hits - 1) {
+            int k = i + __builtin_ctz(hits);
+            if (avx2Match(&dir[k], key))
+                return k;
+        }
+    }
+    for (; i < n; i++) {
+        if (avx2Match(&dir[i], key))
+            return i;
+    }
+    return -1;
+}
+
+__attribute__((target("avx2"))) static int
+avx2Free(const dir_entry *dir, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int hits = avx2Empty8(dir + i);
+        if (hits)
+            return i + __builtin_ctz(hits);
+    }
+    int k = scalarFree(dir + i, n - i);
+    return k == -1 ? -1 : i + k;
+}
+
+__attribute__((target("avx2"))) static int
+avx2Used(const dir_entry *dir, int n, int from)
+{
+    int i = from;
+    for (; i + 8 <= n; i += 8) {
+        int hits = ~avx2Empty8(dir + i) & 0xff;
+        if (hits)
+            return i + __builtin_ctz(hits);
+    }
+    return scalarUsed(dir, n, i);
+}
+
+__attribute__((target("avx2"))) static int
+avx2Block(const dir_entry *dir, int n, int from, uint16_t blk, uint8_t type)
+{
+    const __m256i mask = _mm256_set1_epi32(BLK_TYPE_MASK);
+    const __m256i want = _mm256_set1_epi32(blk | (uint32_t)type << 16);
+    int i = from;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_and_si256(dwords8(dir + i, BLK_OFFSET), mask);
+        int hits = mask8(_mm256_cmpeq_epi32(v, want)) & ~avx2Empty8(dir + i);
+        if (hits)
+            return i + __builtin_ctz(hits);
+    }
+    return scalarBlock(dir, n, i, blk, type);
+}
+
+#endif // DIRSCAN_X86
+
+// ---------------------------------------------------------------------------
+// run-time dispatch
+// ---------------------------------------------------------------------------
+
+struct dir_kernels {
+    const char *name;
+    int (*find_name)(const dir_entry *, int, const char *);
+    int (*find_free)(const dir_entry *, int);
+    int (*find_used)(const dir_entry *, int, int);
+    int (*find_block)(const dir_entry *, int, int, uint16_t, uint8_t);
+};
+
+static const dir_kernels kernel_table[] = {
+#ifdef DIRSCAN_X86
+    { "avx2", avx2Name, avx2Free, avx2Used, avx2Block },
+    { "sse2", sse2Name, sse2Free, sse2Used, sse2Block },
+#endif
+    { "scalar", scalarName, scalarFree, scalarUsed, scalarBlock },
+};
+static const int no_kernels = sizeof(kernel_table) / sizeof(kernel_table[0]);
+
+static bool
+supported(const dir_kernels& k)
+{
+#ifdef DIRSCAN_X86
+    __builtin_cpu_init();
+    if (std::strcmp(k.name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (std::strcmp(k.name, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+#endif
+    return true;
+}
+
+static const dir_kernels *
+best()
+{
+    for (int i = 0; i < no_kernels; i++) {
+        if (supported(kernel_table[i]))
+            return &kernel_table[i];
+    }
+    return &kernel_table[no_kernels - 1];
+}
+
+// the kernels in use: the first supported entry of kernel_table, unless
+// dir_scan_use() chose others
+static const dir_kernels *&
+active()
+{
+    static const dir_kernels *k = best();
+    return k;
+}
+
+int
+dir_find_name(const dir_entry *dir, int n, const char *name)
+{
+    return active()->find_name(dir, n, name);
+}
+
+int
+dir_find_free(const dir_entry *dir, int n)
+{
+    return active()->find_free(dir, n);
+}
+
+int
+dir_find_used(const dir_entry *dir, int n, int from)
+{
+    return active()->find_used(dir, n, from);
+}
+
+int
+dir_find_block(const dir_entry *dir, int n, int from, uint16_t blk, uint8_t type)
+{
+    return active()->find_block(dir, n, from, blk, type);
+}
+
+const char *
+dir_scan_kernels()
+{
+    return active()->name;
+}
+
+bool
+dir_scan_use(const char *name)
+{
+    for (int i = 0; i < no_kernels; i++) {
+        if (std::strcmp(kernel_table[i].name, name) == 0 && supported(kernel_table[i])) {
+            active() = &kernel_table[i];
+            return true;
+        }
+    }
+    return false;
+}
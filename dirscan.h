@@ -0,0 +1,26 @@
+#include <cstdint>
+#include "fs.h"
+
+#ifndef __DIRSCAN_H__
+#define __DIRSCAN_H__
+
+// Scans over the dir_entry records of a directory block. Every function has
+// a scalar, an SSE2 and an AVX2 version; the best one the CPU supports is
+// picked at run time. Results are those of the plain loops: the index of the
+// first matching entry at or after from, or -1.
+
+// used entry whose file_name equals name
+int dir_find_name(const dir_entry *dir, int n, const char *name);
+// entry with an empty name
+int dir_find_free(const dir_entry *dir, int n);
+// used entry
+int dir_find_used(const dir_entry *dir, int n, int from);
+// used entry with the given first_blk and type & TYPE_MASK
+int dir_find_block(const dir_entry *dir, int n, int from, uint16_t blk, uint8_t type);
+
+// name of the kernels in use ("avx2", "sse2" or "scalar")
+const char *dir_scan_kernels();
+// switches to the named kernels; false if the CPU lacks them
+bool dir_scan_use(const char *name);
+
+#endif // __DIRSCAN_H__
@@ -1,7 +1,15 @@
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include "disk.h"
 
-Disk::Disk()
+Disk::Disk() : epoch(0), epoch_written(false), dirty_count(0), writeback_on(true),
+               stopping(false), failed(false)
 {
     // first check if the disk file exists, otherwise create it.
     if (!disk_file_exists(DISKNAME)) {
@@ -12,16 +20,32 @@ Disk::Disk()
         f.write("", 1);
     }
     // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
+    diskfd = open(DISKNAME, O_RDWR);
+    if (diskfd == -1) {
         std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
         exit(-1);
     }
+    void *m = mmap(NULL, disk_size, PROT_READ, MAP_SHARED, diskfd, 0);
+    mapped = m == MAP_FAILED ? NULL : (const uint8_t *)m;
+    flusher = std::thread(&Disk::flusher_loop, this);
 }
 
 Disk::~Disk()
 {
-    diskfile.close();
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        stopping = true;
+    }
+    flusher_wake.notify_one();
+    drained.notify_all();
+    flusher.join();
+    {
+        std::lock_guard<std::mutex> io(io_mutex);
+        write_back(~0u);
+    }
+    if (mapped)
+        munmap((void *)mapped, disk_size);
+    close(diskfd);
 }
 
 bool
@@ -41,11 +65,9 @@ Disk::write(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
-    return 0;
+    if (!writeback_on)
+        return write_through(block_no, 1, blk);
+    return write_cached(block_no, 1, blk);
 }
 
 // reads one block from the disk
@@ -59,8 +81,299 @@ Disk::read(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
+    if (dirty_count.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        std::map<unsigned, unsigned>::iterator n = newest.find(block_no);
+        if (n != newest.end()) {
+            std::memcpy(blk, dirty.find(dirty_key(n->second, block_no))->second.data.data(), BLOCK_SIZE);
+            return 0;
+        }
+    }
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    if (pread(diskfd, blk, BLOCK_SIZE, offset) != BLOCK_SIZE)
+        return -1;
+    return 0;
+}
+
+// writes count consecutive blocks to the disk
+int
+Disk::write_blocks(unsigned block_no, unsigned count, uint8_t *blks)
+{
+    if (DEBUG)
+        std::cout << "Disk::write_blocks(" << block_no << ", " << count << ")\n";
+    if (block_no >= no_blocks || count > no_blocks - block_no) {
+        std::cout << "Disk::write_blocks - ERROR: Invalid block range (" << block_no << ", " << count << ")\n";
+        return -1;
+    }
+    if (!writeback_on)
+        return write_through(block_no, count, blks);
+    return write_cached(block_no, count, blks);
+}
+
+// reads count consecutive blocks from the disk
+int
+Disk::read_blocks(unsigned block_no, unsigned count, uint8_t *blks)
+{
+    if (DEBUG)
+        std::cout << "Disk::read_blocks(" << block_no << ", " << count << ")\n";
+    if (block_no >= no_blocks || count > no_blocks - block_no) {
+        std::cout << "Disk::read_blocks - ERROR: Invalid block range (" << block_no << ", " << count << ")\n";
+        return -1;
+    }
+    // 1) dirty blocks come from the cache; they are looked up first, as
+    //    the flusher drops a block only once the image has it
+    std::vector<char> hit(count, 0);
+    if (dirty_count.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        std::map<unsigned, unsigned>::iterator n = newest.lower_bound(block_no);
+        for (; n != newest.end() && n->first < block_no + count; ++n) {
+            const dirty_block& d = dirty.find(dirty_key(n->second, n->first))->second;
+            std::memcpy(blks + (size_t)(n->first - block_no) * BLOCK_SIZE, d.data.data(), BLOCK_SIZE);
+            hit[n->first - block_no] = 1;
+        }
+    }
+    // 2) one read per run of the others
+    for (unsigned i = 0; i < count; ) {
+        if (hit[i]) {
+            i++;
+            continue;
+        }
+        unsigned j = i + 1;
+        while (j < count && !hit[j])
+            j++;
+        off_t offset = (off_t)(block_no + i) * BLOCK_SIZE;
+        size_t bytes = (size_t)(j - i) * BLOCK_SIZE;
+        if (pread(diskfd, blks + (size_t)i * BLOCK_SIZE, bytes, offset) != (ssize_t)bytes)
+            return -1;
+        i = j;
+    }
+    return 0;
+}
+
+// writes count consecutive blocks straight to the image
+int
+Disk::write_through(unsigned block_no, unsigned count, const uint8_t *blks)
+{
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    size_t bytes = (size_t)count * BLOCK_SIZE;
+    if (pwrite(diskfd, blks, bytes, offset) != (ssize_t)bytes)
+        return -1;
+    return 0;
+}
+
+// puts count consecutive blocks in the write-back cache, in the current
+// epoch; the caller waits while too many blocks are dirty. Returns -1 if
+// it had to wait and the write-back is failing: the blocks stay dirty and
+// are retried, but the image does not have them
+int
+Disk::write_cached(unsigned block_no, unsigned count, const uint8_t *blks)
+{
+    // 1) into the current epoch
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    clock_type::time_point now = clock_type::now();
+    for (unsigned i = 0; i < count; i++) {
+        std::pair<std::map<dirty_key, dirty_block>::iterator, bool> ins =
+            dirty.insert(std::make_pair(dirty_key(epoch, block_no + i), dirty_block()));
+        dirty_block& d = ins.first->second;
+        if (ins.second) {
+            // a reused buffer saves the page faults of a new one
+            if (spare.empty())
+                d.data.resize(BLOCK_SIZE);
+            else {
+                d.data.swap(spare.back());
+                spare.pop_back();
+            }
+            d.since = now;
+        }
+        std::memcpy(d.data.data(), blks + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+        newest[block_no + i] = epoch;
+    }
+    epoch_written = true;
+    dirty_count.store(dirty.size(), std::memory_order_release);
+    if (dirty.size() >= dirty_background)
+        flusher_wake.notify_one();
+    // 2) over the limit the writer waits for the flusher to make room for
+    //    a batch of writes, not just one; a failing write-back won't
+    if (dirty.size() >= dirty_limit) {
+        drained.wait(lock, [this] { return dirty.size() <= dirty_limit - dirty_background || failed || stopping; });
+        if (failed && dirty.size() > dirty_limit - dirty_background) {
+            std::cout << "Disk::write_cached - ERROR: Write-back is failing (" << dirty.size() << " blocks dirty)\n";
+            return -1;
+        }
+    }
     return 0;
 }
+
+// the writes so far reach the image before any that follow
+void
+Disk::barrier()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (epoch_written) {
+        epoch++;
+        epoch_written = false;
+    }
+}
+
+// Writes the epochs up to last back, oldest first and each in block order,
+// one I/O per run of consecutive blocks. An epoch being written is closed
+// first, so its copies do not change and are written straight from the
+// cache, which is locked only to find and to drop them. If a block can't be
+// written, it and every later epoch stay dirty.
+int
+Disk::write_back(unsigned last)
+{
+    int ret = 0;
+    std::vector<std::map<dirty_key, dirty_block>::iterator> taken;
+    std::vector<struct iovec> iov;
+    while (ret == 0) {
+        // 1) the oldest epoch
+        taken.clear();
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            if (dirty.empty() || dirty.begin()->first.first > last)
+                break;
+            unsigned e = dirty.begin()->first.first;
+            if (e == epoch) {
+                epoch++;
+                epoch_written = false;
+            }
+            std::map<dirty_key, dirty_block>::iterator it = dirty.begin();
+            for (; it != dirty.end() && it->first.first == e; ++it)
+                taken.push_back(it);
+        }
+
+        // 2) write it
+        size_t written = taken.size();
+        for (size_t i = 0; i < taken.size(); ) {
+            size_t j = i;
+            iov.clear();
+            do {
+                struct iovec v = { taken[j]->second.data.data(), BLOCK_SIZE };
+                iov.push_back(v);
+                j++;
+            } while (j < taken.size() && j - i < IOV_MAX &&
+                     taken[j]->first.second == taken[j - 1]->first.second + 1);
+            unsigned block_no = taken[i]->first.second;
+            ssize_t bytes = (ssize_t)(j - i) * BLOCK_SIZE;
+            if (pwritev(diskfd, iov.data(), iov.size(), (off_t)block_no * BLOCK_SIZE) != bytes) {
+                std::cout << "Disk::write_back - ERROR: Can't write blocks (" << block_no << ", " << j - i << ")\n";
+                written = i;
+                ret = -1;
+                break;
+            }
+            i = j;
+        }
+
+        // 3) drop what was written
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            for (size_t i = 0; i < written; i++) {
+                std::map<unsigned, unsigned>::iterator n = newest.find(taken[i]->first.second);
+                if (n->second == taken[i]->first.first)
+                    newest.erase(n);
+                if (spare.size() < dirty_limit)
+                    spare.push_back(std::move(taken[i]->second.data));
+                dirty.erase(taken[i]);
+            }
+            dirty_count.store(dirty.size(), std::memory_order_release);
+            if (dirty.size() <= dirty_limit - dirty_background)
+                drained.notify_all();
+        }
+    }
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    failed = ret != 0;
+    if (failed)
+        drained.notify_all(); // writers waiting for room stop waiting
+    return ret;
+}
+
+// The background writeback thread: wakes up every writeback_interval, or
+// when dirty_background blocks are dirty, and then writes back everything
+// (over the threshold) or the epochs up to the newest one with a block
+// dirty for longer than dirty_expire. After a failure it waits an interval
+// before it tries again.
+void
+Disk::flusher_loop()
+{
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    while (!stopping) {
+        if (failed || dirty.size() < dirty_background)
+            flusher_wake.wait_for(lock, writeback_interval);
+        if (stopping || dirty.empty())
+            continue;
+        unsigned last = ~0u;
+        if (dirty.size() < dirty_background) {
+            clock_type::time_point expired = clock_type::now() - dirty_expire;
+            bool any = false;
+            std::map<dirty_key, dirty_block>::iterator it = dirty.begin();
+            for (; it != dirty.end(); ++it) {
+                if (it->second.since <= expired) {
+                    last = it->first.first;
+                    any = true;
+                }
+            }
+            if (!any)
+                continue;
+        }
+        lock.unlock();
+        {
+            std::lock_guard<std::mutex> io(io_mutex);
+            write_back(last);
+        }
+        lock.lock();
+    }
+}
+
+// true if one of the blocks is dirty
+bool
+Disk::cached(unsigned block_no, unsigned count)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    std::map<unsigned, unsigned>::iterator n = newest.lower_bound(block_no);
+    return n != newest.end() && n->first < block_no + count;
+}
+
+// writes back the epochs up to the newest one holding a dirty block among
+// count consecutive ones, so that the mapping shows them
+int
+Disk::write_back_range(unsigned block_no, unsigned count)
+{
+    if (block_no >= no_blocks || count > no_blocks - block_no)
+        return -1;
+    std::lock_guard<std::mutex> io(io_mutex);
+    bool any = false;
+    unsigned last = 0;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        std::map<unsigned, unsigned>::iterator n = newest.lower_bound(block_no);
+        for (; n != newest.end() && n->first < block_no + count; ++n) {
+            last = std::max(last, n->second);
+            any = true;
+        }
+    }
+    return any ? write_back(last) : 0;
+}
+
+// writes back every dirty block and flushes the image to the device
+int
+Disk::sync()
+{
+    int ret;
+    {
+        std::lock_guard<std::mutex> io(io_mutex);
+        ret = write_back(~0u);
+    }
+    if (fdatasync(diskfd) == -1)
+        ret = -1;
+    return ret;
+}
+
+// with the cache off every write goes straight to the image
+void
+Disk::set_writeback(bool on)
+{
+    if (!on)
+        sync();
+    writeback_on = on;
+}
@@ -1,6 +1,13 @@
 #include <iostream>
 #include <fstream>
 #include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #ifndef __DISK_H__
 #define __DISK_H__
@@ -9,12 +16,62 @@
 #define BLOCK_SIZE 4096
 #define DEBUG false
 
+// Writes go to a write-back cache of dirty blocks that a background thread
+// writes to the image. It starts once dirty_background blocks are dirty or
+// a block has been dirty for dirty_expire; a writer that finds dirty_limit
+// blocks dirty waits until dirty_background of them are written. Reads see
+// the cache first, and sync() (or the destructor) writes everything back.
+//
+// barrier() orders the writes: those before it reach the image before any
+// after it, as with synchronous writes. The writes between two barriers
+// form an epoch, written back in block order with neighbours merged into
+// one I/O. A block written again in a later epoch keeps its older copy
+// until that epoch is written back; epochs before the current one do not
+// change any more.
 class Disk {
 private:
-    std::fstream diskfile;
+    typedef std::chrono::steady_clock clock_type;
+    struct dirty_block {
+        std::vector<uint8_t> data;
+        clock_type::time_point since; // first dirtied in its epoch
+    };
+    // an epoch and a block number; sorted, the keys give the write-back order
+    typedef std::pair<unsigned, unsigned> dirty_key;
+    // positional I/O on a plain descriptor, so several threads may read at once
+    int diskfd;
+    // the image mapped read-only (NULL if mmap failed); it shares the page
+    // cache with pread/pwrite, so it shows what was written back
+    const uint8_t *mapped;
     const unsigned no_blocks = 2048;
     const unsigned disk_size = BLOCK_SIZE * no_blocks;
+    const unsigned dirty_background = no_blocks / 16;
+    const unsigned dirty_limit = no_blocks / 4;
+    const std::chrono::milliseconds dirty_expire{500};
+    const std::chrono::milliseconds writeback_interval{100};
+
+    // cache: the dirty copies, and the epoch of the newest copy of every
+    // dirty block; io_mutex is held by whoever writes them back
+    std::mutex cache_mutex, io_mutex;
+    std::condition_variable flusher_wake, drained;
+    std::map<dirty_key, dirty_block> dirty;
+    std::map<unsigned, unsigned> newest;
+    std::vector<std::vector<uint8_t> > spare; // buffers of written copies
+    unsigned epoch;     // of the writes now
+    bool epoch_written; // a write went to it
+    std::atomic<unsigned> dirty_count;
+    std::atomic<bool> writeback_on;
+    bool stopping;
+    bool failed; // the last write-back failed; retried after an interval
+    std::thread flusher;
+
     bool disk_file_exists (const std::string& name);
+    int write_through(unsigned block_no, unsigned count, const uint8_t *blks);
+    int write_cached(unsigned block_no, unsigned count, const uint8_t *blks);
+    // writes back the epochs up to last, in order; called with io_mutex
+    // held. A block that can't be written stays dirty and ends the write-back
+    int write_back(unsigned last);
+    void flusher_loop();
+    bool cached(unsigned block_no, unsigned count);
 public:
     Disk();
     ~Disk();
@@ -22,8 +79,31 @@ public:
     unsigned get_disk_size() { return disk_size; }
     // writes one block to the disk
     int write(unsigned block_no, uint8_t *blk);
-    // reads one block from the disk
+    // reads one block from the disk; safe to call from several threads
     int read(unsigned block_no, uint8_t *blk);
+    // writes / reads count consecutive blocks with a single I/O
+    int write_blocks(unsigned block_no, unsigned count, uint8_t *blks);
+    int read_blocks(unsigned block_no, unsigned count, uint8_t *blks);
+    // writes every dirty block back and waits for the image to have them
+    int sync();
+    // the writes so far reach the image before any that follow
+    void barrier();
+    // switches the write-back cache on (default) or off (after a sync)
+    void set_writeback(bool on);
+    // the blocks in the read-only mapping of the image, NULL if there is
+    // none or one of them is dirty (write_back_range() makes it current)
+    const uint8_t *map(unsigned block_no, unsigned count = 1)
+    {
+        if (!mapped || block_no >= no_blocks || count > no_blocks - block_no)
+            return NULL;
+        if (dirty_count.load(std::memory_order_acquire) && cached(block_no, count))
+            return NULL;
+        return mapped + (size_t)block_no * BLOCK_SIZE;
+    }
+    bool mappable() { return mapped != NULL; }
+    // writes back the dirty blocks among count consecutive ones, and what
+    // was written before them
+    int write_back_range(unsigned block_no, unsigned count);
 };
 
 #endif // __DISK_H__
@@ -0,0 +1,336 @@
+#include <cstring>
+#include "fatscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FATSCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// largest value a next pointer may hold in a FAT of n entries
+static inline int16_t
+lastBlock(int n)
+{
+    return n - 1 > INT16_MAX ? INT16_MAX : n - 1;
+}
+
+// ---------------------------------------------------------------------------
+// scalar
+// ---------------------------------------------------------------------------
+
+static int
+scalarFind(const int16_t *fat, int n, int from, int16_t value)
+{
+    for (int i = from; i < n; i++) {
+        if (fat[i] == value)
+            return i;
+    }
+    return -1;
+}
+
+static int
+scalarOther(const int16_t *fat, int n, int from, int16_t value)
+{
+    for (int i = from; i < n; i++) {
+        if (fat[i] != value)
+            return i;
+    }
+    return -1;
+}
+
+static int
+scalarCount(const int16_t *fat, int n, int16_t value)
+{
+    int count = 0;
+    for (int i = 0; i < n; i++)
+        count += fat[i] == value;
+    return count;
+}
+
+static int
+scalarInvalid(const int16_t *fat, int n, int from)
+{
+    int16_t last = lastBlock(n);
+    for (int i = from; i < n; i++) {
+        if (fat[i] < FAT_SNAP || fat[i] > last || fat[i] == FAT_BLOCK)
+            return i;
+    }
+    return -1;
+}
+
+#ifdef FATSCAN_X86
+
+// ---------------------------------------------------------------------------
+// SSE2: sixteen entries per step, packed into one byte mask
+// ---------------------------------------------------------------------------
+
+// bit k set where entry i + k compares true; a and b cover entries 0-7, 8-15
+static inline int
+mask16(__m128i a, __m128i b)
+{
+    return _mm_movemask_epi8(_mm_packs_epi16(a, b));
+}
+
+static inline __m128i
+load8(const int16_t *p)
+{
+    return _mm_loadu_si128((const __m128i *)p);
+}
+
+static int
+sse2Find(const int16_t *fat, int n, int from, int16_t value)
+{
+    const __m128i want = _mm_set1_epi16(value);
+    int i = from;
+    for (; i + 16 <= n; i += 16) {
+        int hits = mask16(_mm_cmpeq_epi16(load8(fat + i), want),
+                          _mm_cmpeq_epi16(load8(fat + i + 8), want));
+        if (hits)
+            return i + __builtin_ctz(hits);
+    }
+    return scalarFind(fat, n, i, value);
+}
+
+static int
+sse2Other(const int16_t *fat, int n, int from, int16_t value)
+{
+    const __m128i want = _mm_set1_epi16(value);
+    int i = from;
+    for (; i + 16 <= n; i += 16) {
+        int hits = ~mask16(_mm_cmpeq_epi16(load8(fat + i), want),
+                           _mm_cmpeq_epi16(load8(fat + i + 8), want)) & 0xffff;
+        if (hits)
+            return i + __builtin_ctz(hits);
+    }
+    return scalarOther(fat, n, i, value);
+}
+
+static int
+sse2Count(const int16_t *fat, int n, int16_t value)
+{
+    const __m128i want = _mm_set1_epi16(value);
+    int count = 0, i = 0;
+    while (i + 16 <= n) {
+        // a lane gains at most 2 per step; sum up before it can overflow
+        int end = n - i > 16 * 16383 ? i + 16 * 16383 : n;
+        __m128i acc = _mm_setzero_si128();
+        for (; i + 16 <= end; i += 16) {
+            acc = _mm_sub_epi16(acc, _mm_cmpeq_epi16(load8(fat + i), want));
+            acc = _mm_sub_epi16(acc, _mm_cmpeq_epi16(load8(fat + i + 8), want));
+        }
+        __m128i sum = _mm_madd_epi16(acc, _mm_set1_epi16(1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+        count += _mm_cvtsi128_si32(sum);
+    }
+    return count + scalarCount(fat + i, n - i, value);
+}
+
+static inline __m128i
+sse2Bad8(__m128i v, __m128i lo, __m128i hi, __m128i fat_block)
+{
+    __m128i bad = _mm_or_si128(_mm_cmplt_epi16(v, lo), _mm_cmpgt_epi16(v, hi));
+    return _mm_or_si128(bad, _mm_cmpeq_epi16(v, fat_block));
+}
+
+static int
+sse2Invalid(const int16_t *fat, int n, int from)
+{
+    const __m128i lo = _mm_set1_epi16(FAT_SNAP);
+    const __m128i hi = _mm_set1_epi16(lastBlock(n));
+    const __m128i fat_block = _mm_set1_epi16(FAT_BLOCK);
+    int i = from;
+    for (; i + 16 <= n; i += 16) {
+        int hits = mask16(sse2Bad8(load8(fat + i), lo, hi, fat_block),
+                          sse2Bad8(load8(fat + i + 8), lo, hi, fat_block));
+        if (hits)
+            return i + __builtin_ctz(hits);
+    }
+    return scalarInvalid(fat, n, i);
+}
+
+// ---------------------------------------------------------------------------
+// AVX2: thirty-two entries per step
+// ---------------------------------------------------------------------------
+
+// packs works per 128-bit lane; the permute puts the bytes back in order
+__attribute__((target("avx2"))) static inline uint32_t
+mask32(__m256i a, __m256i b)
+{
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xd8);
+    return (uint32_t)_mm256_movemask_epi8(packed);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+load16(const int16_t *p)
+{
+    return _mm256_loadu_si256((const __m256i *)p);
+}
+
+__attribute__((target("avx2"))) static int
+avx2Find(const int16_t *fat, int n, int from, int16_t value)
+{
+    const __m256i want = _mm256_set1_epi16(value);
+    int i = from;
+    for (; i + 32 <= n; i += 32) {
+        uint32_t hits = mask32(_mm256_cmpeq_epi16(load16(fat + i), want),
+                               _mm256_cmpeq_epi16(load16(fat + i + 16), want));
+        if (hits)
+            return i + __builtin_ctz(hits);
+    }
+    return scalarFind(fat, n, i, value);
+}
+
+__attribute__((target("avx2"))) static int
+avx2Other(const int16_t *fat, int n, int from, int16_t value)
+{
+    const __m256i want = _mm256_set1_epi16(value);
+    int i = from;
+    for (; i + 32 <= n; i += 32) {
+        uint32_t hits = ~mask32(_mm256_cmpeq_epi16(load16(fat + i), want),
+                                _mm256_cmpeq_epi16(load16(fat + i + 16), want));
+        if (hits)
+            return i + __builtin_ctz(hits);
+    }
+    return scalarOther(fat, n, i, value);
+}
+
+__attribute__((target("avx2"))) static int
+avx2Count(const int16_t *fat, int n, int16_t value)
+{
+    const __m256i want = _mm256_set1_epi16(value);
+    int count = 0, i = 0;
+    while (i + 32 <= n) {
+        int end = n - i > 32 * 16383 ? i + 32 * 16383 : n;
+        __m256i acc = _mm256_setzero_si256();
+        for (; i + 32 <= end; i += 32) {
+            acc = _mm256_sub_epi16(acc, _mm256_cmpeq_epi16(load16(fat + i), want));
+            acc = _mm256_sub_epi16(acc, _mm256_cmpeq_epi16(load16(fat + i + 16), want));
+        }
+        __m256i wide = _mm256_madd_epi16(acc, _mm256_set1_epi16(1));
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(wide), _mm256_extracti128_si256(wide, 1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+        count += _mm_cvtsi128_si32(sum);
+    }
+    return count + scalarCount(fat + i, n - i, value);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+avx2Bad16(__m256i v, __m256i lo, __m256i hi, __m256i fat_block)
+{
+    __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi16(lo, v), _mm256_cmpgt_epi16(v, hi));
+    return _mm256_or_si256(bad, _mm256_cmpeq_epi16(v, fat_block));
+}
+
+__attribute__((target("avx2"))) static int
+avx2Invalid(const int16_t *fat, int n, int from)
+{
+    const __m256i lo = _mm256_set1_epi16(FAT_SNAP);
+    const __m256i hi = _mm256_set1_epi16(lastBlock(n));
+    const __m256i fat_block = _mm256_set1_epi16(FAT_BLOCK);
+    int i = from;
+    for (; i + 32 <= n; i += 32) {
+        uint32_t hits = mask32(avx2Bad16(load16(fat + i), lo, hi, fat_block),
+                               avx2Bad16(load16(fat + i + 16), lo, hi, fat_block));
+        if (hits)
+            return i + __builtin_ctz(hits);
+    }
+    return scalarInvalid(fat, n, i);
+}
+
+#endif // FATSCAN_X86
+
+// ---------------------------------------------------------------------------
+// run-time dispatch
+// ---------------------------------------------------------------------------
+
+struct fat_kernels {
+    const char *name;
+    int (*find)(const int16_t *, int, int, int16_t);
+    int (*find_other)(const int16_t *, int, int, int16_t);
+    int (*count)(const int16_t *, int, int16_t);
+    int (*find_invalid)(const int16_t *, int, int);
+};
+
+static const fat_kernels kernel_table[] = {
+#ifdef FATSCAN_X86
+    { "avx2", avx2Find, avx2Other, avx2Count, avx2Invalid },
+    { "sse2", sse2Find, sse2Other, sse2Count, sse2Invalid },
+#endif
+    { "scalar", scalarFind, scalarOther, scalarCount, scalarInvalid },
+};
+static const int no_kernels = sizeof(kernel_table) / sizeof(kernel_table[0]);
+
+static bool
+supported(const fat_kernels& k)
+{
+#ifdef FATSCAN_X86
+    __builtin_cpu_init();
+    if (std::strcmp(k.name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (std::strcmp(k.name, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+#endif
+    return true;
+}
+
+static const fat_kernels *
+best()
+{
+    for (int i = 0; i < no_kernels; i++) {
+        if (supported(kernel_table[i]))
+            return &kernel_table[i];
+    }
+    return &kernel_table[no_kernels - 1];
+}
+
+// the kernels in use: the first supported entry of kernel_table, unless
+// fat_scan_use() chose others
+static const fat_kernels *&
+active()
+{
+    static const fat_kernels *k = best();
+    return k;
+}
+
+int
+fat_find(const int16_t *fat, int n, int from, int16_t value)
+{
+    return active()->find(fat, n, from, value);
+}
+
+int
+fat_find_other(const int16_t *fat, int n, int from, int16_t value)
+{
+    return active()->find_other(fat, n, from, value);
+}
+
+int
+fat_count(const int16_t *fat, int n, int16_t value)
+{
+    return active()->count(fat, n, value);
+}
+
+int
+fat_find_invalid(const int16_t *fat, int n, int from)
+{
+    return active()->find_invalid(fat, n, from);
+}
+
+const char *
+fat_scan_kernels()
+{
+    return active()->name;
+}
+
+bool
+fat_scan_use(const char *name)
+{
+    for (int i = 0; i < no_kernels; i++) {
+        if (std::strcmp(kernel_table[i].name, name) == 0 && supported(kernel_table[i])) {
+            active() = &kernel_table[i];
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,27 @@
+#include <cstdint>
+#include "fs.h"
+
+#ifndef __FATSCAN_H__
+#define __FATSCAN_H__
+
+// Scans over the int16_t entries of the FAT. Like the directory scans in
+// dirscan.h every function has a scalar, an SSE2 and an AVX2 version, picked
+// at run time. The find functions return the index of the first matching
+// entry at or after from, or -1.
+
+// entry equal to value (FAT_FREE finds free blocks)
+int fat_find(const int16_t *fat, int n, int from, int16_t value);
+// entry not equal to value (the end of a run of free blocks)
+int fat_find_other(const int16_t *fat, int n, int from, int16_t value);
+// number of entries equal to value
+int fat_count(const int16_t *fat, int n, int16_t value);
+// entry that is neither FAT_FREE, FAT_EOF, FAT_USED, FAT_SNAP nor a block in
+// [2, n)
+int fat_find_invalid(const int16_t *fat, int n, int from);
+
+// name of the kernels in use ("avx2", "sse2" or "scalar")
+const char *fat_scan_kernels();
+// switches to the named kernels; false if the CPU lacks them
+bool fat_scan_use(const char *name);
+
+#endif // __FATSCAN_H__
@@ -1,52 +1,60 @@
 #include <iostream>
 #include "fs.h"
+#include "lz.h"
+#include "dirscan.h"
+#include "fatscan.h"
 #include <vector>
 #include <string>
 #include <cstring>
 #include <sstream>
+#include <algorithm>
+#include <mutex>
+#include <set>
+#include <iterator>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 // ls lists the content in the current directory (files and sub-directories)
 #include <iomanip> // högst upp i filen
 
 // FS implementation notes:
-// - Directory entries live in one block; max entries = BLOCK_SIZE / sizeof(dir_entry)
+// - A directory lives in one block; plain blocks hold BLOCK_SIZE / sizeof(dir_entry)
+//   entries, compact ones (FEAT_COMPACT_DIRS) up to MAX_DIR_ENTRIES
 // - Names are stored in dir_entry::file_name with max length 55 (+ '\0')
 // - FAT uses 16-bit entries; FAT_FREE and FAT_EOF mark free/end-of-chain
 
 static constexpr int MAX_NAME_LEN = 55;
-static constexpr int MAX_DIR_ENTRIES = BLOCK_SIZE / sizeof(dir_entry);
+static constexpr int PLAIN_DIR_ENTRIES = BLOCK_SIZE / sizeof(dir_entry);
+static constexpr int MAX_DIR_ENTRIES = 256; // slots of a directory in memory
+static constexpr int GROUP_BLOCKS = 256; // blocks per allocation group
 
+// Both scans use the vectorized kernels from dirscan.cpp
 static int findEntryIndex(dir_entry *dir, int max, const std::string &name)
 {
-    for (int i = 0; i < max; i++)
-    {
-        if (dir[i].file_name[0] != '\0' &&
-            std::strcmp(dir[i].file_name, name.c_str()) == 0)
-        {
-            return i;
-        }
-    }
-    return -1;
+    return dir_find_name(dir, max, name.c_str());
 }
 
 static int findFreeIndex(dir_entry *dir, int max)
 {
-    for (int i = 0; i < max; i++)
-    {
-        if (dir[i].file_name[0] == '\0')
-            return i;
-    }
-    return -1;
+    return dir_find_free(dir, max);
 }
 
 static bool isFile(const dir_entry &e)
 {
-    return e.type == TYPE_FILE;
+    return (e.type & TYPE_MASK) == TYPE_FILE;
 }
 
 static bool isDir(const dir_entry &e)
 {
-    return e.type == TYPE_DIR;
+    return (e.type & TYPE_MASK) == TYPE_DIR;
+}
+
+static bool hasInode(const dir_entry &e)
+{
+    return (e.type & TYPE_INODE) != 0;
 }
 
 // Helper function that splits a file system path into individual directory or file names.
@@ -55,17 +63,319 @@ static bool isDir(const dir_entry &e)
 static std::vector<std::string> splitPath(const std::string &path)
 {
     std::vector<std::string> parts;
-    std::stringstream ss(path);
-    std::string token;
-
-    while (std::getline(ss, token, '/'))
+    size_t start = 0;
+    while (start < path.size())
     {
-        if (!token.empty())
-            parts.push_back(token);
+        size_t end = path.find('/', start);
+        if (end == std::string::npos)
+            end = path.size();
+        if (end > start)
+            parts.push_back(path.substr(start, end - start));
+        start = end + 1;
     }
     return parts;
 }
 
+// ---------------------------------------------------------------------------
+// Directory blocks
+//
+// In memory a directory is an array of MAX_DIR_ENTRIES slots. On plain
+// volumes its block holds the first PLAIN_DIR_ENTRIES of them as they are.
+// FEAT_COMPACT_DIRS volumes store only the used slots, as variable-length
+// records behind a header:
+//
+//   header: uint32 magic | uint16 records | uint16 record bytes |
+//           512-bit summary with bit (hash(name) % 512) set for every name
+//   record: uint8 slot | uint8 type | uint8 access_rights | uint8 name length |
+//           uint16 first_blk | uint32 size | the name without '\0'
+//
+// With names of typical length a block holds several times the 64 entries of
+// the plain format; how many depends on the name lengths, so freeSlot()
+// checks the room left. Lookups test the summary before the records. The
+// records are written in name order, a sorted run that ls pages through
+// without decoding or sorting the rest. Blocks are recognized by their
+// magic, so plain blocks stay readable.
+// ---------------------------------------------------------------------------
+
+static constexpr uint32_t DIR_MAGIC = 0x32524944; // "DIR2"
+static constexpr int DIR_SUMMARY_BITS = 512;
+static constexpr int DIR_RECORD = 10; // record without the name
+
+struct dir_block_header {
+    uint32_t magic;
+    uint16_t records;
+    uint16_t bytes;
+    uint64_t summary[DIR_SUMMARY_BITS / 64];
+};
+
+// FNV-1a over the name, reduced to a summary bit
+static int summaryBit(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h % DIR_SUMMARY_BITS;
+}
+
+static size_t nameLen(const dir_entry &e)
+{
+    return strnlen(e.file_name, MAX_NAME_LEN);
+}
+
+// byte order of names, as strcmp
+static int nameCmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int c = std::memcmp(a, b, std::min(alen, blen));
+    return c != 0 ? c : (alen < blen ? -1 : alen > blen);
+}
+
+static void decodeRecord(const uint8_t *p, dir_entry &e)
+{
+    std::memset(&e, 0, sizeof(e));
+    e.type = p[1];
+    e.access_rights = p[2];
+    std::memcpy(&e.first_blk, p + 4, 2);
+    std::memcpy(&e.size, p + 6, 4);
+    std::memcpy(e.file_name, p + DIR_RECORD, p[3]);
+}
+
+// bytes the used slots of dir take in a compact block
+static int compactSize(const dir_entry *dir)
+{
+    int bytes = sizeof(dir_block_header);
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        if (dir[i].file_name[0] != '\0')
+            bytes += DIR_RECORD + nameLen(dir[i]);
+    return bytes;
+}
+
+void FS::readDir(int blk, dir_entry *dir)
+{
+    uint8_t buf[BLOCK_SIZE];
+    disk.read(blk, buf);
+    dir_block_header h;
+    std::memcpy(&h, buf, sizeof(h));
+
+    std::memset(dir, 0, MAX_DIR_ENTRIES * sizeof(dir_entry));
+    if (!hasFeature(FEAT_COMPACT_DIRS) || h.magic != DIR_MAGIC)
+    {
+        std::memcpy(dir, buf, BLOCK_SIZE);
+        return;
+    }
+
+    // a damaged record ends the directory; fsck finds the blocks of the
+    // entries behind it unreferenced
+    const uint8_t *p = buf + sizeof(h);
+    const uint8_t *end = p + std::min<int>(h.bytes, BLOCK_SIZE - sizeof(h));
+    for (int r = 0; r < h.records && end - p >= DIR_RECORD; r++)
+    {
+        int len = p[3];
+        if (len == 0 || len > MAX_NAME_LEN || end - p < DIR_RECORD + len)
+            break;
+        decodeRecord(p, dir[p[0]]);
+        p += DIR_RECORD + len;
+    }
+}
+
+// Like all metadata, a directory block reaches the disk after what was
+// written before it and before what follows (Disk::barrier()).
+void FS::writeDir(int blk, const dir_entry *dir)
+{
+    disk.barrier();
+    if (!hasFeature(FEAT_COMPACT_DIRS))
+    {
+        disk.write(blk, (uint8_t *)dir);
+        disk.barrier();
+        return;
+    }
+
+    uint8_t buf[BLOCK_SIZE] = {0};
+    dir_block_header h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic = DIR_MAGIC;
+    std::vector<int> order;
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        if (dir[i].file_name[0] != '\0')
+            order.push_back(i);
+    std::sort(order.begin(), order.end(), [dir](int a, int b)
+    {
+        return std::strncmp(dir[a].file_name, dir[b].file_name, MAX_NAME_LEN) < 0;
+    });
+
+    uint8_t *p = buf + sizeof(h);
+    for (size_t k = 0; k < order.size(); k++)
+    {
+        int i = order[k];
+        const dir_entry &e = dir[i];
+        size_t len = nameLen(e);
+        if (p + DIR_RECORD + len > buf + BLOCK_SIZE)
+            break; // freeSlot() keeps this from happening
+        p[0] = i;
+        p[1] = e.type;
+        p[2] = e.access_rights;
+        p[3] = len;
+        std::memcpy(p + 4, &e.first_blk, 2);
+        std::memcpy(p + 6, &e.size, 4);
+        std::memcpy(p + DIR_RECORD, e.file_name, len);
+        p += DIR_RECORD + len;
+
+        int bit = summaryBit(e.file_name, len);
+        h.summary[bit / 64] |= (uint64_t)1 << (bit % 64);
+        h.records++;
+    }
+    h.bytes = p - (buf + sizeof(h));
+    std::memcpy(buf, &h, sizeof(h));
+    disk.write(blk, buf);
+    disk.barrier();
+}
+
+// Finds name in directory block blk without decoding the whole block. A
+// compact block is read through the mapping of the image and skipped at
+// once when its summary rules the name out.
+int FS::findInDir(int blk, const std::string &name, dir_entry &entry)
+{
+    uint8_t buf[BLOCK_SIZE];
+    const uint8_t *b = disk.map(blk);
+    if (!b)
+    {
+        disk.read(blk, buf);
+        b = buf;
+    }
+    dir_block_header h;
+    std::memcpy(&h, b, sizeof(h));
+
+    if (!hasFeature(FEAT_COMPACT_DIRS) || h.magic != DIR_MAGIC)
+    {
+        dir_entry dir[PLAIN_DIR_ENTRIES];
+        std::memcpy(dir, b, BLOCK_SIZE);
+        int idx = findEntryIndex(dir, PLAIN_DIR_ENTRIES, name);
+        if (idx != -1)
+            entry = dir[idx];
+        return idx;
+    }
+
+    if (name.empty() || name.size() > MAX_NAME_LEN)
+        return -1;
+    int bit = summaryBit(name.data(), name.size());
+    if (!(h.summary[bit / 64] & ((uint64_t)1 << (bit % 64))))
+        return -1;
+
+    const uint8_t *p = b + sizeof(h);
+    const uint8_t *end = p + std::min<int>(h.bytes, BLOCK_SIZE - sizeof(h));
+    for (int r = 0; r < h.records && end - p >= DIR_RECORD; r++)
+    {
+        size_t len = p[3];
+        if (len == 0 || len > MAX_NAME_LEN || end - p < DIR_RECORD + (int)len)
+            break;
+        if (len == name.size() && std::memcmp(p + DIR_RECORD, name.data(), len) == 0)
+        {
+            decodeRecord(p, entry);
+            return p[0];
+        }
+        p += DIR_RECORD + len;
+    }
+    return -1;
+}
+
+// A free slot for a new entry called name, or -1 if the directory is full:
+// out of slots, or on compact volumes out of room for the record.
+int FS::freeSlot(dir_entry *dir, const std::string &name)
+{
+    if (!hasFeature(FEAT_COMPACT_DIRS))
+        return findFreeIndex(dir, PLAIN_DIR_ENTRIES);
+
+    int len = std::min<int>(name.size(), MAX_NAME_LEN);
+    if (compactSize(dir) + DIR_RECORD + len > BLOCK_SIZE)
+        return -1;
+    return findFreeIndex(dir, MAX_DIR_ENTRIES);
+}
+
+// One page of directory block blk: up to limit entries (0: all) that sort
+// after the entry called after, and whether more follow. In name order a
+// compact block is read in place from its sorted run, decoding only the
+// page; otherwise the rest is sorted only as far as the page reaches.
+// Returns -1 if sorting by size and after is not in the directory.
+int FS::listPage(int blk, int order, const std::string &after, int limit,
+                 std::vector<dir_entry> &page, bool &more)
+{
+    page.clear();
+    more = false;
+    if (limit <= 0)
+        limit = MAX_DIR_ENTRIES;
+
+    // 1) name order from the sorted run; blocks written unsorted fall through
+    const uint8_t *b = disk.map(blk);
+    dir_block_header h;
+    if (b)
+        std::memcpy(&h, b, sizeof(h));
+    if (order == LS_NAME && b && hasFeature(FEAT_COMPACT_DIRS) && h.magic == DIR_MAGIC)
+    {
+        const uint8_t *p = b + sizeof(h);
+        const uint8_t *end = p + std::min<int>(h.bytes, BLOCK_SIZE - sizeof(h));
+        const uint8_t *prev = NULL;
+        bool sorted = true;
+        for (int r = 0; r < h.records && end - p >= DIR_RECORD; r++)
+        {
+            size_t len = p[3];
+            if (len == 0 || len > MAX_NAME_LEN || end - p < DIR_RECORD + (int)len)
+                break;
+            if (prev && nameCmp((const char *)prev + DIR_RECORD, prev[3], (const char *)p + DIR_RECORD, len) >= 0)
+            {
+                sorted = false;
+                break;
+            }
+            if (!more && nameCmp((const char *)p + DIR_RECORD, len, after.data(), after.size()) > 0)
+            {
+                if ((int)page.size() == limit)
+                    more = true;
+                else
+                {
+                    page.push_back(dir_entry());
+                    decodeRecord(p, page.back());
+                }
+            }
+            prev = p;
+            p += DIR_RECORD + len;
+        }
+        if (sorted)
+            return 0;
+        page.clear();
+        more = false;
+    }
+
+    // 2) the entries behind the cursor, sorted up to the page size
+    dir_entry dir[MAX_DIR_ENTRIES];
+    readDir(blk, dir);
+    auto before = [order](const dir_entry *x, const dir_entry *y)
+    {
+        if (order == LS_SIZE && x->size != y->size)
+            return x->size < y->size;
+        return std::strncmp(x->file_name, y->file_name, MAX_NAME_LEN) < 0;
+    };
+    dir_entry cursor;
+    std::memset(&cursor, 0, sizeof(cursor));
+    if (order == LS_SIZE && !after.empty())
+    {
+        int idx = findEntryIndex(dir, MAX_DIR_ENTRIES, after);
+        if (idx == -1)
+            return -1;
+        cursor = dir[idx];
+    }
+    else
+        std::strncpy(cursor.file_name, after.c_str(), MAX_NAME_LEN);
+
+    std::vector<const dir_entry *> rest;
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        if (dir[i].file_name[0] != '\0' && (after.empty() || before(&cursor, &dir[i])))
+            rest.push_back(&dir[i]);
+    size_t n = std::min<size_t>(rest.size(), limit);
+    std::partial_sort(rest.begin(), rest.begin() + n, rest.end(), before);
+    more = rest.size() > n;
+    for (size_t k = 0; k < n; k++)
+        page.push_back(*rest[k]);
+    return 0;
+}
+
 // Resolves a given absolute or relative path by traversing the file system.
 // On success, it returns the block number of the parent directory and the
 // final file or directory name. Returns false if the path is invalid.
@@ -81,29 +391,17 @@ bool FS::resolvePath(const std::string &path,
     if (parts.empty())
         return false; // keeps behavior safe for "/" cases
 
-    int current = (path[0] == '/') ? ROOT_BLOCK : cwd_blk;
+    int current = (path[0] == '/') ? root_blk : cwd_blk;
 
     // Traverse all components except the last => find the parent directory block
     for (int i = 0; i < (int)parts.size() - 1; i++)
     {
-        dir_entry dir[MAX_DIR_ENTRIES];
-        disk.read(current, (uint8_t *)dir);
-
-        if (parts[i] == "..")
-        {
-            int idx = findEntryIndex(dir, MAX_DIR_ENTRIES, "..");
-            if (idx == -1)
-                return false;
-
-            current = dir[idx].first_blk;
-            continue;
-        }
-
-        int idx = findEntryIndex(dir, MAX_DIR_ENTRIES, parts[i]);
-        if (idx == -1 || dir[idx].type != TYPE_DIR)
+        dir_entry e;
+        int idx = findInDir(current, parts[i], e);
+        if (idx == -1 || (parts[i] != ".." && e.type != TYPE_DIR))
             return false;
 
-        current = dir[idx].first_blk;
+        current = e.first_blk;
     }
 
     parent_block = current;
@@ -111,865 +409,5061 @@ bool FS::resolvePath(const std::string &path,
     return true;
 }
 
-FS::FS()
+// Number of data blocks a file of the given size occupies. Every file owns at
+// least one block so that first_blk always refers to a valid chain.
+static int blocksFor(int size)
 {
-    std::cout << "FS::FS()... Creating file system\n";
+    int n = ((long)size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    return n > 0 ? n : 1;
 }
 
-FS::~FS()
+// Allocates n free blocks first-fit from the in-memory FAT, searching from
+// goal to the end and then from the start. The blocks are not marked as
+// used; the caller links them. Returns false if the disk is too full.
+bool FS::allocBlocks(int n, std::vector<int> &blocks, int goal)
 {
+    blocks.clear();
+    int no_blocks = disk.get_no_blocks();
+    if (goal < 2 || goal >= no_blocks)
+        goal = 2;
+    int ranges[2][2] = { { goal, no_blocks }, { 2, goal } };
+    for (int r = 0; r < 2; r++)
+        for (int i = fat_find(fat, ranges[r][1], ranges[r][0], FAT_FREE);
+             i != -1 && (int)blocks.size() < n; i = fat_find(fat, ranges[r][1], i + 1, FAT_FREE))
+            blocks.push_back(i);
+    return (int)blocks.size() >= n;
 }
 
-// formats the disk, i.e., creates an empty file system
-int FS::format()
+// Block groups: the volume is divided into groups of GROUP_BLOCKS blocks.
+// The data of a file is looked for from its directory's block on, so a
+// directory and its files share a group and spill over into the next one
+// when it fills. A new directory stays in its parent's group while that has
+// at least 3/4 of the average share of free blocks; directories in the root, and
+// those whose parent's group is crowded, go to the group with the most
+// free blocks, which keeps unrelated trees apart.
+int FS::dirGoal(int parent_blk)
 {
-
-    for (int i = 0; i < BLOCK_SIZE / 2; i++)
+    int no_blocks = disk.get_no_blocks();
+    int groups = (no_blocks + GROUP_BLOCKS - 1) / GROUP_BLOCKS;
+    std::vector<int> free_blks(groups);
+    int total = 0;
+    for (int g = 0; g < groups; g++)
     {
-        fat[i] = FAT_FREE;
+        int start = std::max(2, g * GROUP_BLOCKS);
+        int end = std::min(no_blocks, (g + 1) * GROUP_BLOCKS);
+        free_blks[g] = fat_count(fat + start, end - start, FAT_FREE);
+        total += free_blks[g];
     }
 
-    fat[ROOT_BLOCK] = FAT_EOF;
-    fat[FAT_BLOCK] = FAT_EOF;
-
-    disk.write(FAT_BLOCK, (uint8_t *)fat);
-    uint8_t empty_dir[BLOCK_SIZE] = {0};
-    disk.write(ROOT_BLOCK, empty_dir);
-    cwd_blk = ROOT_BLOCK;
-
-    return 0;
+    int parent = parent_blk / GROUP_BLOCKS;
+    if (parent_blk != root_blk && parent < groups && 4 * free_blks[parent] * groups >= 3 * total)
+        return parent_blk;
+    int best = std::max_element(free_blks.begin(), free_blks.end()) - free_blks.begin();
+    return std::max(2, best * GROUP_BLOCKS);
 }
 
-//  create <filepath> creates a new file on the disk, the data content is
-// written on the following rows (ended with an empty row)
-int FS::create(std::string filepath)
+// Releases every block of a FAT chain in the in-memory FAT.
+void FS::freeChain(int first_blk)
 {
-    if (filepath.length() > MAX_NAME_LEN)
+    if (first_blk > 0 && first_blk < (int)tails.size() && tails[first_blk])
     {
-        std::cout << "File name too long\n";
-        return -1;
+        tails[first_blk] = 0;
+        tails_dirty = true;
     }
 
-    dir_entry dir[BLOCK_SIZE / sizeof(dir_entry)];
-    disk.read(cwd_blk, (uint8_t *)dir);
-
-    if (findEntryIndex(dir, MAX_DIR_ENTRIES, filepath) != -1)
+    int cur = first_blk;
+    while (cur > 0 && cur < (int)disk.get_no_blocks())
     {
-        std::cout << "File already exists\n";
-        return -1;
+        int next = fat[cur];
+        release(cur);
+        cur = next;
     }
+}
 
-    int free_index = findFreeIndex(dir, MAX_DIR_ENTRIES);
-    if (free_index == -1)
-    {
-        std::cout << "Directory full\n";
-        return -1;
-    }
+// Returns the last block of the chain starting at first_blk. The tail table
+// answers in O(1); an entry is trusted only if it still ends a chain,
+// otherwise the chain is walked once and the table updated.
+int FS::tailOf(int first_blk)
+{
+    int tail = tails[first_blk];
+    if (tail > 0 && fat[tail] == FAT_EOF)
+        return tail;
+
+    tail = first_blk;
+    for (unsigned n = 0; fat[tail] > 0 && n < disk.get_no_blocks(); n++)
+        tail = fat[tail];
+    setTail(first_blk, tail);
+    return tail;
+}
 
-    // 4. Läs in data från stdin
-    std::string data, line;
-    while (std::getline(std::cin, line))
+void FS::setTail(int first_blk, int last_blk)
+{
+    if (tails[first_blk] == last_blk)
+        return;
+    tails[first_blk] = last_blk;
+    tails_dirty = true;
+}
+
+// Follows ".." entries from directory block blk towards the root and reports
+// whether top_blk is passed on the way, i.e. whether blk lies inside top_blk.
+bool FS::inSubtree(int blk, int top_blk)
+{
+    int cur = blk;
+    for (unsigned depth = 0; depth < disk.get_no_blocks(); depth++)
     {
-        if (line.empty())
-            break;
-        data += line + "\n";
+        if (cur == top_blk)
+            return true;
+        if (cur == root_blk)
+            return false;
+
+        dir_entry up;
+        if (findInDir(cur, "..", up) == -1)
+            return false;
+        cur = up.first_blk;
     }
+    return false;
+}
 
-    // 5. Räkna ut antal block som behövs
-    int size = data.size();
-    int blocks_needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+// The reverse index maps a directory block to its parent and name. It is
+// filled by mkdir/cd/cp -r and corrected by mv/rm, so pwd never has to search
+// parent directories for names it has already seen.
+void FS::learnDir(int blk, int parent_blk, const std::string &name)
+{
+    dir_names[blk] = std::make_pair(parent_blk, name);
+}
 
-    // 6. läs FAT
-    disk.read(FAT_BLOCK, (uint8_t *)fat);
+void FS::forgetDir(int blk)
+{
+    dir_names.erase(blk);
+}
 
-    // 7. hitta lediga block i FAT
-    std::vector<int> blocks;
-    for (int i = 2; i < disk.get_no_blocks() && (int)blocks.size() < blocks_needed; i++)
+// Rebuilds the cached cwd path by walking towards the root. Levels known to
+// the reverse index cost nothing; unknown levels fall back to reading ".." and
+// scanning the parent, and the result is remembered.
+bool FS::deriveCwdPath()
+{
+    std::vector<std::string> names;
+    std::vector<int> trail;
+    int current = cwd_blk;
 
+    for (unsigned depth = 0; current != root_blk; depth++)
     {
-        if (fat[i] == FAT_FREE)
-            blocks.push_back(i);
+        if (depth >= disk.get_no_blocks())
+            return false;
+
+        std::unordered_map<int, std::pair<int, std::string> >::iterator it = dir_names.find(current);
+        if (it == dir_names.end())
+        {
+            dir_entry curDir[MAX_DIR_ENTRIES];
+            readDir(current, curDir);
+            int parentIdx = findEntryIndex(curDir, MAX_DIR_ENTRIES, "..");
+            if (parentIdx == -1)
+                return false;
+
+            int parent = curDir[parentIdx].first_blk;
+            dir_entry parentDir[MAX_DIR_ENTRIES];
+            readDir(parent, parentDir);
+            int i = dir_find_block(parentDir, MAX_DIR_ENTRIES, 0, current, TYPE_DIR);
+            while (i != -1 && std::strcmp(parentDir[i].file_name, "..") == 0)
+                i = dir_find_block(parentDir, MAX_DIR_ENTRIES, i + 1, current, TYPE_DIR);
+            if (i != -1)
+                learnDir(current, parent, parentDir[i].file_name);
+
+            it = dir_names.find(current);
+            if (it == dir_names.end())
+                return false;
+        }
+
+        trail.push_back(current);
+        names.push_back(it->second.second);
+        current = it->second.first;
     }
 
-    // 8. Kolla om det finns tillräckligt med lediga block
-    if (blocks.size() < blocks_needed)
+    cwd_trail.assign(trail.rbegin(), trail.rend());
+    cwd_path.assign(names.rbegin(), names.rend());
+    cwd_valid = true;
+    return true;
+}
+
+// Looks up the directory entry for a path. The empty path stands for the
+// current directory and "/" for the root; both get a synthetic entry.
+bool FS::lookup(const std::string &path, dir_entry &entry)
+{
+    if (path.empty() || splitPath(path).empty())
     {
-        std::cout << "Not enough disk space\n";
-        return -1;
+        std::memset(&entry, 0, sizeof(dir_entry));
+        std::strncpy(entry.file_name, path.empty() ? "." : "/", MAX_NAME_LEN);
+        entry.type = TYPE_DIR;
+        entry.first_blk = path.empty() ? cwd_blk : root_blk;
+        entry.access_rights = READ | WRITE | EXECUTE;
+        return true;
     }
 
-    // 9. länka ihop blocken i FAT
-    for (int i = 0; i < blocks.size() - 1; i++)
-        fat[blocks[i]] = blocks[i + 1];
+    int parentBlk;
+    std::string name;
+    if (!resolvePath(path, parentBlk, name))
+        return false;
+
+    return findInDir(parentBlk, name, entry) != -1;
+}
+
+// Traversal engine for recursive commands. Every directory below start_blk is
+// read by its own task on the work-stealing pool, so directory blocks on
+// different branches are fetched in parallel. With ordered == false nodes are
+// returned (and visit is called, concurrently) in completion order; otherwise
+// visit runs afterwards on the calling thread in depth-first slot order, which
+// is also the order of the returned nodes. Each block is visited once, so a
+// damaged tree with cycles still terminates.
+void FS::walk(int start_blk, const std::string &label, std::vector<dir_node> &nodes,
+              bool ordered, const std::function<void(const dir_node &)> &visit)
+{
+    std::mutex lock;
+    std::vector<dir_node *> all;
+    std::vector<char> seen(disk.get_no_blocks(), 0);
+
+    dir_node *top = new dir_node;
+    top->blk = start_blk;
+    top->parent = -1;
+    top->slot = -1;
+    top->depth = 0;
+    top->path = label;
+    all.push_back(top);
+    seen[start_blk] = 1;
+
+    std::function<void(dir_node *, int)> expand = [&](dir_node *node, int index)
+    {
+        node->entries.resize(MAX_DIR_ENTRIES);
+        readDir(node->blk, node->entries.data());
+        if (visit && !ordered)
+            visit(*node);
+
+        std::string prefix = node->path == "/" ? "" : node->path;
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        {
+            const dir_entry &e = node->entries[i];
+            if (e.file_name[0] == '\0' || !isDir(e) || std::strcmp(e.file_name, "..") == 0)
+                continue;
+            if (e.first_blk >= disk.get_no_blocks())
+                continue;
+
+            dir_node *child = new dir_node;
+            child->blk = e.first_blk;
+            child->parent = index;
+            child->slot = i;
+            child->depth = node->depth + 1;
+            child->path = prefix + "/" + e.file_name;
+
+            int child_index;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (seen[child->blk])
+                {
+                    delete child;
+                    continue;
+                }
+                seen[child->blk] = 1;
+                child_index = all.size();
+                all.push_back(child);
+            }
+            pool.submit([&expand, child, child_index]() { expand(child, child_index); });
+        }
+    };
 
-    fat[blocks.back()] = FAT_EOF;
+    pool.submit([&expand, top]() { expand(top, 0); });
+    pool.wait();
 
-    // 10. Skriv data till disken
-    for (int i = 0; i < blocks.size(); i++)
+    // Order the nodes: completion order, or depth-first by parent and slot
+    std::vector<int> order;
+    if (!ordered)
     {
-        uint8_t buf[BLOCK_SIZE] = {0};
-        memcpy(buf,
-               data.data() + i * BLOCK_SIZE,
-               std::min(BLOCK_SIZE, size - i * BLOCK_SIZE));
-        disk.write(blocks[i], buf);
+        for (size_t i = 0; i < all.size(); i++)
+            order.push_back(i);
     }
+    else
+    {
+        std::vector<std::vector<int> > children(all.size());
+        for (size_t i = 1; i < all.size(); i++)
+            children[all[i]->parent].push_back(i);
 
-    // 11. skapa directory entry
-    strncpy(dir[free_index].file_name, filepath.c_str(), MAX_NAME_LEN);
-    dir[free_index].file_name[MAX_NAME_LEN] = '\0';
-    dir[free_index].size = size;
-    dir[free_index].first_blk = blocks[0];
-    dir[free_index].type = TYPE_FILE;
-    dir[free_index].access_rights = READ | WRITE; // 0x06
+        std::vector<int> stack(1, 0);
+        while (!stack.empty())
+        {
+            int n = stack.back();
+            stack.pop_back();
+            order.push_back(n);
+
+            std::vector<int> &c = children[n];
+            std::sort(c.begin(), c.end(), [&all](int a, int b) { return all[a]->slot < all[b]->slot; });
+            for (int k = (int)c.size() - 1; k >= 0; k--)
+                stack.push_back(c[k]);
+        }
+    }
 
-    // 12. Skriv tillbaka FAT och root directory till disken
-    disk.write(cwd_blk, (uint8_t *)dir);
-    disk.write(FAT_BLOCK, (uint8_t *)fat);
+    std::vector<int> position(all.size());
+    for (size_t k = 0; k < order.size(); k++)
+        position[order[k]] = k;
 
-    // std::cout << "FS::create(" << filepath << ")\n";
-    return 0;
+    nodes.clear();
+    nodes.reserve(order.size());
+    for (size_t k = 0; k < order.size(); k++)
+    {
+        dir_node *n = all[order[k]];
+        nodes.push_back(*n);
+        if (n->parent != -1)
+            nodes.back().parent = position[n->parent];
+    }
+    for (size_t i = 0; i < all.size(); i++)
+        delete all[i];
+
+    if (visit && ordered)
+    {
+        for (size_t k = 0; k < nodes.size(); k++)
+            visit(nodes[k]);
+    }
 }
 
-// cat <filepath> reads the content of a file and prints it on the screen
-int FS::cat(std::string path)
+// Copies the directory tree rooted at src_blk so that the copy's ".." points to
+// dst_parent. The source directories are read in parallel by walk(), all
+// blocks the copy needs are taken from the FAT in one pass, and the file
+// chains are then copied concurrently on the pool while each new directory
+// block is written exactly once. Files that are not plain FAT chains, or any
+// file on an extent volume, go through writeData() instead. Only the
+// in-memory FAT/inodes are updated; the caller persists them. Returns the
+// block of the new top directory or -1.
+int FS::copyTree(int src_blk, int dst_parent)
 {
+    std::vector<dir_node> nodes;
+    walk(src_blk, "", nodes, true);
 
-    int parent;
-    std::string name;
+    // batch-copied FAT chains vs. files copied through the data layer
+    bool chains = !hasFeature(FEAT_EXTENTS);
+    std::vector<dir_entry *> others;
 
-    // 1) Resolve path -> parent directory block + entry name
-    if (!resolvePath(path, parent, name))
+    // 1) Count the blocks needed for the copy
+    int blocks_needed = nodes.size();
+    for (size_t d = 0; d < nodes.size(); d++)
     {
-        std::cout << "File not found\n";
-        return -1;
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        {
+            dir_entry &e = nodes[d].entries[i];
+            if (e.file_name[0] == '\0' || !isFile(e))
+                continue;
+            if (chains && !hasInode(e))
+                blocks_needed += blocksFor(e.size);
+            else
+                others.push_back(&e);
+        }
     }
 
-    // 2) Read parent directory
-    dir_entry dir[MAX_DIR_ENTRIES];
-    disk.read(parent, (uint8_t *)dir);
-
-    // 3) Find entry
-    int idx = findEntryIndex(dir, MAX_DIR_ENTRIES, name);
-    if (idx == -1)
-    {
-        std::cout << "File not found\n";
+    // 2) Allocate everything in a single FAT scan, in the block group a new
+    //    directory would get; directories come first
+    std::vector<int> blocks;
+    if (!allocBlocks(blocks_needed, blocks, dirGoal(dst_parent)))
         return -1;
-    }
 
-    dir_entry &entry = dir[idx];
+    // reserve them all now; file chains are linked properly in step 4
+    for (size_t b = 0; b < blocks.size(); b++)
+        fat[blocks[b]] = FAT_EOF;
 
-    // 4) Must be a file
-    if (entry.type == TYPE_DIR)
+    for (size_t k = 0; k < others.size(); k++)
     {
-        std::cout << "Not a file\n";
-        return -1;
+        std::vector<uint8_t> data;
+        readData(*others[k], data);
+        if (writeData(*others[k], data.data(), data.size(), dataGoal(blocks[0])) == -1)
+        {
+            // give back what was taken so far; the caller does not persist
+            for (size_t j = 0; j < k; j++)
+                freeData(*others[j]);
+            for (size_t b = 0; b < blocks.size(); b++)
+                fat[blocks[b]] = FAT_FREE;
+            return -1;
+        }
     }
 
-    // 5) Check READ permission
-    if (!(entry.access_rights & READ))
+    // 3) Point the copied entries at their new blocks
+    for (size_t d = 1; d < nodes.size(); d++)
     {
-        std::cout << "Permission denied\n";
-        return -1;
+        dir_entry &e = nodes[nodes[d].parent].entries[nodes[d].slot];
+        e.first_blk = blocks[d];
+        learnDir(blocks[d], blocks[nodes[d].parent], e.file_name);
     }
 
-    // 6) Read FAT
-    disk.read(FAT_BLOCK, (uint8_t *)fat);
-
-    int cur = entry.first_blk;
-    int remaining = entry.size;
-
-    // 7) Read blocks following FAT chain
-    while (cur != FAT_EOF && remaining > 0)
+    int next = nodes.size();
+    for (size_t d = 0; d < nodes.size(); d++)
     {
-        uint8_t buf[BLOCK_SIZE];
-        disk.read(cur, buf);
+        dir_entry *dir = nodes[d].entries.data();
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        {
+            if (dir[i].file_name[0] == '\0')
+                continue;
 
-        int n = std::min(BLOCK_SIZE, remaining);
-        std::cout.write((char *)buf, n);
+            if (std::strcmp(dir[i].file_name, "..") == 0)
+            {
+                dir[i].first_blk = (d == 0) ? dst_parent : blocks[nodes[d].parent];
+                continue;
+            }
+            if (isDir(dir[i]) || !chains || hasInode(dir[i]))
+                continue;
+
+            // 4) Copy this file's chain into its preassigned blocks
+            int n = blocksFor(dir[i].size);
+            int src = dir[i].first_blk;
+            int remaining = dir[i].size;
+            const int *dst = &blocks[next];
+            pool.submit([this, n, src, remaining, dst]() mutable
+            {
+                for (int b = 0; b < n; b++)
+                {
+                    uint8_t buf[BLOCK_SIZE] = {0};
+                    if (remaining > 0 && src != FAT_EOF)
+                    {
+                        disk.read(src, buf);
+                        src = fat[src];
+                        remaining -= BLOCK_SIZE;
+                    }
+                    disk.write(dst[b], buf);
+                    fat[dst[b]] = (b + 1 < n) ? dst[b + 1] : FAT_EOF;
+                }
+            });
+            dir[i].first_blk = blocks[next];
+            setTail(blocks[next], blocks[next + n - 1]);
+            next += n;
+        }
 
-        remaining -= n;
-        cur = fat[cur];
+        int blk = blocks[d];
+        pool.submit([this, dir, blk]() { writeDir(blk, dir); });
     }
+    pool.wait();
 
-    return 0;
+    return blocks[0];
 }
 
-int FS::ls()
+// ---------------------------------------------------------------------------
+// Volume metadata and the layout-independent file data layer
+//
+// Volumes formatted without features have no superblock and every file is a
+// FAT chain. A formatted-with-features volume keeps a superblock in block 2
+// and an inode table (a FAT chain of blocks, held in memory). Files with
+// TYPE_INODE store their data as extents: runs of contiguous blocks marked
+// FAT_USED, or, when small enough on FEAT_INLINE volumes, inside the inode.
+// Both kinds of file can live side by side on such a volume.
+// ---------------------------------------------------------------------------
+
+void FS::mount()
 {
-    dir_entry dir[MAX_DIR_ENTRIES];
-    disk.read(cwd_blk, (uint8_t *)dir);
+    disk.read(fat_blk, (uint8_t *)fat);
+    int bad = fat_find_invalid(fat, disk.get_no_blocks(), 0);
+    if (bad != -1)
+        std::cout << "Warning: FAT entry " << bad << " is invalid (" << fat[bad] << ")\n";
+    std::memset(&super, 0, sizeof(super));
+    inodes.clear();
+    inode_blks.clear();
+    inode_dirty.clear();
+    tails.assign(disk.get_no_blocks(), 0);
+    tails_dirty = false;
+    packs.clear();
+    refs.clear();
+    fps.clear();
+    fp_index.clear();
+    dedup_dirty = false;
+    std::memset(&dedup_stats, 0, sizeof(dedup_stats));
+    snaps.clear();
+    pinned.clear();
+
+    if (fat[SUPER_BLOCK] == FAT_FREE)
+        return;
+
+    uint8_t buf[BLOCK_SIZE];
+    disk.read(SUPER_BLOCK, buf);
+    superblock sb;
+    std::memcpy(&sb, buf, sizeof(sb));
+    if (sb.magic != FS_MAGIC)
+        return; // an image without superblock: block 2 holds ordinary data
+    super = sb;
+
+    if (super.snap_blk)
+    {
+        snaps.resize(MAX_SNAPSHOTS);
+        disk.read(super.snap_blk, (uint8_t *)snaps.data());
+    }
 
-    std::cout << std::left
-              << std::setw(17) << "name"
-              << std::setw(11) << "type"
-              << std::setw(16) << "accessrights"
+    // a mounted snapshot brings its own inode table and nothing else: it is
+    // never written, so tails and fingerprints are not needed
+    int blk = super.inode_blk;
+    unsigned limit = disk.get_no_blocks();
+    if (view != -1)
+    {
+        blk = snaps[view].inode_blk;
+        limit = snaps[view].inode_blocks;
+    }
+    while (blk > 0 && inode_blks.size() < limit)
+    {
+        inode_blks.push_back(blk);
+        inodes.resize(inode_blks.size() * INODES_PER_BLOCK);
+        disk.read(blk, (uint8_t *)&inodes[(inode_blks.size() - 1) * INODES_PER_BLOCK]);
+        blk = fat[blk];
+    }
+    inode_dirty.assign(inode_blks.size(), 0);
+    if (view != -1)
+        return;
+    loadPins();
+
+    if (super.tail_blk)
+        disk.read(super.tail_blk, (uint8_t *)tails.data());
+
+    if (super.dedup_blk)
+    {
+        refs.resize(disk.get_no_blocks());
+        fps.resize(disk.get_no_blocks());
+        disk.read(super.dedup_blk, (uint8_t *)refs.data());
+        disk.read_blocks(super.dedup_blk + 1, 2, (uint8_t *)fps.data());
+        for (size_t b = 0; b < refs.size(); b++)
+            if (refs[b])
+                fp_index.insert(std::make_pair(fps[b], (int)b));
+    }
+
+    for (size_t i = 0; i < inodes.size(); i++)
+    {
+        if (inodes[i].kind != INODE_EXTENT || !inodes[i].tail_len)
+            continue;
+        std::vector<extent> ext;
+        loadExtents(i, ext);
+        packs[ext.back().start][ext.back().len] = inodes[i].tail_len;
+    }
+}
+
+void FS::writeSuper()
+{
+    uint8_t buf[BLOCK_SIZE] = {0};
+    std::memcpy(buf, &super, sizeof(super));
+    disk.barrier();
+    disk.write(SUPER_BLOCK, buf);
+    disk.barrier();
+}
+
+void FS::flushMeta()
+{
+    if (view != -1)
+        return; // snapshots are read-only
+    disk.barrier();
+    disk.write(FAT_BLOCK, (uint8_t *)fat);
+    for (size_t b = 0; b < inode_blks.size(); b++)
+    {
+        if (!inode_dirty[b])
+            continue;
+        disk.write(inode_blks[b], (uint8_t *)&inodes[b * INODES_PER_BLOCK]);
+        inode_dirty[b] = 0;
+    }
+    if (tails_dirty && super.tail_blk)
+        disk.write(super.tail_blk, (uint8_t *)tails.data());
+    tails_dirty = false;
+    if (dedup_dirty && super.dedup_blk)
+    {
+        disk.write(super.dedup_blk, (uint8_t *)refs.data());
+        disk.write_blocks(super.dedup_blk + 1, 2, (uint8_t *)fps.data());
+    }
+    dedup_dirty = false;
+    disk.barrier();
+}
+
+// Returns a free inode number, growing the inode table by one block if it
+// is full, or -1 if the disk is full.
+int FS::allocInode()
+{
+    for (size_t i = 0; i < inodes.size(); i++)
+    {
+        if (inodes[i].kind == INODE_FREE)
+            return i;
+    }
+
+    std::vector<int> blocks;
+    if (inode_blks.empty() || !allocBlocks(1, blocks))
+        return -1;
+
+    fat[inode_blks.back()] = blocks[0];
+    fat[blocks[0]] = FAT_EOF;
+    int first = inodes.size();
+    inode_blks.push_back(blocks[0]);
+    inodes.resize(inodes.size() + INODES_PER_BLOCK);
+    std::memset(&inodes[first], 0, INODES_PER_BLOCK * sizeof(inode));
+    inode_dirty.push_back(1);
+
+    super.inode_blocks++;
+    writeSuper();
+    return first;
+}
+
+void FS::loadExtents(int ino, std::vector<extent> &ext)
+{
+    const inode &in = inodes[ino];
+    int direct = std::min<int>(in.n_extents, INODE_EXTENTS);
+    ext.assign(in.ext, in.ext + direct);
+
+    if (in.n_extents > INODE_EXTENTS && in.indirect)
+    {
+        extent more[EXTENTS_PER_BLOCK];
+        disk.read(in.indirect, (uint8_t *)more);
+        ext.insert(ext.end(), more, more + (in.n_extents - INODE_EXTENTS));
+    }
+}
+
+// Stores an extent list in the inode, spilling into the indirect block (which
+// is allocated or released as needed). Returns false if it does not fit.
+bool FS::storeExtents(int ino, const std::vector<extent> &ext)
+{
+    inode &in = inodes[ino];
+    if (ext.size() > INODE_EXTENTS + EXTENTS_PER_BLOCK)
+        return false;
+
+    if (ext.size() > INODE_EXTENTS)
+    {
+        if (!in.indirect)
+        {
+            std::vector<int> blocks;
+            if (!allocBlocks(1, blocks))
+                return false;
+            fat[blocks[0]] = FAT_USED;
+            in.indirect = blocks[0];
+        }
+        extent more[EXTENTS_PER_BLOCK];
+        std::memset(more, 0, sizeof(more));
+        std::copy(ext.begin() + INODE_EXTENTS, ext.end(), more);
+        disk.write(in.indirect, (uint8_t *)more);
+    }
+    else if (in.indirect)
+    {
+        release(in.indirect);
+        in.indirect = 0;
+    }
+
+    std::memset(in.ext, 0, sizeof(in.ext));
+    std::copy(ext.begin(), ext.begin() + std::min<size_t>(ext.size(), INODE_EXTENTS), in.ext);
+    in.n_extents = ext.size();
+    markInode(ino);
+    return true;
+}
+
+// Start of the first run of at least n free blocks in [from, to), or -1. The
+// run is cut at to, so a run that continues past it is only as long as the
+// part before to.
+int FS::findRun(int from, int to, int n)
+{
+    int i = fat_find(fat, to, from, FAT_FREE);
+    while (i != -1)
+    {
+        int end = fat_find_other(fat, to, i, FAT_FREE);
+        if ((end == -1 ? to : end) - i >= n)
+            return i;
+        if (end == -1)
+            return -1;
+        i = fat_find(fat, to, end, FAT_FREE);
+    }
+    return -1;
+}
+
+// Allocates n blocks for extents and marks them FAT_USED. A single run of n
+// contiguous blocks at or after goal is preferred; otherwise the free runs
+// met from goal onwards (wrapping around) are combined. Returns false and
+// leaves the FAT unchanged if there are fewer than n free blocks.
+bool FS::allocExtents(int n, std::vector<extent> &ext, int goal)
+{
+    ext.clear();
+    if (n <= 0)
+        return true;
+
+    int first = 2, last = disk.get_no_blocks();
+    if (goal < first || goal >= last)
+        goal = first;
+
+    // 1) look for one run that is long enough, from goal to the end of the
+    //    disk and then from the start up to goal; runs do not wrap around
+    int run_start = findRun(goal, last, n);
+    if (run_start == -1)
+        run_start = findRun(first, goal, n);
+    if (run_start != -1)
+    {
+        extent e = { (uint16_t)run_start, (uint16_t)n };
+        ext.push_back(e);
+    }
+
+    // 2) otherwise gather the free runs in the same order
+    if (ext.empty())
+    {
+        int need = n;
+        int ranges[2][2] = { { goal, last }, { first, goal } };
+        for (int r = 0; r < 2 && need > 0; r++)
+        {
+            int i = fat_find(fat, ranges[r][1], ranges[r][0], FAT_FREE);
+            while (i != -1 && need > 0)
+            {
+                int end = fat_find_other(fat, ranges[r][1], i, FAT_FREE);
+                int len = std::min((end == -1 ? ranges[r][1] : end) - i, need);
+                if (!ext.empty() && ext.back().start + ext.back().len == i)
+                    ext.back().len += len;
+                else
+                {
+                    extent e = { (uint16_t)i, (uint16_t)len };
+                    ext.push_back(e);
+                }
+                need -= len;
+                i = end == -1 ? -1 : fat_find(fat, ranges[r][1], end, FAT_FREE);
+            }
+        }
+        if (need > 0)
+        {
+            ext.clear();
+            return false;
+        }
+    }
+
+    for (size_t e = 0; e < ext.size(); e++)
+        for (int b = 0; b < ext[e].len; b++)
+            fat[ext[e].start + b] = FAT_USED;
+    return true;
+}
+
+// first[k] is the file block index where extent k begins, so the extent
+// holding a file block is found by a binary search (extentAt)
+static void extentIndex(const std::vector<extent> &ext, std::vector<int> &first)
+{
+    first.resize(ext.size());
+    int pos = 0;
+    for (size_t k = 0; k < ext.size(); k++)
+    {
+        first[k] = pos;
+        pos += ext[k].len;
+    }
+}
+
+// The extent holding the index-th block of a file, -1 if there is none.
+static int extentAt(const std::vector<extent> &ext, const std::vector<int> &first, int index)
+{
+    int k = std::upper_bound(first.begin(), first.end(), index) - first.begin() - 1;
+    if (k < 0 || index - first[k] >= ext[k].len)
+        return -1;
+    return k;
+}
+
+// Writes size bytes into the given extents, one multi-block I/O per extent.
+static void writeExtents(Disk &disk, const std::vector<extent> &ext,
+                         const uint8_t *data, int size)
+{
+    int pos = 0;
+    for (size_t k = 0; k < ext.size(); k++)
+    {
+        std::vector<uint8_t> buf(ext[k].len * BLOCK_SIZE, 0);
+        int n = std::min<int>(buf.size(), size - pos);
+        if (n > 0)
+            std::memcpy(buf.data(), data + pos, n);
+        disk.write_blocks(ext[k].start, ext[k].len, buf.data());
+        pos += buf.size();
+    }
+}
+
+static const uint8_t zero_block[BLOCK_SIZE] = {0};
+
+// Appends x to ext, merged into the last extent if it continues it (a hole
+// continues a hole).
+static void addExtent(std::vector<extent> &ext, extent x)
+{
+    if (!ext.empty())
+    {
+        extent &last = ext.back();
+        bool holes = last.start == EXTENT_HOLE && x.start == EXTENT_HOLE;
+        bool follows = last.start != EXTENT_HOLE && x.start != EXTENT_HOLE &&
+                       last.start + last.len == x.start;
+        if (holes || follows)
+        {
+            int room = std::min<int>(x.len, UINT16_MAX - last.len);
+            last.len += room;
+            x.len -= room;
+            if (x.start != EXTENT_HOLE)
+                x.start += room;
+        }
+    }
+    if (x.len)
+        ext.push_back(x);
+}
+
+// Blocks covered by ext, holes included.
+static int extentBlocks(const std::vector<extent> &ext)
+{
+    int n = 0;
+    for (size_t k = 0; k < ext.size(); k++)
+        n += ext[k].len;
+    return n;
+}
+
+// Keeps the first n blocks of ext (holes included) and moves the rest to rest.
+static void splitExtents(std::vector<extent> &ext, int n, std::vector<extent> &rest)
+{
+    std::vector<extent> head;
+    rest.clear();
+    for (size_t k = 0; k < ext.size(); k++)
+    {
+        int keep = std::max(0, std::min<int>(ext[k].len, n));
+        n -= keep;
+        if (keep)
+        {
+            extent x = { ext[k].start, (uint16_t)keep };
+            head.push_back(x);
+        }
+        if (keep < ext[k].len)
+        {
+            extent x = { (uint16_t)(ext[k].start == EXTENT_HOLE ? EXTENT_HOLE : ext[k].start + keep),
+                         (uint16_t)(ext[k].len - keep) };
+            rest.push_back(x);
+        }
+    }
+    ext.swap(head);
+}
+
+// A fast, non-cryptographic fingerprint of a block; 0 means "none".
+static uint32_t fingerprint(const uint8_t *blk)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < BLOCK_SIZE; i += 8)
+    {
+        uint64_t v;
+        std::memcpy(&v, blk + i, sizeof(v));
+        h ^= v * 0xff51afd7ed558ccdULL;
+        h = (h << 31 | h >> 33) * 0xc4ceb9fe1a85ec53ULL;
+    }
+    h ^= h >> 29;
+    uint32_t fp = (uint32_t)(h ^ (h >> 32));
+    return fp ? fp : 1;
+}
+
+// Returns a block holding exactly the content blk with fingerprint fp, or
+// -1. Equal fingerprints are verified by reading the candidate back.
+int FS::findDuplicate(uint32_t fp, const uint8_t *blk)
+{
+    typedef std::unordered_multimap<uint32_t, int>::iterator iter;
+    std::pair<iter, iter> range = fp_index.equal_range(fp);
+    for (iter it = range.first; it != range.second; ++it)
+    {
+        if (refs[it->second] == UINT16_MAX)
+            continue;
+        uint8_t buf[BLOCK_SIZE];
+        disk.read(it->second, buf);
+        dedup_stats.verified++;
+        if (std::memcmp(buf, blk, BLOCK_SIZE) == 0)
+            return it->second;
+        dedup_stats.collisions++;
+    }
+    return -1;
+}
+
+// Whole blocks of zeros are not stored but become holes. Without dedup the
+// other blocks are allocated as few runs as possible and written one run per
+// I/O. With dedup every block is fingerprinted first; a block already on the
+// disk gets one more reference, the others are allocated one by one from
+// goal on and still written in runs. On failure nothing stays allocated.
+bool FS::writeBlocks(const uint8_t *data, int size, int goal, std::vector<extent> &ext)
+{
+    ext.clear();
+    int n = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<char> hole(n, 0);
+    int holes = 0;
+    for (int i = 0; i < size / BLOCK_SIZE; i++)
+    {
+        hole[i] = std::memcmp(data + (size_t)i * BLOCK_SIZE, zero_block, BLOCK_SIZE) == 0;
+        holes += hole[i];
+    }
+
+    if (!hasFeature(FEAT_DEDUP))
+    {
+        std::vector<extent> runs;
+        if (!allocExtents(n - holes, runs, goal))
+            return false;
+        if (!holes)
+        {
+            ext = runs;
+            writeExtents(disk, ext, data, size);
+            return true;
+        }
+
+        // lay the allocated runs over the blocks that are not holes
+        size_t r = 0;
+        int used = 0; // blocks of runs[r] taken so far
+        for (int i = 0; i < n;)
+        {
+            int len = 0;
+            while (i + len < n && len < UINT16_MAX && hole[i + len] == hole[i] &&
+                   (hole[i] || used + len < runs[r].len))
+                len++;
+            extent x = { EXTENT_HOLE, (uint16_t)len };
+            if (!hole[i])
+            {
+                x.start = runs[r].start + used;
+                writeExtents(disk, std::vector<extent>(1, x), data + (size_t)i * BLOCK_SIZE,
+                             size - i * BLOCK_SIZE);
+                used += len;
+                if (used == runs[r].len)
+                {
+                    r++;
+                    used = 0;
+                }
+            }
+            addExtent(ext, x);
+            i += len;
+        }
+        return true;
+    }
+
+    std::vector<uint8_t> run; // new blocks not written yet
+    int run_start = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (hole[i])
+        {
+            extent x = { EXTENT_HOLE, 1 };
+            addExtent(ext, x);
+            continue;
+        }
+        uint8_t buf[BLOCK_SIZE] = {0};
+        std::memcpy(buf, data + (size_t)i * BLOCK_SIZE, std::min(BLOCK_SIZE, size - i * BLOCK_SIZE));
+
+        // 1) look for the same content; candidates must be on the disk
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint32_t fp = fingerprint(buf);
+        int blk = -1;
+        if (fp_index.count(fp))
+        {
+            if (!run.empty())
+                disk.write_blocks(run_start, run.size() / BLOCK_SIZE, run.data());
+            run.clear();
+            blk = findDuplicate(fp, buf);
+        }
+        dedup_stats.us += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        dedup_stats.blocks++;
+
+        // 2) share it, or place a new block
+        if (blk != -1)
+        {
+            refs[blk]++;
+            dedup_stats.shared++;
+        }
+        else
+        {
+            std::vector<extent> one;
+            if (!allocExtents(1, one, goal))
+            {
+                freeExtents(ext);
+                ext.clear();
+                return false;
+            }
+            blk = one[0].start;
+            refs[blk] = 1;
+            fps[blk] = fp;
+            fp_index.insert(std::make_pair(fp, blk));
+            if (!run.empty() && run_start + (int)(run.size() / BLOCK_SIZE) != blk)
+            {
+                disk.write_blocks(run_start, run.size() / BLOCK_SIZE, run.data());
+                run.clear();
+            }
+            if (run.empty())
+                run_start = blk;
+            run.insert(run.end(), buf, buf + BLOCK_SIZE);
+            goal = blk + 1;
+        }
+
+        extent x = { (uint16_t)blk, 1 };
+        addExtent(ext, x);
+    }
+    if (!run.empty())
+        disk.write_blocks(run_start, run.size() / BLOCK_SIZE, run.data());
+    dedup_dirty = true;
+    return true;
+}
+
+// A shared block is only freed with its last reference.
+void FS::freeExtents(const std::vector<extent> &ext)
+{
+    for (size_t k = 0; k < ext.size(); k++)
+    {
+        if (ext[k].start == EXTENT_HOLE)
+            continue;
+        for (int b = ext[k].start; b < ext[k].start + ext[k].len; b++)
+        {
+            if (refs.empty() || refs[b] == 0)
+            {
+                release(b);
+                continue;
+            }
+            dedup_dirty = true;
+            if (--refs[b] > 0)
+                continue;
+            typedef std::unordered_multimap<uint32_t, int>::iterator iter;
+            std::pair<iter, iter> range = fp_index.equal_range(fps[b]);
+            for (iter it = range.first; it != range.second; ++it)
+            {
+                if (it->second == b)
+                {
+                    fp_index.erase(it);
+                    break;
+                }
+            }
+            fps[b] = 0;
+            release(b);
+        }
+    }
+}
+
+// Packed tails share blocks, so they are written read-modify-write.
+static void writeTail(Disk &disk, const extent &where, const uint8_t *data, int len)
+{
+    uint8_t buf[BLOCK_SIZE];
+    disk.read(where.start, buf);
+    std::memcpy(buf + where.len, data, len);
+    disk.write(where.start, buf);
+}
+
+static void readTail(Disk &disk, const extent &where, uint8_t *data, int len)
+{
+    uint8_t buf[BLOCK_SIZE];
+    disk.read(where.start, buf);
+    std::memcpy(data, buf + where.len, len);
+}
+
+// Finds room for a packed tail of len bytes: first fit in the blocks that
+// already hold tails, otherwise a new block is taken. where receives the
+// block and byte offset.
+bool FS::allocTail(int len, extent &where)
+{
+    for (std::map<int, std::map<int, int> >::iterator p = packs.begin(); p != packs.end(); ++p)
+    {
+        if (isPinned(p->first))
+            continue; // the gaps of a snapshot's pack block stay as they were
+        int gap_start = 0;
+        std::map<int, int>::iterator r = p->second.begin();
+        for (;; ++r)
+        {
+            int gap_end = (r == p->second.end()) ? BLOCK_SIZE : r->first;
+            if (gap_end - gap_start >= len)
+            {
+                p->second[gap_start] = len;
+                where.start = p->first;
+                where.len = gap_start;
+                return true;
+            }
+            if (r == p->second.end())
+                break;
+            gap_start = r->first + r->second;
+        }
+    }
+
+    std::vector<int> blocks;
+    if (!allocBlocks(1, blocks))
+        return false;
+    fat[blocks[0]] = FAT_USED;
+    packs[blocks[0]][0] = len;
+    where.start = blocks[0];
+    where.len = 0;
+    return true;
+}
+
+// Releases a packed tail; a pack block is freed with its last tail.
+void FS::freeTail(const extent &where)
+{
+    std::map<int, std::map<int, int> >::iterator p = packs.find(where.start);
+    if (p == packs.end())
+        return;
+    p->second.erase(where.len);
+    if (p->second.empty())
+    {
+        release(where.start);
+        packs.erase(p);
+    }
+}
+
+// Compresses data in chunks of COMPRESS_CHUNK bytes and appends a descriptor
+// per chunk to chunks. Every chunk gets its own contiguous run of blocks, so
+// any chunk can be read and decompressed on its own. On failure the chunks
+// written so far are released again and chunks is left unchanged.
+bool FS::writeChunks(const uint8_t *data, int size, std::vector<extent> &chunks)
+{
+    size_t first = chunks.size();
+    int goal = 2;
+    if (!chunks.empty())
+        goal = chunks.back().start + (chunks.back().len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    std::vector<uint8_t> buf(COMPRESS_CHUNK);
+    for (int pos = 0; pos < size; pos += COMPRESS_CHUNK)
+    {
+        // 1) compress; only a real gain is kept, else the chunk is stored raw
+        int raw = std::min(COMPRESS_CHUNK, size - pos);
+        int len = lz_compress(data + pos, raw, buf.data(), raw - 1);
+        if (len < 0)
+        {
+            std::memcpy(buf.data(), data + pos, raw);
+            len = raw;
+        }
+
+        // 2) place it in one run of blocks
+        int nblocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        std::vector<extent> run;
+        if (!allocExtents(nblocks, run, goal) || run.size() != 1)
+        {
+            freeExtents(run);
+            for (size_t k = first; k < chunks.size(); k++)
+                freeChunk(chunks[k]);
+            chunks.resize(first);
+            return false;
+        }
+        std::memset(buf.data() + len, 0, nblocks * BLOCK_SIZE - len);
+        disk.write_blocks(run[0].start, nblocks, buf.data());
+
+        extent chunk = { run[0].start, (uint16_t)len };
+        chunks.push_back(chunk);
+        goal = run[0].start + nblocks;
+    }
+    return true;
+}
+
+// Reads one chunk holding raw bytes of file data into out.
+void FS::readChunk(const extent &chunk, int raw, uint8_t *out)
+{
+    int nblocks = (chunk.len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<uint8_t> buf((size_t)nblocks * BLOCK_SIZE);
+    disk.read_blocks(chunk.start, nblocks, buf.data());
+    if (chunk.len == raw)
+        std::memcpy(out, buf.data(), raw);
+    else if (lz_decompress(buf.data(), chunk.len, out, raw) != raw)
+        std::memset(out, 0, raw);
+}
+
+void FS::freeChunk(const extent &chunk)
+{
+    int nblocks = (chunk.len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int b = 0; b < nblocks; b++)
+        release(chunk.start + b);
+}
+
+// Reads the whole content of a file into data.
+int FS::readData(const dir_entry &entry, std::vector<uint8_t> &data)
+{
+    int size = entry.size;
+    if (hasInode(entry) && inodes[entry.first_blk].kind == INODE_INLINE)
+    {
+        data.assign(inodes[entry.first_blk].data, inodes[entry.first_blk].data + size);
+        return 0;
+    }
+
+    int nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    data.resize((size_t)nblocks * BLOCK_SIZE);
+
+    if (hasInode(entry) && inodes[entry.first_blk].kind == INODE_COMPRESSED)
+    {
+        // chunk k holds bytes k * COMPRESS_CHUNK.., so single chunks could
+        // be read just as well
+        std::vector<extent> chunks;
+        loadExtents(entry.first_blk, chunks);
+        for (size_t k = 0; k < chunks.size(); k++)
+        {
+            int pos = k * COMPRESS_CHUNK;
+            readChunk(chunks[k], std::min(COMPRESS_CHUNK, size - pos), data.data() + pos);
+        }
+    }
+    else if (!hasInode(entry))
+    {
+        // contiguous stretches of the chain are read with one I/O each
+        int cur = entry.first_blk;
+        for (int b = 0; b < nblocks && cur > 0;)
+        {
+            int start = cur, len = 1;
+            while (b + len < nblocks && fat[cur] == cur + 1)
+            {
+                cur++;
+                len++;
+            }
+            disk.read_blocks(start, len, data.data() + (size_t)b * BLOCK_SIZE);
+            b += len;
+            cur = fat[cur];
+        }
+    }
+    else
+    {
+        std::vector<extent> ext;
+        loadExtents(entry.first_blk, ext);
+        int tail_len = inodes[entry.first_blk].tail_len;
+        if (tail_len)
+        {
+            readTail(disk, ext.back(), data.data() + size - tail_len, tail_len);
+            ext.pop_back();
+        }
+        size_t pos = 0;
+        for (size_t k = 0; k < ext.size() && pos < data.size(); k++)
+        {
+            int len = std::min<size_t>(ext[k].len, (data.size() - pos) / BLOCK_SIZE);
+            if (ext[k].start == EXTENT_HOLE)
+                std::memset(data.data() + pos, 0, (size_t)len * BLOCK_SIZE);
+            else
+                disk.read_blocks(ext[k].start, len, data.data() + pos);
+            pos += (size_t)len * BLOCK_SIZE;
+        }
+    }
+
+    data.resize(size);
+    return 0;
+}
+
+// Reads up to count bytes of a file from offset on into data, which is
+// shorter at the end of the file. Only the blocks holding the range are
+// read: extent files find the first one by a binary search over the extent
+// list, compressed files by its chunk number and FAT files by following
+// the chain.
+int FS::readRange(const dir_entry &entry, long offset, int count, std::vector<uint8_t> &data)
+{
+    long size = entry.size;
+    data.clear();
+    if (offset < 0 || count < 0)
+        return -1;
+    if (offset >= size || count == 0)
+        return 0;
+    int n = (int)std::min<long>(count, size - offset);
+    if (hasInode(entry) && inodes[entry.first_blk].kind == INODE_INLINE)
+    {
+        data.assign(inodes[entry.first_blk].data + offset, inodes[entry.first_blk].data + offset + n);
+        return 0;
+    }
+
+    // 1) compressed: the chunks of the range, decompressed
+    if (hasInode(entry) && inodes[entry.first_blk].kind == INODE_COMPRESSED)
+    {
+        std::vector<extent> chunks;
+        loadExtents(entry.first_blk, chunks);
+        int c0 = offset / COMPRESS_CHUNK, c1 = (offset + n - 1) / COMPRESS_CHUNK;
+        std::vector<uint8_t> buf((size_t)(c1 - c0 + 1) * COMPRESS_CHUNK);
+        for (int c = c0; c <= c1 && c < (int)chunks.size(); c++)
+        {
+            long pos = (long)c * COMPRESS_CHUNK;
+            readChunk(chunks[c], std::min<long>(COMPRESS_CHUNK, size - pos),
+                      buf.data() + (size_t)(c - c0) * COMPRESS_CHUNK);
+        }
+        data.assign(buf.begin() + (offset - (long)c0 * COMPRESS_CHUNK),
+                    buf.begin() + (offset - (long)c0 * COMPRESS_CHUNK) + n);
+        return 0;
+    }
+
+    // 2) blocks b0..b1 of the file; holes and missing blocks read as zeros
+    int b0 = offset / BLOCK_SIZE, b1 = (offset + n - 1) / BLOCK_SIZE;
+    std::vector<uint8_t> buf((size_t)(b1 - b0 + 1) * BLOCK_SIZE, 0);
+    std::vector<extent> ext;
+    extent tail = { 0, 0 };
+    int tail_len = 0;
+    if (!hasInode(entry))
+    {
+        int cur = entry.first_blk;
+        for (int b = 0; b < b0 && cur > 0; b++)
+            cur = fat[cur];
+        for (int b = b0; b <= b1 && cur > 0;)
+        {
+            int start = cur, len = 1;
+            while (b + len <= b1 && fat[cur] == cur + 1)
+            {
+                cur++;
+                len++;
+            }
+            disk.read_blocks(start, len, buf.data() + (size_t)(b - b0) * BLOCK_SIZE);
+            b += len;
+            cur = fat[cur];
+        }
+    }
+    else
+    {
+        loadExtents(entry.first_blk, ext);
+        tail_len = inodes[entry.first_blk].tail_len;
+        if (tail_len)
+        {
+            tail = ext.back();
+            ext.pop_back();
+        }
+        std::vector<int> first;
+        extentIndex(ext, first);
+        int k = extentAt(ext, first, b0);
+        for (int b = b0; k != -1 && k < (int)ext.size() && b <= b1; k++)
+        {
+            int from = b - first[k];
+            int len = std::min(ext[k].len - from, b1 - b + 1);
+            if (ext[k].start != EXTENT_HOLE)
+                disk.read_blocks(ext[k].start + from, len, buf.data() + (size_t)(b - b0) * BLOCK_SIZE);
+            b += len;
+        }
+    }
+    data.assign(buf.begin() + (offset - (long)b0 * BLOCK_SIZE),
+                buf.begin() + (offset - (long)b0 * BLOCK_SIZE) + n);
+
+    // 3) the packed tail, if the range reaches into it
+    long tail_start = size - tail_len;
+    if (tail_len && offset + n > tail_start)
+    {
+        uint8_t piece[BLOCK_SIZE];
+        readTail(disk, tail, piece, tail_len);
+        long from = std::max(offset, tail_start);
+        std::memcpy(data.data() + (from - offset), piece + (from - tail_start), offset + n - from);
+    }
+    return 0;
+}
+
+// Stores data as the content of a new file, in the volume's default layout,
+// and fills in type, size and first_blk of entry. The blocks are looked for
+// from goal on. Returns -1 if the disk is full.
+int FS::writeData(dir_entry &entry, const uint8_t *data, int size, int goal)
+{
+    if (hasFeature(FEAT_INLINE) && size <= (int)INLINE_MAX)
+    {
+        int ino = allocInode();
+        if (ino == -1)
+            return -1;
+
+        std::memset(&inodes[ino], 0, sizeof(inode));
+        inodes[ino].kind = INODE_INLINE;
+        if (size)
+            std::memcpy(inodes[ino].data, data, size); // data is NULL for an empty file
+        markInode(ino);
+
+        entry.type = TYPE_FILE | TYPE_INODE;
+        entry.first_blk = ino;
+        entry.size = size;
+        return 0;
+    }
+
+    if (hasFeature(FEAT_COMPRESS))
+    {
+        int ino = allocInode();
+        if (ino == -1)
+            return -1;
+
+        std::vector<extent> chunks;
+        if (!writeChunks(data, size, chunks))
+            return -1;
+        std::memset(&inodes[ino], 0, sizeof(inode));
+        inodes[ino].kind = INODE_COMPRESSED;
+        if (!storeExtents(ino, chunks))
+        {
+            for (size_t k = 0; k < chunks.size(); k++)
+                freeChunk(chunks[k]);
+            inodes[ino].kind = INODE_FREE;
+            return -1;
+        }
+
+        entry.type = TYPE_FILE | TYPE_INODE;
+        entry.first_blk = ino;
+        entry.size = size;
+        return 0;
+    }
+
+    if (hasFeature(FEAT_EXTENTS))
+    {
+        int ino = allocInode();
+        if (ino == -1)
+            return -1;
+
+        // with FEAT_PACK only whole blocks get extents, the rest is packed
+        int full = size / BLOCK_SIZE, rest = size % BLOCK_SIZE;
+        bool pack = hasFeature(FEAT_PACK) && rest > 0;
+
+        std::vector<extent> ext;
+        if (!writeBlocks(data, pack ? full * BLOCK_SIZE : size, goal, ext))
+            return -1;
+        extent where = { 0, 0 };
+        std::vector<extent> all(ext);
+        if (pack)
+        {
+            if (!allocTail(rest, where))
+            {
+                freeExtents(ext);
+                return -1;
+            }
+            all.push_back(where);
+        }
+
+        std::memset(&inodes[ino], 0, sizeof(inode));
+        inodes[ino].kind = INODE_EXTENT;
+        if (!storeExtents(ino, all))
+        {
+            freeExtents(ext);
+            if (pack)
+                freeTail(where);
+            inodes[ino].kind = INODE_FREE;
+            return -1;
+        }
+        if (pack)
+        {
+            inodes[ino].tail_len = rest;
+            writeTail(disk, where, data + (size - rest), rest);
+        }
+
+        entry.type = TYPE_FILE | TYPE_INODE;
+        entry.first_blk = ino;
+        entry.size = size;
+        return 0;
+    }
+
+    std::vector<int> blocks;
+    if (!allocBlocks(blocksFor(size), blocks, goal))
+        return -1;
+
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        uint8_t buf[BLOCK_SIZE] = {0};
+        int n = std::min<int>(BLOCK_SIZE, size - (int)i * BLOCK_SIZE);
+        if (n > 0)
+            std::memcpy(buf, data + i * BLOCK_SIZE, n);
+        disk.write(blocks[i], buf);
+        fat[blocks[i]] = (i + 1 < blocks.size()) ? blocks[i + 1] : FAT_EOF;
+    }
+
+    setTail(blocks[0], blocks.back());
+    entry.type = TYPE_FILE;
+    entry.first_blk = blocks[0];
+    entry.size = size;
+    return 0;
+}
+
+// Appends data to an existing file: the partly used last block is filled
+// first, the rest goes to newly allocated blocks (for extent files as close
+// behind the current tail as possible, merging with the last extent). An
+// inline file that outgrows its inode is rewritten in the default layout, a
+// packed tail is moved behind the appended data. For a compressed file only
+// the last, partly filled chunk is compressed again.
+int FS::appendData(dir_entry &entry, const uint8_t *data, int size, int goal)
+{
+    if (size <= 0)
+        return 0;
+
+    if (hasInode(entry) && inodes[entry.first_blk].kind == INODE_INLINE)
+    {
+        inode &in = inodes[entry.first_blk];
+        if (entry.size + size <= INLINE_MAX)
+        {
+            std::memcpy(in.data + entry.size, data, size);
+            markInode(entry.first_blk);
+            entry.size += size;
+            return 0;
+        }
+
+        std::vector<uint8_t> all(in.data, in.data + entry.size);
+        all.insert(all.end(), data, data + size);
+        dir_entry moved = entry;
+        if (writeData(moved, all.data(), all.size(), goal) == -1)
+            return -1;
+        freeData(entry);
+        entry.type = moved.type;
+        entry.first_blk = moved.first_blk;
+        entry.size = moved.size;
+        return 0;
+    }
+
+    if (hasInode(entry) && inodes[entry.first_blk].kind == INODE_COMPRESSED)
+    {
+        int ino = entry.first_blk;
+        std::vector<extent> chunks;
+        loadExtents(ino, chunks);
+
+        // 1) the partial last chunk is decompressed and goes in front
+        std::vector<uint8_t> joined;
+        int partial = entry.size % COMPRESS_CHUNK;
+        extent old = { 0, 0 };
+        if (partial)
+        {
+            old = chunks.back();
+            chunks.pop_back();
+            joined.resize(partial);
+            readChunk(old, partial, joined.data());
+        }
+        joined.insert(joined.end(), data, data + size);
+
+        // 2) write the new chunks; the old one is released only on success
+        size_t kept = chunks.size();
+        if (!writeChunks(joined.data(), joined.size(), chunks))
+            return -1;
+        if (!storeExtents(ino, chunks))
+        {
+            for (size_t k = kept; k < chunks.size(); k++)
+                freeChunk(chunks[k]);
+            return -1;
+        }
+        if (partial)
+            freeChunk(old);
+
+        entry.size += size;
+        return 0;
+    }
+
+    int used = entry.size % BLOCK_SIZE; // bytes used in the last block
+    int written = 0;
+
+    if (!hasInode(entry))
+    {
+        int lastBlk = tailOf(entry.first_blk);
+
+        // a 0 byte file still owns one (empty) block
+        if (used != 0 || entry.size == 0)
+        {
+            uint8_t last_buf[BLOCK_SIZE];
+            disk.read(lastBlk, last_buf);
+            written = std::min(BLOCK_SIZE - used, size);
+            std::memcpy(last_buf + used, data, written);
+
+            // a snapshot still sees the old last block: copy on write
+            if (isPinned(lastBlk))
+            {
+                std::vector<int> copy;
+                if (!allocBlocks(1, copy))
+                    return -1;
+                int prev = -1;
+                for (int b = entry.first_blk; b != lastBlk; b = fat[b])
+                    prev = b;
+                if (prev == -1)
+                {
+                    setTail(entry.first_blk, 0);
+                    entry.first_blk = copy[0];
+                }
+                else
+                    fat[prev] = copy[0];
+                fat[copy[0]] = FAT_EOF;
+                release(lastBlk);
+                lastBlk = copy[0];
+            }
+            disk.write(lastBlk, last_buf);
+        }
+
+        int need = (size - written + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        std::vector<int> blocks;
+        if (!allocBlocks(need, blocks, lastBlk + 1))
+            return -1;
+
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            uint8_t buf[BLOCK_SIZE] = {0};
+            int n = std::min(BLOCK_SIZE, size - written);
+            std::memcpy(buf, data + written, n);
+            disk.write(blocks[i], buf);
+
+            fat[lastBlk] = blocks[i];
+            fat[blocks[i]] = FAT_EOF;
+            lastBlk = blocks[i];
+            written += n;
+        }
+        setTail(entry.first_blk, lastBlk);
+
+        entry.size += size;
+        return 0;
+    }
+
+    int ino = entry.first_blk;
+    std::vector<extent> ext;
+    loadExtents(ino, ext);
+
+    // the old packed tail goes in front of the new data; it is released
+    // only once the new layout is stored
+    const int added = size;
+    const int old_len = inodes[ino].tail_len;
+    extent old_tail = { 0, 0 };
+    std::vector<uint8_t> joined;
+    if (old_len)
+    {
+        old_tail = ext.back();
+        ext.pop_back();
+        joined.resize(old_len);
+        readTail(disk, old_tail, joined.data(), old_len);
+        joined.insert(joined.end(), data, data + size);
+        data = joined.data();
+        size = joined.size();
+        used = 0; // the remaining extents end on a block boundary
+    }
+
+    // preallocated blocks after the data are filled before new ones
+    std::vector<extent> reserved;
+    if (!old_len)
+        splitExtents(ext, (entry.size + BLOCK_SIZE - 1) / BLOCK_SIZE, reserved);
+
+    // shared blocks are never changed in place: on dedup volumes, or when a
+    // snapshot holds it, a partly used last block is taken out and rewritten
+    // like a packed tail; a hole there is taken out as zeros
+    extent old_last = { 0, 0 };
+    if (used != 0 && !ext.empty())
+    {
+        bool hole = ext.back().start == EXTENT_HOLE;
+        int lastBlk = ext.back().start + ext.back().len - 1;
+        if (hole || hasFeature(FEAT_DEDUP) || isPinned(lastBlk))
+        {
+            uint8_t last_buf[BLOCK_SIZE] = {0};
+            if (!hole)
+            {
+                old_last.start = lastBlk;
+                old_last.len = 1;
+                disk.read(lastBlk, last_buf);
+            }
+            if (--ext.back().len == 0)
+                ext.pop_back();
+            std::vector<uint8_t> front(last_buf, last_buf + used);
+            front.insert(front.end(), data, data + size);
+            joined.swap(front);
+            data = joined.data();
+            size = joined.size();
+            used = 0;
+        }
+    }
+
+    // continue after the last block, else near the file's directory
+    if (!ext.empty() && ext.back().start != EXTENT_HOLE)
+    {
+        int lastBlk = ext.back().start + ext.back().len - 1;
+        goal = lastBlk + 1;
+        if (used != 0)
+        {
+            uint8_t last_buf[BLOCK_SIZE];
+            disk.read(lastBlk, last_buf);
+            written = std::min(BLOCK_SIZE - used, size);
+            std::memcpy(last_buf + used, data, written);
+            disk.write(lastBlk, last_buf);
+        }
+    }
+
+    std::vector<extent> filled;
+    if (written < size && !reserved.empty())
+    {
+        std::vector<extent> left;
+        int want = (size - written + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        filled.swap(reserved);
+        splitExtents(filled, want, left);
+        reserved.swap(left);
+        writeExtents(disk, filled, data + written, size - written);
+        written += std::min(extentBlocks(filled) * BLOCK_SIZE, size - written);
+        goal = filled.back().start + filled.back().len;
+    }
+
+    int rest = (size - written) % BLOCK_SIZE;
+    bool pack = hasFeature(FEAT_PACK) && rest > 0;
+    int bytes = size - written - (pack ? rest : 0); // going to whole blocks
+
+    std::vector<extent> more;
+    if (!writeBlocks(data + written, bytes, goal, more))
+        return -1;
+    extent where = { 0, 0 };
+    if (pack && !allocTail(rest, where))
+    {
+        freeExtents(more);
+        return -1;
+    }
+    if (pack)
+        writeTail(disk, where, data + size - rest, rest);
+
+    for (size_t k = 0; k < filled.size(); k++)
+        addExtent(ext, filled[k]);
+    for (size_t k = 0; k < more.size(); k++)
+        addExtent(ext, more[k]);
+    if (pack)
+        ext.push_back(where);
+    for (size_t k = 0; k < reserved.size(); k++)
+        addExtent(ext, reserved[k]);
+    if (!storeExtents(ino, ext))
+    {
+        freeExtents(more);
+        if (pack)
+            freeTail(where);
+        return -1;
+    }
+
+    if (old_len)
+        freeTail(old_tail);
+    if (old_last.len)
+        freeExtents(std::vector<extent>(1, old_last));
+    inodes[ino].tail_len = pack ? rest : 0;
+    if (reserved.empty())
+        inodes[ino].flags &= ~INODE_PREALLOC;
+    markInode(ino);
+
+    entry.size += added;
+    return 0;
+}
+
+// Releases the data (and inode) of a file in the in-memory FAT / inode table.
+void FS::freeData(const dir_entry &entry)
+{
+    if (!hasInode(entry))
+    {
+        freeChain(entry.first_blk);
+        return;
+    }
+
+    int ino = entry.first_blk;
+    if (inodes[ino].kind == INODE_COMPRESSED)
+    {
+        std::vector<extent> chunks;
+        loadExtents(ino, chunks);
+        for (size_t k = 0; k < chunks.size(); k++)
+            freeChunk(chunks[k]);
+        if (inodes[ino].indirect)
+            release(inodes[ino].indirect);
+    }
+    else if (inodes[ino].kind == INODE_EXTENT)
+    {
+        std::vector<extent> ext;
+        loadExtents(ino, ext);
+        if (inodes[ino].tail_len)
+        {
+            freeTail(ext.back());
+            ext.pop_back();
+        }
+        freeExtents(ext);
+        if (inodes[ino].indirect)
+            release(inodes[ino].indirect);
+    }
+
+    std::memset(&inodes[ino], 0, sizeof(inode));
+    markInode(ino);
+}
+
+// Inline files take no block and packed tails are not counted, compressed
+// files count the blocks of their chunks; an extent file counts its extents
+// without holes (and with preallocated blocks), while a FAT chain always has
+// at least one block.
+int FS::dataBlocks(const dir_entry &entry)
+{
+    if (!hasInode(entry))
+        return blocksFor(entry.size);
+    const inode &in = inodes[entry.first_blk];
+    if (in.kind == INODE_INLINE)
+        return 0;
+    if (in.kind == INODE_COMPRESSED)
+    {
+        std::vector<extent> chunks;
+        loadExtents(entry.first_blk, chunks);
+        int n = 0;
+        for (size_t k = 0; k < chunks.size(); k++)
+            n += (chunks[k].len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        return n;
+    }
+    std::vector<extent> ext;
+    loadExtents(entry.first_blk, ext);
+    if (in.tail_len)
+        ext.pop_back();
+    int n = 0;
+    for (size_t k = 0; k < ext.size(); k++)
+        if (ext[k].start != EXTENT_HOLE)
+            n += ext[k].len;
+    return n;
+}
+
+FS::FS() : pool(std::max(4u, std::thread::hardware_concurrency()))
+{
+    cwd_blk = ROOT_BLOCK;
+    cwd_valid = true;
+    defrag_background = false;
+    data_goal = 0;
+    view = -1;
+    root_blk = ROOT_BLOCK;
+    fat_blk = FAT_BLOCK;
+    std::cout << "FS::FS()... Creating file system\n";
+    mount();
+}
+
+FS::~FS()
+{
+}
+
+// formats the disk, i.e., creates an empty file system
+// With features a superblock (block 2) and a one-block inode table (block 3)
+// are created as well, followed by the tail table for FEAT_TAILS and the
+// refcount and fingerprint blocks for FEAT_DEDUP and the snapshot table for
+// FEAT_SNAPSHOT; without, the layout is the plain FAT volume.
+int FS::format(int features)
+{
+    // a mounted snapshot is left; the snapshots are gone with the rest
+    view = -1;
+    root_blk = ROOT_BLOCK;
+    fat_blk = FAT_BLOCK;
+    snaps.clear();
+    pinned.clear();
+
+    for (int i = 0; i < BLOCK_SIZE / 2; i++)
+    {
+        fat[i] = FAT_FREE;
+    }
+
+    fat[ROOT_BLOCK] = FAT_EOF;
+    fat[FAT_BLOCK] = FAT_EOF;
+
+    std::memset(&super, 0, sizeof(super));
+    inodes.clear();
+    inode_blks.clear();
+    inode_dirty.clear();
+    tails.assign(disk.get_no_blocks(), 0);
+    tails_dirty = false;
+    packs.clear();
+    refs.clear();
+    fps.clear();
+    fp_index.clear();
+    dedup_dirty = false;
+    std::memset(&dedup_stats, 0, sizeof(dedup_stats));
+    if (features & (FEAT_PACK | FEAT_DEDUP))
+        features |= FEAT_EXTENTS;
+
+    if (features)
+    {
+        // metadata blocks follow the superblock in a fixed order
+        const int table = SUPER_BLOCK + 1;
+        int next = table + 1;
+        fat[SUPER_BLOCK] = FAT_EOF;
+        fat[table] = FAT_EOF;
+        if (features & FEAT_TAILS)
+        {
+            super.tail_blk = next++;
+            fat[super.tail_blk] = FAT_EOF;
+            tails_dirty = true;
+        }
+        if (features & FEAT_DEDUP)
+        {
+            super.dedup_blk = next;
+            for (int b = 0; b < 3; b++)
+                fat[next++] = FAT_EOF;
+            refs.assign(disk.get_no_blocks(), 0);
+            fps.assign(disk.get_no_blocks(), 0);
+            dedup_dirty = true;
+        }
+        if (features & FEAT_SNAPSHOT)
+        {
+            super.snap_blk = next++;
+            fat[super.snap_blk] = FAT_EOF;
+            snaps.resize(MAX_SNAPSHOTS);
+            std::memset(snaps.data(), 0, BLOCK_SIZE);
+            writeSnapshots();
+        }
+
+        super.magic = FS_MAGIC;
+        super.version = FS_VERSION;
+        super.features = features;
+        super.inode_blk = table;
+        super.inode_blocks = 1;
+        writeSuper();
+
+        inode_blks.push_back(table);
+        inodes.resize(INODES_PER_BLOCK);
+        std::memset(inodes.data(), 0, INODES_PER_BLOCK * sizeof(inode));
+        inode_dirty.push_back(1);
+    }
+    else
+    {
+        // make sure an old superblock is not picked up again
+        uint8_t zero[BLOCK_SIZE] = {0};
+        disk.write(SUPER_BLOCK, zero);
+    }
+
+    flushMeta();
+    dir_entry empty_dir[MAX_DIR_ENTRIES] = {};
+    writeDir(ROOT_BLOCK, empty_dir);
+    cwd_blk = ROOT_BLOCK;
+    cwd_path.clear();
+    cwd_trail.clear();
+    cwd_valid = true;
+    dir_names.clear();
+
+    return 0;
+}
+
+// Finds the slot for a new file <filepath> in the current directory; prints
+// why there is none and returns -1 if it cannot be created.
+int FS::newFileSlot(const std::string &filepath, dir_entry *dir)
+{
+    if (readOnly())
+        return -1;
+    if (filepath.length() > MAX_NAME_LEN)
+    {
+        std::cout << "File name too long\n";
+        return -1;
+    }
+
+    readDir(cwd_blk, dir);
+
+    if (findEntryIndex(dir, MAX_DIR_ENTRIES, filepath) != -1)
+    {
+        std::cout << "File already exists\n";
+        return -1;
+    }
+
+    int free_index = freeSlot(dir, filepath);
+    if (free_index == -1)
+    {
+        std::cout << "Directory full\n";
+        return -1;
+    }
+    return free_index;
+}
+
+// Stores data as the new file in slot free_index of the current directory.
+int FS::storeNewFile(const std::string &filepath, dir_entry *dir, int free_index,
+                     const uint8_t *data, int size)
+{
+    // 1. läs FAT
+    disk.read(fat_blk, (uint8_t *)fat);
+
+    // 2. Allokera block och skriv data till disken
+    if (writeData(dir[free_index], data, size, dataGoal(cwd_blk)) == -1)
+    {
+        std::cout << "Not enough disk space\n";
+        return -1;
+    }
+
+    // 3. skapa directory entry
+    strncpy(dir[free_index].file_name, filepath.c_str(), MAX_NAME_LEN);
+    dir[free_index].file_name[MAX_NAME_LEN] = '\0';
+    dir[free_index].access_rights = READ | WRITE; // 0x06
+
+    // 4. Skriv tillbaka FAT och root directory till disken
+    writeDir(cwd_blk, dir);
+    flushMeta();
+    return 0;
+}
+
+//  create <filepath> creates a new file on the disk, the data content is
+// written on the following rows (ended with an empty row)
+int FS::create(std::string filepath)
+{
+    dir_entry dir[MAX_DIR_ENTRIES];
+    int free_index = newFileSlot(filepath, dir);
+    if (free_index == -1)
+        return -1;
+
+    // Läs in data från stdin
+    std::string data, line;
+    while (std::getline(std::cin, line))
+    {
+        if (line.empty())
+            break;
+        data.append(line);
+        data.push_back('\n');
+    }
+
+    // std::cout << "FS::create(" << filepath << ")\n";
+    return storeNewFile(filepath, dir, free_index, (const uint8_t *)data.data(), data.size());
+}
+
+// The data is taken from the input before anything is checked: it follows
+// the command either way and must not be read as commands if the file
+// cannot be created. It goes straight into one buffer, from which writeData
+// fills the blocks.
+int FS::create(std::string filepath, long bytes)
+{
+    std::vector<uint8_t> data;
+    if (bytes > INT32_MAX)
+    {
+        std::cin.ignore(bytes);
+        std::cout << "File too large\n";
+        return -1;
+    }
+    // the buffer grows with the input, so a count larger than what
+    // follows costs no memory
+    char buf[1 << 16];
+    if (bytes >= 0)
+    {
+        data.reserve(std::min<long>(bytes, disk.get_disk_size()));
+        while ((long)data.size() < bytes)
+        {
+            std::cin.read(buf, std::min<long>(sizeof(buf), bytes - data.size()));
+            if (std::cin.gcount() == 0)
+                break;
+            data.insert(data.end(), buf, buf + std::cin.gcount());
+        }
+    }
+    else
+    {
+        while (std::cin.read(buf, sizeof(buf)) || std::cin.gcount() > 0)
+            data.insert(data.end(), buf, buf + std::cin.gcount());
+    }
+    if (bytes >= 0 && (long)data.size() < bytes)
+    {
+        std::cout << "Unexpected end of input\n";
+        return -1;
+    }
+    if (data.size() > (size_t)INT32_MAX)
+    {
+        std::cout << "File too large\n";
+        return -1;
+    }
+
+    dir_entry dir[MAX_DIR_ENTRIES];
+    int free_index = newFileSlot(filepath, dir);
+    if (free_index == -1)
+        return -1;
+    return storeNewFile(filepath, dir, free_index, data.data(), data.size());
+}
+
+// cat <filepath> reads the content of a file and prints it on the screen
+int FS::cat(std::string path)
+{
+
+    int parent;
+    std::string name;
+
+    // 1) Resolve path -> parent directory block + entry name
+    if (!resolvePath(path, parent, name))
+    {
+        std::cout << "File not found\n";
+        return -1;
+    }
+
+    // 2) Read parent directory
+    dir_entry dir[MAX_DIR_ENTRIES];
+    readDir(parent, dir);
+
+    // 3) Find entry
+    int idx = findEntryIndex(dir, MAX_DIR_ENTRIES, name);
+    if (idx == -1)
+    {
+        std::cout << "File not found\n";
+        return -1;
+    }
+
+    dir_entry &entry = dir[idx];
+
+    // 4) Must be a file
+    if (isDir(entry))
+    {
+        std::cout << "Not a file\n";
+        return -1;
+    }
+
+    // 5) Check READ permission
+    if (!(entry.access_rights & READ))
+    {
+        std::cout << "Permission denied\n";
+        return -1;
+    }
+
+    // 6) Read FAT
+    disk.read(fat_blk, (uint8_t *)fat);
+
+    // 7) Read the blocks (FAT chain or extents) and print them
+    std::vector<uint8_t> data;
+    readData(entry, data);
+    std::cout.write((char *)data.data(), data.size());
+
+    return 0;
+}
+
+int FS::ls(int order, const std::string &after, int limit)
+{
+    std::vector<dir_entry> entries;
+    bool more = false;
+    if (order == LS_SLOT)
+    {
+        dir_entry dir[MAX_DIR_ENTRIES];
+        readDir(cwd_blk, dir);
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+            if (dir[i].file_name[0] != '\0')
+                entries.push_back(dir[i]);
+    }
+    else if (listPage(cwd_blk, order, after, limit, entries, more) == -1)
+    {
+        std::cout << "File not found\n";
+        return -1;
+    }
+
+    std::cout << std::left
+              << std::setw(17) << "name"
+              << std::setw(11) << "type"
+              << std::setw(16) << "accessrights"
               << "size\n";
 
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const dir_entry &e = entries[i];
+        uint8_t r = e.access_rights;
+
+        std::string rights;
+        if (isFile(e))
+        {
+            rights += (r & READ) ? 'r' : '-';
+            rights += (r & WRITE) ? 'w' : '-';
+            rights += '-';
+        }
+        else
+        {
+            rights += (r & READ) ? 'r' : '-';
+            rights += (r & WRITE) ? 'w' : '-';
+            rights += (r & EXECUTE) ? 'x' : '-';
+        }
+
+        std::cout << std::left
+                  << std::setw(17) << e.file_name
+                  << std::setw(11) << (isDir(e) ? "dir" : "file")
+                  << std::setw(16) << rights;
+
+        if (isDir(e))
+            std::cout << "-\n";
+        else
+
+            std::cout << e.size << "\n";
+    }
+
+    // the cursor for the next page
+    if (more)
+        std::cout << "more after " << entries.back().file_name << "\n";
+
+    return 0;
+}
+
+// cp <sourcepath> <destpath> makes an exact copy of the file
+// <sourcepath> to a new file <destpath>
+int FS::cp(std::string srcpath, std::string dstpath, bool recursive)
+{
+    if (readOnly())
+        return -1;
+
+    // ---------- 1) Resolve source ----------
+    int src_parent;
+    std::string src_name;
+
+    if (!resolvePath(srcpath, src_parent, src_name))
+    {
+        std::cout << "Source file not found\n";
+        return -1;
+    }
+
+    dir_entry src_dir[MAX_DIR_ENTRIES];
+    readDir(src_parent, src_dir);
+
+    int src_idx = findEntryIndex(src_dir, MAX_DIR_ENTRIES, src_name);
+    if (src_idx == -1 || (isDir(src_dir[src_idx]) && !recursive) ||
+        src_name == "..")
+    {
+        std::cout << "Source file not found\n";
+        return -1;
+    }
+
+    dir_entry &src_entry = src_dir[src_idx];
+
+    // ---------- 2) Resolve destination ----------
+    int dst_parent;
+    std::string dst_name;
+
+    if (!resolvePath(dstpath, dst_parent, dst_name))
+    {
+        std::cout << "Destination not found\n";
+        return -1;
+    }
+
+    dir_entry dst_dir[MAX_DIR_ENTRIES];
+    readDir(dst_parent, dst_dir);
+
+    // If destination name exists and is a directory -> copy into it using same src name
+    int dst_idx = findEntryIndex(dst_dir, MAX_DIR_ENTRIES, dst_name);
+    if (dst_idx != -1 && dst_dir[dst_idx].type == TYPE_DIR)
+    {
+        dst_parent = dst_dir[dst_idx].first_blk;
+        readDir(dst_parent, dst_dir);
+        dst_name = src_name;
+    }
+
+    // ---------- 3) Noclobber: destination file must not exist ----------
+    if (findEntryIndex(dst_dir, MAX_DIR_ENTRIES, dst_name) != -1)
+    {
+        std::cout << "File already exists\n";
+        return -1;
+    }
+
+    if (dst_name.length() > MAX_NAME_LEN)
+    {
+        std::cout << "File name too long\n";
+        return -1;
+    }
+
+    // ---------- 4) Find free entry slot ----------
+    int free_idx = freeSlot(dst_dir, dst_name);
+    if (free_idx == -1)
+    {
+        std::cout << "Directory full\n";
+        return -1;
+    }
+
+    // ---------- 5) Allocate blocks ----------
+    disk.read(fat_blk, (uint8_t *)fat);
+
+    if (isDir(src_entry))
+    {
+        // a directory can not be copied into itself
+        if (inSubtree(dst_parent, src_entry.first_blk))
+        {
+            std::cout << "Cannot copy directory into itself\n";
+            return -1;
+        }
+
+        int new_blk = copyTree(src_entry.first_blk, dst_parent);
+        if (new_blk == -1)
+        {
+            std::cout << "Not enough disk space\n";
+            return -1;
+        }
+
+        dst_dir[free_idx] = src_entry;
+        std::strncpy(dst_dir[free_idx].file_name, dst_name.c_str(), MAX_NAME_LEN);
+        dst_dir[free_idx].file_name[MAX_NAME_LEN] = '\0';
+        dst_dir[free_idx].first_blk = new_blk;
+        learnDir(new_blk, dst_parent, dst_name);
+
+        writeDir(dst_parent, dst_dir);
+        flushMeta();
+        return 0;
+    }
+
+    // ---------- 6) Copy the data into newly allocated blocks ----------
+    std::vector<uint8_t> data;
+    readData(src_entry, data);
+    if (writeData(dst_dir[free_idx], data.data(), data.size(), dataGoal(dst_parent)) == -1)
+    {
+        std::cout << "Not enough disk space\n";
+        return -1;
+    }
+
+    // ---------- 7) Create destination directory entry ----------
+    std::strncpy(dst_dir[free_idx].file_name, dst_name.c_str(), MAX_NAME_LEN);
+    dst_dir[free_idx].file_name[MAX_NAME_LEN] = '\0';
+    dst_dir[free_idx].access_rights = src_entry.access_rights;
+
+    // ---------- 8) Persist ----------
+    writeDir(dst_parent, dst_dir);
+    flushMeta();
+
+    return 0;
+}
+
+// mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
+// or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
+int FS::mv(std::string srcpath, std::string dstpath)
+{
+    if (readOnly())
+        return -1;
+
+    // ---------- 1) Resolve source ----------
+    int src_parent;
+    std::string src_name;
+
+    if (!resolvePath(srcpath, src_parent, src_name))
+    {
+        std::cout << "File not found\n";
+        return -1;
+    }
+
+    dir_entry src_dir[MAX_DIR_ENTRIES];
+    readDir(src_parent, src_dir);
+
+    int src_idx = findEntryIndex(src_dir, MAX_DIR_ENTRIES, src_name);
+    if (src_idx == -1 || src_name == "..")
+    {
+        std::cout << "File not found\n";
+        return -1;
+    }
+
+    // ---------- 2) Resolve destination ----------
+    int dst_parent;
+    std::string dst_name;
+
+    if (!resolvePath(dstpath, dst_parent, dst_name))
+    {
+        std::cout << "Destination not found\n";
+        return -1;
+    }
+
+    dir_entry dst_dir[MAX_DIR_ENTRIES];
+    readDir(dst_parent, dst_dir);
+
+    // If dst_name exists and is a directory => move into it, keep same filename
+    int dst_idx = findEntryIndex(dst_dir, MAX_DIR_ENTRIES, dst_name);
+    if (dst_idx != -1 && dst_dir[dst_idx].type == TYPE_DIR)
+    {
+        dst_parent = dst_dir[dst_idx].first_blk;
+        readDir(dst_parent, dst_dir);
+        dst_name = src_name;
+    }
+
+    // ---------- 3) Noclobber: destination name must not exist ----------
+    if (findEntryIndex(dst_dir, MAX_DIR_ENTRIES, dst_name) != -1)
+    {
+        std::cout << "File already exists\n";
+        return -1;
+    }
+
+    if (dst_name.length() > MAX_NAME_LEN)
+    {
+        std::cout << "File name too long\n";
+        return -1;
+    }
+
+    // A directory must not end up inside itself
+    bool moving_dir = isDir(src_dir[src_idx]);
+    if (moving_dir && inSubtree(dst_parent, src_dir[src_idx].first_blk))
+    {
+        std::cout << "Cannot move directory into itself\n";
+        return -1;
+    }
+
+    // ---------- 4) Find free slot in destination directory ----------
+    int free_idx = freeSlot(dst_dir, dst_name);
+    if (free_idx == -1)
+    {
+        std::cout << "Directory full\n";
+        return -1;
+    }
+
+    // ---------- 5) Move directory entry ----------
+    dst_dir[free_idx] = src_dir[src_idx];
+
+    std::strncpy(dst_dir[free_idx].file_name, dst_name.c_str(), MAX_NAME_LEN);
+    dst_dir[free_idx].file_name[MAX_NAME_LEN] = '\0';
+
+    // A renamed or moved directory invalidates a cached cwd path through it
+    if (moving_dir)
+    {
+        int moved_blk = dst_dir[free_idx].first_blk;
+        learnDir(moved_blk, dst_parent, dst_name);
+        if (std::find(cwd_trail.begin(), cwd_trail.end(), moved_blk) != cwd_trail.end())
+            cwd_valid = false;
+    }
+
+    // Renaming within the same directory: both views are the same block
+    if (dst_parent == src_parent)
+    {
+        std::memset(&dst_dir[src_idx], 0, sizeof(dir_entry));
+        writeDir(dst_parent, dst_dir);
+        return 0;
+    }
+
+    std::memset(&src_dir[src_idx], 0, sizeof(dir_entry));
+
+    // ---------- 6) A moved directory gets a new ".." ----------
+    if (moving_dir)
+    {
+        int moved_blk = dst_dir[free_idx].first_blk;
+        dir_entry moved[MAX_DIR_ENTRIES];
+        readDir(moved_blk, moved);
+
+        int up = findEntryIndex(moved, MAX_DIR_ENTRIES, "..");
+        if (up != -1)
+        {
+            moved[up].first_blk = dst_parent;
+            writeDir(moved_blk, moved);
+        }
+    }
+
+    // ---------- 7) Write back ----------
+    writeDir(src_parent, src_dir);
+    writeDir(dst_parent, dst_dir);
+
+    return 0;
+}
+
+int FS::rm(std::string path, bool recursive)
+{
+    if (readOnly())
+        return -1;
+    int parentBlk;
+    std::string name;
+
+    // 1) Resolve path -> parent directory block + object name
+    if (!resolvePath(path, parentBlk, name))
+    {
+        std::cout << "File not found\n";
+        return -1;
+    }
+
+    // 2) Read parent directory (where the entry lives)
+    dir_entry parentDir[MAX_DIR_ENTRIES];
+    readDir(parentBlk, parentDir);
+
+    // 3) Find the entry to remove
+    int idx = findEntryIndex(parentDir, MAX_DIR_ENTRIES, name);
+    if (idx == -1 || name == "..")
+    {
+        std::cout << "File not found\n";
+        return -1;
+    }
+
+    dir_entry &entry = parentDir[idx];
+
+    // 4) Check WRITE permission on the object itself
+    if (!(entry.access_rights & WRITE))
+    {
+        std::cout << "Permission denied\n";
+        return -1;
+    }
+
+    // 5) rm -r: collect the whole subtree first so nothing is changed unless
+    //    every object in it may be removed, then free it in one FAT pass
+    if (isDir(entry) && recursive)
+    {
+        std::vector<dir_node> nodes;
+        walk(entry.first_blk, "", nodes, false);
+
+        std::vector<dir_entry> files;
+        for (size_t d = 0; d < nodes.size(); d++)
+        {
+            if (nodes[d].blk == cwd_blk)
+            {
+                std::cout << "Cannot remove current directory\n";
+                return -1;
+            }
+
+            for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+            {
+                const dir_entry &e = nodes[d].entries[i];
+                if (e.file_name[0] == '\0' || std::strcmp(e.file_name, "..") == 0)
+                    continue;
+
+                if (!(e.access_rights & WRITE))
+                {
+                    std::cout << "Permission denied\n";
+                    return -1;
+                }
+                if (isFile(e))
+                    files.push_back(e);
+            }
+        }
+
+        disk.read(fat_blk, (uint8_t *)fat);
+        for (size_t i = 0; i < files.size(); i++)
+            freeData(files[i]);
+        for (size_t d = 0; d < nodes.size(); d++)
+        {
+            freeChain(nodes[d].blk);
+            forgetDir(nodes[d].blk);
+        }
+
+        std::memset(&parentDir[idx], 0, sizeof(dir_entry));
+        writeDir(parentBlk, parentDir);
+        flushMeta();
+        return 0;
+    }
+
+    // 6) If entry is a directory, ensure it is empty (only ".." allowed)
+    if (entry.type == TYPE_DIR)
+    {
+        dir_entry subDir[MAX_DIR_ENTRIES];
+        readDir(entry.first_blk, subDir);
+
+        int i = dir_find_used(subDir, MAX_DIR_ENTRIES, 0);
+        while (i != -1 && std::strcmp(subDir[i].file_name, "..") == 0)
+            i = dir_find_used(subDir, MAX_DIR_ENTRIES, i + 1);
+        if (i != -1)
+        {
+            std::cout << "Directory not empty\n";
+            return -1;
+        }
+    }
+
+    if (entry.type == TYPE_DIR && entry.first_blk == cwd_blk)
+    {
+        std::cout << "Cannot remove current directory\n";
+        return -1;
+    }
+
+    // 7) Free all blocks used by the file/directory content
+    disk.read(fat_blk, (uint8_t *)fat);
+    if (isDir(entry))
+    {
+        freeChain(entry.first_blk);
+        forgetDir(entry.first_blk);
+    }
+    else
+    {
+        freeData(entry);
+    }
+
+    // 8) Remove the directory entry (mark as empty)
+    std::memset(&parentDir[idx], 0, sizeof(dir_entry));
+
+    // 9) Write back changes
+    writeDir(parentBlk, parentDir);
+    flushMeta();
+
+    return 0;
+}
+
+// append <filepath1> <filepath2> appends the contents of file <filepath1> to
+// the end of file <filepath2>. The file <filepath1> is unchanged.
+int FS::append(std::string filepath1, std::string filepath2)
+{
+    if (readOnly())
+        return -1;
+    int parent1, parent2;
+    std::string name1, name2;
+
+    // 1) Resolve both paths
+    if (!resolvePath(filepath1, parent1, name1) ||
+        !resolvePath(filepath2, parent2, name2))
+    {
+        std::cout << "File not found\n";
+        return -1;
+    }
+
+    // 2) Read both parent directories
+    dir_entry dir1[MAX_DIR_ENTRIES], dir2[MAX_DIR_ENTRIES];
+    readDir(parent1, dir1);
+    readDir(parent2, dir2);
+
+    // 3) Find source and destination entries
+    int srcIdx = findEntryIndex(dir1, MAX_DIR_ENTRIES, name1);
+    int dstIdx = findEntryIndex(dir2, MAX_DIR_ENTRIES, name2);
+
+    if (srcIdx == -1 || dstIdx == -1)
+    {
+        std::cout << "File not found\n";
+        return -1;
+    }
+
+    dir_entry &src = dir1[srcIdx];
+    dir_entry &dst = dir2[dstIdx];
+
+    // Optional but clearer/safe: both must be files
+    if (src.type == TYPE_DIR || dst.type == TYPE_DIR)
+    {
+        std::cout << "Not a file\n";
+        return -1;
+    }
+
+    // 4) Permissions
+    if (!(src.access_rights & READ) || !(dst.access_rights & WRITE))
+    {
+        std::cout << "Permission denied\n";
+        return -1;
+    }
+
+    // 5) Load FAT
+    disk.read(fat_blk, (uint8_t *)fat);
+
+    // 6) Read all data from file1 into RAM
+    std::vector<uint8_t> data1;
+    readData(src, data1);
+
+    // 7) Fill the last block of file2, then continue in new blocks
+    if (appendData(dst, data1.data(), data1.size(), dataGoal(parent2)) == -1)
+    {
+        std::cout << "Not enough disk space\n";
+        return -1;
+    }
+
+    // 8) Write back FAT + dst directory (the entry holds the new size)
+    flushMeta();
+    writeDir(parent2, dir2);
+
+    return 0;
+}
+
+// mkdir <dirpath> creates a new sub-directory with the name <dirpath>
+// in the current directory
+int FS::mkdir(std::string dirpath)
+{
+    if (readOnly())
+        return -1;
+    int parentBlk;
+    std::string name;
+
+    // 1) Resolve path -> where to create + new directory name
+    if (!resolvePath(dirpath, parentBlk, name))
+    {
+        std::cout << "Directory not found\n";
+        return -1;
+    }
+
+    if (name.length() > MAX_NAME_LEN)
+    {
+        std::cout << "Directory name too long\n";
+        return -1;
+    }
+
+    // 2) Read parent directory block
+    dir_entry parentDir[MAX_DIR_ENTRIES];
+    readDir(parentBlk, parentDir);
+
+    // 3) Name must not already exist
+    int existing = findEntryIndex(parentDir, MAX_DIR_ENTRIES, name);
+    if (existing != -1)
+    {
+        if (parentDir[existing].type == TYPE_DIR)
+            std::cout << "Directory already exists\n";
+        else
+            std::cout << "File with same name exists\n";
+        return -1;
+    }
+
+    // 4) Find free slot in parent directory
+    int free_idx = freeSlot(parentDir, name);
+    if (free_idx == -1)
+    {
+        std::cout << "Directory full\n";
+        return -1;
+    }
+
+    // 5) Read FAT and allocate a free block for the new directory, in the
+    //    block group dirGoal() picks
+    disk.read(fat_blk, (uint8_t*)fat);
+
+    std::vector<int> blocks;
+    if (!allocBlocks(1, blocks, dirGoal(parentBlk)))
+    {
+        std::cout << "No free blocks\n";
+        return -1;
+    }
+    int newDirBlk = blocks[0];
+    fat[newDirBlk] = FAT_EOF;   // mark block as used (end of chain)
+
+    // 6) Create the new directory block content:
+    //    first entry ".." points to the parent directory block
+    dir_entry newDir[MAX_DIR_ENTRIES];
+    std::memset(newDir, 0, sizeof(newDir));
+
+    std::strncpy(newDir[0].file_name, "..", MAX_NAME_LEN);
+    newDir[0].file_name[MAX_NAME_LEN] = '\0';
+    newDir[0].type = TYPE_DIR;
+    newDir[0].first_blk = parentBlk;
+    newDir[0].access_rights = READ | WRITE | EXECUTE;
+
+    writeDir(newDirBlk, newDir);
+    learnDir(newDirBlk, parentBlk, name);
+
+    // 7) Add directory entry into the parent directory
+    std::strncpy(parentDir[free_idx].file_name, name.c_str(), MAX_NAME_LEN);
+    parentDir[free_idx].file_name[MAX_NAME_LEN] = '\0';
+    parentDir[free_idx].type = TYPE_DIR;
+    parentDir[free_idx].first_blk = newDirBlk;
+    parentDir[free_idx].access_rights = READ | WRITE | EXECUTE;
+
+    // 8) Write back parent directory and FAT
+    writeDir(parentBlk, parentDir);
+    flushMeta();
+
+    return 0;
+}
+
+// cd <dirpath> changes the current (working) directory to the directory named <dirpath>
+// The cached cwd path is updated component by component: ".." pops a level,
+// a name reads one directory block, and an absolute path starts from the root.
+int FS::cd(std::string path)
+{
+    if (path.empty())
+    {
+        std::cout << "Directory not found\n";
+        return -1;
+    }
+
+    if (!cwd_valid && !deriveCwdPath())
+    {
+        std::cout << "Directory not found\n";
+        return -1;
+    }
+
+    // 1) Start from the root or from the current directory
+    std::vector<std::string> names;
+    std::vector<int> trail;
+    if (path[0] != '/')
+    {
+        names = cwd_path;
+        trail = cwd_trail;
+    }
+
+    // 2) Follow the path one component at a time
+    std::vector<std::string> parts = splitPath(path);
+    for (size_t i = 0; i < parts.size(); i++)
+    {
+        if (parts[i] == ".")
+            continue;
+
+        if (parts[i] == "..")
+        {
+            // ".." of the root is the root itself
+            if (!trail.empty())
+            {
+                trail.pop_back();
+                names.pop_back();
+            }
+            continue;
+        }
+
+        int current = trail.empty() ? root_blk : trail.back();
+        dir_entry entry;
+        if (findInDir(current, parts[i], entry) == -1)
+        {
+            std::cout << "Directory not found\n";
+            return -1;
+        }
+
+        // 3) Must be a directory
+        if (entry.type != TYPE_DIR)
+        {
+            std::cout << "Not a directory\n";
+            return -1;
+        }
+
+        // 4) Need EXECUTE permission to enter
+        if (!(entry.access_rights & EXECUTE))
+        {
+            std::cout << "Permission denied\n";
+            return -1;
+        }
+
+        learnDir(entry.first_blk, current, parts[i]);
+        trail.push_back(entry.first_blk);
+        names.push_back(parts[i]);
+    }
+
+    // 5) Change current working directory
+    cwd_blk = trail.empty() ? root_blk : trail.back();
+    cwd_trail = trail;
+    cwd_path = names;
+    return 0;
+}
+
+// pwd prints the full path, i.e., from the root directory, to the current
+// directory, including the currect directory name
+// The path is kept by cd, so this normally does no disk I/O at all.
+int FS::pwd()
+{
+    if (!cwd_valid && !deriveCwdPath())
+    {
+        std::cout << "Directory not found\n";
+        return -1;
+    }
+
+    std::cout << "/";
+    for (size_t i = 0; i < cwd_path.size(); i++)
+    {
+        std::cout << cwd_path[i];
+        if (i + 1 < cwd_path.size()) std::cout << "/";
+    }
+    std::cout << "\n";
+
+    return 0;
+}
+
+// chmod <accessrights> <filepath> changes the access rights for the
+// file <filepath> to <accessrights>.
+int FS::chmod(std::string accessrights, std::string filepath)
+{
+    if (readOnly())
+        return -1;
+
+    // 1) Convert accessrights to int
+    int rights;
+    try
+    {
+        rights = std::stoi(accessrights);
+    }
+    catch (...)
+    {
+        std::cout << "Invalid access rights\n";
+        return -1;
+    }
+
+    if (rights < 0 || rights > 7)
+    {
+        std::cout << "Invalid access rights\n";
+        return -1;
+    }
+
+    // 2) Resolve path -> parent directory block + entry name
+    int parentBlk;
+    std::string name;
+
+    if (!resolvePath(filepath, parentBlk, name))
+    {
+        std::cout << "File not found\n";
+        return -1;
+    }
+
+    // 3) Read parent directory
+    dir_entry dir[MAX_DIR_ENTRIES];
+    readDir(parentBlk, dir);
+
+    // 4) Find entry and update rights
+    int idx = findEntryIndex(dir, MAX_DIR_ENTRIES, name);
+    if (idx == -1)
+    {
+        std::cout << "File not found\n";
+        return -1;
+    }
+
+    dir[idx].access_rights = rights;
+    writeDir(parentBlk, dir);
+    return 0;
+}
+
+// du [<path>] prints the disk usage of every directory below <path>
+// (default the current directory); sub-directories come before their parent
+int FS::du(std::string path)
+{
+    dir_entry top;
+    if (!lookup(path, top))
+    {
+        std::cout << "Directory not found\n";
+        return -1;
+    }
+
+    std::string label = path.empty() ? "." : path;
+    std::cout << std::left << std::setw(11) << "size" << std::setw(8) << "blocks" << "path\n";
+
+    if (isFile(top))
+    {
+        std::cout << std::left << std::setw(11) << top.size
+                  << std::setw(8) << dataBlocks(top) << label << "\n";
+        return 0;
+    }
+
+    // The ordered walk yields a depth-first pre-order; running it backwards
+    // completes the totals of all children before their parent is printed
+    std::vector<dir_node> nodes;
+    walk(top.first_blk, label, nodes, true);
+
+    std::vector<long> bytes(nodes.size(), 0);
+    std::vector<long> used(nodes.size(), 1);
+    for (size_t n = 0; n < nodes.size(); n++)
+    {
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        {
+            const dir_entry &e = nodes[n].entries[i];
+            if (e.file_name[0] != '\0' && isFile(e))
+            {
+                bytes[n] += e.size;
+                used[n] += dataBlocks(e);
+            }
+        }
+    }
+
+    for (int n = (int)nodes.size() - 1; n >= 0; n--)
+    {
+        if (nodes[n].parent != -1)
+        {
+            bytes[nodes[n].parent] += bytes[n];
+            used[nodes[n].parent] += used[n];
+        }
+        std::cout << std::left << std::setw(11) << bytes[n]
+                  << std::setw(8) << used[n] << nodes[n].path << "\n";
+    }
+
+    return 0;
+}
+
+// stat <path>... prints the entry of every path with the blocks of its data
+// and the runs they form; one bulk lookup serves all of them
+int FS::stat(const std::vector<std::string> &paths)
+{
+    std::vector<file_stat> stats;
+    statPaths(paths, stats);
+
+    std::cout << std::left << std::setw(11) << "size" << std::setw(8) << "blocks"
+              << std::setw(6) << "runs" << std::setw(6) << "type" << std::setw(8) << "rights"
+              << "path\n";
+    int result = 0;
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        const dir_entry &e = stats[i].entry;
+        if (!stats[i].found)
+        {
+            std::cout << paths[i] << ": File not found\n";
+            result = -1;
+            continue;
+        }
+        std::string rights;
+        rights += (e.access_rights & READ) ? 'r' : '-';
+        rights += (e.access_rights & WRITE) ? 'w' : '-';
+        rights += (e.access_rights & EXECUTE) ? 'x' : '-';
+        std::cout << std::left << std::setw(11) << (isDir(e) ? std::string("-") : std::to_string(e.size))
+                  << std::setw(8) << stats[i].blocks << std::setw(6) << stats[i].runs
+                  << std::setw(6) << (isDir(e) ? "dir" : "file") << std::setw(8) << rights
+                  << paths[i] << "\n";
+    }
+    return result;
+}
+
+// Matches a name against a shell-style pattern with '*' and '?' wildcards.
+static bool globMatch(const char *pattern, const char *name)
+{
+    const char *star = nullptr;
+    const char *resume = nullptr;
+
+    while (*name)
+    {
+        if (*pattern == '?' || *pattern == *name)
+        {
+            pattern++;
+            name++;
+        }
+        else if (*pattern == '*')
+        {
+            star = pattern++;
+            resume = name;
+        }
+        else if (star)
+        {
+            pattern = star + 1;
+            name = ++resume;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == '\0';
+}
+
+// find [-s] <pattern> [<path>] prints every file and directory below <path>
+// whose name matches the pattern. Matches are printed as soon as their
+// directory has been read unless sorted output is requested.
+int FS::find(std::string pattern, std::string path, bool sorted)
+{
+    dir_entry top;
+    if (!lookup(path, top) || !isDir(top))
+    {
+        std::cout << "Directory not found\n";
+        return -1;
+    }
+
+    std::mutex out;
+    std::vector<dir_node> nodes;
+    walk(top.first_blk, path.empty() ? "." : path, nodes, sorted,
+         [&pattern, &out](const dir_node &node)
+         {
+             std::string prefix = node.path == "/" ? "" : node.path;
+             std::string found;
+             for (size_t i = 0; i < node.entries.size(); i++)
+             {
+                 const dir_entry &e = node.entries[i];
+                 if (e.file_name[0] == '\0' || std::strcmp(e.file_name, "..") == 0)
+                     continue;
+                 if (globMatch(pattern.c_str(), e.file_name))
+                     found += prefix + "/" + e.file_name + "\n";
+             }
+             std::lock_guard<std::mutex> guard(out);
+             std::cout << found;
+         });
+
+    return 0;
+}
+
+// dedup prints how much space block sharing saves on a FEAT_DEDUP volume, and
+// what the write path paid for it since the volume was mounted
+int FS::dedup()
+{
+    if (readOnly())
+        return -1;
+    if (!hasFeature(FEAT_DEDUP))
+    {
+        std::cout << "Volume not formatted with dedup\n";
+        return -1;
+    }
+
+    long logical = 0, physical = 0;
+    for (size_t b = 0; b < refs.size(); b++)
+    {
+        if (refs[b])
+        {
+            logical += refs[b];
+            physical++;
+        }
+    }
+
+    std::cout << std::left << std::setw(20) << "referenced blocks" << logical << "\n"
+              << std::setw(20) << "stored blocks" << physical << "\n"
+              << std::setw(20) << "saved blocks" << logical - physical << " ("
+              << (logical - physical) * BLOCK_SIZE << " bytes)\n"
+              << std::setw(20) << "dedup ratio" << std::fixed << std::setprecision(2)
+              << (physical ? (double)logical / physical : 1.0) << "\n";
+    std::cout << std::setw(20) << "blocks written" << dedup_stats.blocks << " ("
+              << dedup_stats.shared << " shared)\n"
+              << std::setw(20) << "verify reads" << dedup_stats.verified << " ("
+              << dedup_stats.collisions << " collisions)\n"
+              << std::setw(20) << "hash+lookup time" << dedup_stats.us << " us ("
+              << (dedup_stats.blocks ? (double)dedup_stats.us / dedup_stats.blocks : 0.0)
+              << " us/block)\n";
+    std::cout.unsetf(std::ios::fixed);
+    std::cout << std::setprecision(6);
+    return 0;
+}
+
+// df prints the free and used space of the disk. Everything is counted from
+// the FAT: every FAT chain (directories, files without extents and the
+// metadata blocks) ends in one FAT_EOF entry, extent blocks are FAT_USED and
+// blocks only snapshots still use are FAT_SNAP.
+int FS::df()
+{
+    disk.read(fat_blk, (uint8_t *)fat);
+    int total = disk.get_no_blocks();
+    int snap_blks = fat_count(fat, total, FAT_SNAP);
+
+    // 1) free space and the longest run of it
+    int free_blks = fat_count(fat, total, FAT_FREE);
+    int largest = 0;
+    int i = fat_find(fat, total, 0, FAT_FREE);
+    while (i != -1)
+    {
+        int end = fat_find_other(fat, total, i, FAT_FREE);
+        largest = std::max(largest, (end == -1 ? total : end) - i);
+        i = end == -1 ? -1 : fat_find(fat, total, end, FAT_FREE);
+    }
+
+    // 2) what the used blocks are
+    int used = total - free_blks - snap_blks;
+    int chains = fat_count(fat, total, FAT_EOF);
+    int unchained = fat_count(fat, total, FAT_USED);
+
+    std::cout << std::left << std::setw(20) << "total blocks" << total << " ("
+              << (long)total * BLOCK_SIZE << " bytes)\n"
+              << std::setw(20) << "used blocks" << used << " ("
+              << (long)used * BLOCK_SIZE << " bytes, " << used * 100 / total << "%)\n"
+              << std::setw(20) << "free blocks" << free_blks << " ("
+              << (long)free_blks * BLOCK_SIZE << " bytes)\n"
+              << std::setw(20) << "largest free run" << largest << " blocks\n"
+              << std::setw(20) << "FAT chains" << chains << "\n"
+              << std::setw(20) << "extent blocks" << unchained << "\n";
+    if (hasFeature(FEAT_SNAPSHOT))
+        std::cout << std::setw(20) << "snapshot blocks" << snap_blks << " ("
+                  << (long)snap_blks * BLOCK_SIZE << " bytes)\n";
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// fsck
+//
+// Every directory entry claims the blocks it uses. The claims are collected
+// in parallel while walk() reads the directory tree; ownership is decided
+// afterwards on one thread, depth-first from the root in slot order, so the
+// first entry to claim a block keeps it and the report does not depend on
+// thread timing. All repairs are made on copies and only written back if
+// fsck was asked to repair.
+// ---------------------------------------------------------------------------
+
+// what a block is used as
+enum { CLAIM_META, CLAIM_CHAIN, CLAIM_DIR, CLAIM_EXTENT, CLAIM_DATA, CLAIM_TAIL };
+
+struct fsck_claim {
+    int blk;
+    int kind;
+    int offset, len; // byte range in the block of a CLAIM_TAIL
+};
+
+struct fsck_entry {
+    std::vector<fsck_claim> claims;
+    std::string damage; // why the entry cannot be used; empty if it can
+    int cut;            // chain block that must end the chain, or -1
+    std::string cut_why;
+    bool stale_indirect; // the inode has an indirect block it does not use
+    int blocks;         // blocks of data (chain blocks, extents or chunks)
+};
+
+static void claim(fsck_entry &out, int blk, int kind, int offset = 0, int len = 0)
+{
+    fsck_claim c = { blk, kind, offset, len };
+    out.claims.push_back(c);
+}
+
+// Collects the blocks used by entry e; reads only the in-memory FAT and inode
+// table (and an indirect block), so it may run on several threads at once.
+void FS::fsckClaims(const dir_entry &e, fsck_entry &out)
+{
+    const int n = disk.get_no_blocks();
+    out.cut = -1;
+    out.stale_indirect = false;
+    out.blocks = 0;
+
+    if (isDir(e))
+    {
+        if (e.first_blk >= n)
+            out.damage = "directory block " + std::to_string(e.first_blk) + " is out of range";
+        else
+            claim(out, e.first_blk, CLAIM_DIR);
+        return;
+    }
+
+    if (!hasInode(e))
+    {
+        // 1) a FAT chain: follow it until FAT_EOF, a value that cannot
+        //    continue a chain, or a block it has already passed
+        if (e.first_blk < 2 || e.first_blk >= n)
+        {
+            out.damage = "first block " + std::to_string(e.first_blk) + " is out of range";
+            return;
+        }
+        std::vector<char> passed(n, 0);
+        int b = e.first_blk;
+        passed[b] = 1;
+        claim(out, b, CLAIM_CHAIN);
+        for (;;)
+        {
+            int next = fat[b];
+            if (next == FAT_EOF)
+                break;
+            if (next < 2 || next >= n)
+            {
+                out.cut = b;
+                out.cut_why = "chain is broken at block " + std::to_string(b);
+                break;
+            }
+            if (passed[next])
+            {
+                out.cut = b;
+                out.cut_why = "chain loops back at block " + std::to_string(b);
+                break;
+            }
+            b = next;
+            passed[b] = 1;
+            claim(out, b, CLAIM_CHAIN);
+        }
+        // blocks past the size are not part of the file; they are often
+        // the start of another chain this one was cross-linked to
+        int need = blocksFor(e.size);
+        if ((int)out.claims.size() > need)
+        {
+            out.claims.resize(need);
+            out.cut = out.claims.back().blk;
+            out.cut_why = "chain is longer than its size";
+        }
+        out.blocks = out.claims.size();
+        return;
+    }
+
+    // 2) an inode: its extents, chunks or packed tail, and the indirect block
+    int ino = e.first_blk;
+    if (ino >= (int)inodes.size())
+    {
+        out.damage = "inode " + std::to_string(ino) + " does not exist";
+        return;
+    }
+    const inode &in = inodes[ino];
+    if (in.kind == INODE_FREE)
+    {
+        out.damage = "inode " + std::to_string(ino) + " is free";
+        return;
+    }
+    if (in.kind == INODE_INLINE)
+        return;
+    if (in.kind != INODE_EXTENT && in.kind != INODE_COMPRESSED)
     {
-        if (dir[i].file_name[0] == '\0')
+        out.damage = "inode " + std::to_string(ino) + " has unknown kind " + std::to_string(in.kind);
+        return;
+    }
+    if (in.n_extents > INODE_EXTENTS + EXTENTS_PER_BLOCK)
+    {
+        out.damage = "inode " + std::to_string(ino) + " has too many extents";
+        return;
+    }
+
+    std::vector<extent> ext(in.ext, in.ext + std::min<int>(in.n_extents, INODE_EXTENTS));
+    if (in.n_extents > INODE_EXTENTS)
+    {
+        if (in.indirect < 2 || in.indirect >= n)
+        {
+            out.damage = "indirect block " + std::to_string(in.indirect) + " is out of range";
+            return;
+        }
+        claim(out, in.indirect, CLAIM_EXTENT);
+        extent more[EXTENTS_PER_BLOCK];
+        disk.read(in.indirect, (uint8_t *)more);
+        ext.insert(ext.end(), more, more + (in.n_extents - INODE_EXTENTS));
+    }
+    else if (in.indirect)
+        out.stale_indirect = true;
+
+    for (size_t k = 0; k < ext.size(); k++)
+    {
+        const extent &x = ext[k];
+        bool tail = in.kind == INODE_EXTENT && in.tail_len && k + 1 == ext.size();
+        if (in.kind == INODE_EXTENT && !tail && x.start == EXTENT_HOLE && x.len > 0)
+        {
+            out.blocks += x.len; // a hole covers bytes but claims nothing
+            continue;
+        }
+        int len = tail ? 1 : in.kind == INODE_COMPRESSED ? (x.len + BLOCK_SIZE - 1) / BLOCK_SIZE : x.len;
+        if (x.start < 2 || len < 1 || x.start + len > n ||
+            (tail && x.len + in.tail_len > BLOCK_SIZE) ||
+            (in.kind == INODE_COMPRESSED && x.len > COMPRESS_CHUNK))
+        {
+            out.damage = "extent " + std::to_string(k) + " of inode " + std::to_string(ino) + " is out of range";
+            out.claims.clear();
+            return;
+        }
+        if (tail)
+        {
+            claim(out, x.start, CLAIM_TAIL, x.len, in.tail_len);
             continue;
+        }
+        for (int b = x.start; b < x.start + len; b++)
+            claim(out, b, in.kind == INODE_COMPRESSED ? CLAIM_EXTENT : CLAIM_DATA);
+        out.blocks += in.kind == INODE_COMPRESSED ? 1 : len;
+    }
+}
+
+// fsck [-r] checks the whole volume; see above. Returns -1 if problems are
+// left, i.e. some were found and not repaired.
+int FS::fsck(bool repair)
+{
+    if (readOnly())
+        return -1;
 
-        uint8_t r = dir[i].access_rights;
+    // 1) load the FAT and metadata once, then read the tree in parallel
+    mount();
+    const int n = disk.get_no_blocks();
+    const bool shared_data = hasFeature(FEAT_DEDUP);
 
-        std::string rights;
-        if (dir[i].type == TYPE_FILE)
+    std::mutex lock;
+    std::map<int, std::vector<dir_entry> > dirs;
+    std::map<int, std::vector<fsck_entry> > found;
+    std::vector<dir_node> nodes;
+    walk(ROOT_BLOCK, "/", nodes, false, [&](const dir_node &node)
+    {
+        std::vector<fsck_entry> files(MAX_DIR_ENTRIES);
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
         {
-            rights += (r & READ) ? 'r' : '-';
-            rights += (r & WRITE) ? 'w' : '-';
-            rights += '-';
+            const dir_entry &e = node.entries[i];
+            if (e.file_name[0] != '\0' && std::strcmp(e.file_name, "..") != 0)
+                fsckClaims(e, files[i]);
         }
-        else
+        std::lock_guard<std::mutex> guard(lock);
+        dirs[node.blk] = node.entries;
+        found[node.blk].swap(files);
+    });
+
+    // everything below is changed on copies
+    std::vector<int16_t> nfat(fat, fat + n);
+    std::vector<inode> ninodes = inodes;
+    std::vector<uint16_t> nrefs = refs;
+    std::vector<uint16_t> ntails = tails;
+    std::set<int> dirty_dirs;
+    int problems = 0, unrepaired = 0;
+
+    // owner of each block: -1 none, -2 metadata, otherwise an index into
+    // paths; data_refs counts the extent references on dedup volumes
+    std::vector<int> owner(n, -1), kind(n, -1), data_refs(n, 0);
+    std::map<int, std::map<int, int> > tail_ranges;
+    std::vector<std::string> paths;
+    std::vector<int> inode_owner(ninodes.size(), -1);
+
+    // 2) the metadata is claimed first
+    std::vector<int> meta;
+    meta.push_back(ROOT_BLOCK);
+    meta.push_back(FAT_BLOCK);
+    if (super.magic == FS_MAGIC)
+    {
+        meta.push_back(SUPER_BLOCK);
+        meta.insert(meta.end(), inode_blks.begin(), inode_blks.end());
+        if (super.tail_blk)
+            meta.push_back(super.tail_blk);
+        for (int b = 0; super.dedup_blk && b < 3; b++)
+            meta.push_back(super.dedup_blk + b);
+        if (super.snap_blk)
+            meta.push_back(super.snap_blk);
+    }
+    // the snapshots' own chains; their data is checked when they are taken
+    for (size_t i = 0; i < snaps.size(); i++)
+    {
+        int b = snaps[i].name[0] ? snaps[i].fat_blk : 0;
+        for (uint32_t k = 0; k < snaps[i].blocks && b >= 2 && b < n; k++, b = fat[b])
+            meta.push_back(b);
+    }
+    for (size_t k = 0; k < meta.size(); k++)
+    {
+        owner[meta[k]] = -2;
+        kind[meta[k]] = CLAIM_META;
+    }
+
+    // a claim conflicts unless both sides may share the block
+    auto conflicts = [&](const fsck_claim &c) -> bool
+    {
+        if (owner[c.blk] == -1)
+            return false;
+        if (c.kind == CLAIM_DATA && kind[c.blk] == CLAIM_DATA && shared_data)
+            return false;
+        if (c.kind != CLAIM_TAIL || kind[c.blk] != CLAIM_TAIL)
+            return true;
+        std::map<int, int> &r = tail_ranges[c.blk];
+        std::map<int, int>::iterator after = r.lower_bound(c.offset);
+        if (after != r.end() && after->first < c.offset + c.len)
+            return true;
+        if (after != r.begin() && std::prev(after)->first + std::prev(after)->second > c.offset)
+            return true;
+        return false;
+    };
+    auto take = [&](const fsck_claim &c, int who)
+    {
+        owner[c.blk] = who;
+        kind[c.blk] = c.kind;
+        if (c.kind == CLAIM_DATA)
+            data_refs[c.blk]++;
+        if (c.kind == CLAIM_TAIL)
+            tail_ranges[c.blk][c.offset] = c.len;
+    };
+    auto describe = [&](int who) -> std::string
+    {
+        return who == -2 ? std::string("file system metadata") : paths[who];
+    };
+    auto report = [&](const std::string &path, const std::string &what, const std::string &fix)
+    {
+        problems++;
+        std::cout << path << ": " << what << (repair ? ", " + fix : "") << "\n";
+    };
+
+    // 3) depth-first from the root: every entry takes its blocks unless an
+    //    earlier one holds them already
+    std::vector<std::pair<int, std::string> > stack(1, std::make_pair(ROOT_BLOCK, std::string("")));
+    while (!stack.empty())
+    {
+        int dir_blk = stack.back().first;
+        std::string dir_path = stack.back().second;
+        stack.pop_back();
+        std::vector<dir_entry> &entries = dirs[dir_blk];
+        std::vector<fsck_entry> &files = found[dir_blk];
+        std::vector<std::pair<int, std::string> > below;
+
+        for (int i = 0; i < MAX_DIR_ENTRIES && i < (int)files.size(); i++)
         {
-            rights += (r & READ) ? 'r' : '-';
-            rights += (r & WRITE) ? 'w' : '-';
-            rights += (r & EXECUTE) ? 'x' : '-';
+            dir_entry &e = entries[i];
+            if (e.file_name[0] == '\0' || std::strcmp(e.file_name, "..") == 0)
+                continue;
+            fsck_entry &f = files[i];
+            std::string path = dir_path + "/" + e.file_name;
+            int who = paths.size();
+            paths.push_back(path);
+
+            bool drop = !f.damage.empty();
+            if (drop)
+                report(path, f.damage, "entry removed");
+            if (!drop && hasInode(e) && inode_owner[e.first_blk] != -1)
+            {
+                report(path, "inode " + std::to_string(e.first_blk) + " is also used by " +
+                       paths[inode_owner[e.first_blk]], "entry removed");
+                drop = true;
+            }
+
+            // a chain keeps the blocks before the first conflict, anything
+            // else gives up the entry
+            size_t k = 0;
+            while (!drop && k < f.claims.size() && !conflicts(f.claims[k]))
+                k++;
+            if (!drop && k < f.claims.size())
+            {
+                std::string what = "block " + std::to_string(f.claims[k].blk) + " is also used by " +
+                                   describe(owner[f.claims[k].blk]);
+                if (f.claims[k].kind == CLAIM_CHAIN && k > 0)
+                {
+                    report(path, what, "chain cut before it");
+                    f.claims.resize(k);
+                    f.blocks = k;
+                    f.cut = f.claims.back().blk;
+                    f.cut_why.clear();
+                }
+                else
+                {
+                    report(path, what, "entry removed");
+                    drop = true;
+                }
+            }
+            if (drop)
+            {
+                std::memset(&e, 0, sizeof(e));
+                dirty_dirs.insert(dir_blk);
+                continue;
+            }
+
+            for (size_t c = 0; c < f.claims.size(); c++)
+                take(f.claims[c], who);
+            if (hasInode(e))
+                inode_owner[e.first_blk] = who;
+            if (f.cut != -1)
+            {
+                if (!f.cut_why.empty())
+                    report(path, f.cut_why, "chain ended there");
+                nfat[f.cut] = FAT_EOF;
+            }
+            if (f.stale_indirect)
+            {
+                report(path, "inode " + std::to_string(e.first_blk) + " keeps an unused indirect block",
+                       "released");
+                ninodes[e.first_blk].indirect = 0;
+            }
+
+            if (isDir(e))
+            {
+                below.push_back(std::make_pair((int)e.first_blk, path));
+                continue;
+            }
+
+            // 4) the size must agree with the blocks found
+            long size = e.size, fixed = size;
+            bool fixable = true;
+            const inode *in = hasInode(e) ? &ninodes[e.first_blk] : 0;
+            if (!in)
+            {
+                if (blocksFor(size) != f.blocks)
+                    fixed = (long)f.blocks * BLOCK_SIZE;
+            }
+            else if (in->kind == INODE_INLINE)
+            {
+                if (size > (long)INLINE_MAX)
+                    fixed = INLINE_MAX;
+            }
+            else if (in->kind == INODE_COMPRESSED)
+            {
+                if ((size + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK != f.blocks)
+                    fixable = false;
+            }
+            else if (in->tail_len)
+            {
+                if (size != (long)f.blocks * BLOCK_SIZE + in->tail_len)
+                    fixed = (long)f.blocks * BLOCK_SIZE + in->tail_len;
+            }
+            else if (in->flags & INODE_PREALLOC)
+            {
+                if ((size + BLOCK_SIZE - 1) / BLOCK_SIZE > f.blocks)
+                    fixed = (long)f.blocks * BLOCK_SIZE;
+            }
+            else if ((size + BLOCK_SIZE - 1) / BLOCK_SIZE != f.blocks)
+                fixed = (long)f.blocks * BLOCK_SIZE;
+
+            if (!fixable)
+            {
+                problems++;
+                unrepaired++;
+                std::cout << path << ": size " << size << " does not match its " << f.blocks
+                          << " chunks, not repaired\n";
+            }
+            else if (fixed != size)
+            {
+                report(path, "size " + std::to_string(size) + " does not match its " +
+                       std::to_string(f.blocks) + " blocks", "size set to " + std::to_string(fixed));
+                e.size = fixed;
+                dirty_dirs.insert(dir_blk);
+            }
         }
 
-        std::cout << std::left
-                  << std::setw(17) << dir[i].file_name
-                  << std::setw(11) << (dir[i].type == TYPE_DIR ? "dir" : "file")
-                  << std::setw(16) << rights;
+        // sub-directories must point back here with ".."
+        for (size_t d = 0; d < below.size(); d++)
+        {
+            int blk = below[d].first;
+            std::vector<dir_entry> &sub = dirs[blk];
+            if (sub.empty())
+                continue; // not read by walk(): reached before through a cross-link
+            int up = findEntryIndex(sub.data(), MAX_DIR_ENTRIES, "..");
+            if (up != -1 && sub[up].first_blk == dir_blk && isDir(sub[up]))
+                continue;
+            if (up == -1)
+                up = freeSlot(sub.data(), "..");
+            if (up == -1)
+            {
+                problems++;
+                unrepaired++;
+                std::cout << below[d].second << ": \"..\" is missing and the directory is full\n";
+                continue;
+            }
+            report(below[d].second, "\"..\" does not point to the parent directory", "fixed");
+            std::memset(&sub[up], 0, sizeof(dir_entry));
+            std::strcpy(sub[up].file_name, "..");
+            sub[up].first_blk = dir_blk;
+            sub[up].type = TYPE_DIR;
+            sub[up].access_rights = READ | WRITE | EXECUTE;
+            dirty_dirs.insert(blk);
+        }
+        for (int d = (int)below.size() - 1; d >= 0; d--)
+            stack.push_back(below[d]);
+    }
 
-        if (dir[i].type == TYPE_DIR)
-            std::cout << "-\n";
-        else
+    // 5) inodes nobody refers to
+    for (size_t ino = 0; ino < ninodes.size(); ino++)
+    {
+        if (ninodes[ino].kind == INODE_FREE || inode_owner[ino] != -1)
+            continue;
+        report("inode " + std::to_string(ino), "not referenced by any entry", "freed");
+        std::memset(&ninodes[ino], 0, sizeof(inode));
+    }
+
+    // 6) the FAT must agree with the owners; blocks nobody owns are leaked,
+    //    unless a snapshot still uses them (FAT_SNAP)
+    int leaked = 0, unmarked = 0;
+    for (int b = 0; b < n; b++)
+    {
+        if (owner[b] == -1)
+        {
+            int16_t free_value = isPinned(b) ? FAT_SNAP : FAT_FREE;
+            if (nfat[b] != free_value)
+            {
+                if (nfat[b] == FAT_FREE || nfat[b] == FAT_SNAP)
+                    unmarked++;
+                else
+                    leaked++;
+                nfat[b] = free_value;
+            }
+            continue;
+        }
+        int want = kind[b] == CLAIM_EXTENT || kind[b] == CLAIM_DATA || kind[b] == CLAIM_TAIL ? FAT_USED : FAT_EOF;
+        bool ok = want == FAT_USED ? nfat[b] == FAT_USED : kind[b] == CLAIM_DIR ? nfat[b] == FAT_EOF : nfat[b] != FAT_FREE && nfat[b] != FAT_SNAP;
+        if (!ok)
+        {
+            unmarked++;
+            nfat[b] = want;
+        }
+    }
+    if (leaked)
+        report("FAT", std::to_string(leaked) + " blocks are marked used but not referenced", "freed");
+    if (unmarked)
+        report("FAT", std::to_string(unmarked) + " blocks are marked wrongly", "marked");
+
+    // 7) the tail table and the dedup reference counts
+    int stale_tails = 0;
+    for (int b = 0; b < (int)ntails.size() && super.tail_blk; b++)
+    {
+        if (!ntails[b])
+            continue;
+        bool chain_start = owner[b] >= 0 && kind[b] == CLAIM_CHAIN;
+        if (!chain_start || ntails[b] >= n || nfat[ntails[b]] != FAT_EOF || owner[ntails[b]] != owner[b])
+        {
+            stale_tails++;
+            ntails[b] = 0;
+        }
+    }
+    if (stale_tails)
+        report("tail table", std::to_string(stale_tails) + " entries are stale", "cleared");
 
-            std::cout << dir[i].size << "\n";
+    int bad_refs = 0;
+    for (int b = 0; b < (int)nrefs.size(); b++)
+    {
+        if (nrefs[b] != data_refs[b])
+        {
+            bad_refs++;
+            nrefs[b] = data_refs[b];
+        }
     }
+    if (bad_refs)
+        report("dedup", std::to_string(bad_refs) + " reference counts are wrong", "recounted");
 
-    return 0;
+    // 8) write the repairs back and mount the result
+    if (repair && problems > unrepaired)
+    {
+        std::memcpy(fat, nfat.data(), n * sizeof(int16_t));
+        inodes = ninodes;
+        inode_dirty.assign(inode_blks.size(), 1);
+        tails = ntails;
+        tails_dirty = true;
+        for (int b = 0; b < (int)nrefs.size(); b++)
+        {
+            refs[b] = nrefs[b];
+            if (!refs[b])
+                fps[b] = 0;
+        }
+        dedup_dirty = true;
+        flushMeta();
+        for (std::set<int>::iterator d = dirty_dirs.begin(); d != dirty_dirs.end(); ++d)
+            writeDir(*d, dirs[*d].data());
+        mount();
+        cwd_blk = ROOT_BLOCK;
+        cwd_path.clear();
+        cwd_trail.clear();
+        cwd_valid = true;
+        dir_names.clear();
+    }
+
+    if (!problems)
+        std::cout << "fsck: no problems found\n";
+    else if (repair)
+        std::cout << "fsck: " << problems << " problems found, " << problems - unrepaired << " repaired\n";
+    else
+        std::cout << "fsck: " << problems << " problems found\n";
+    return problems && (!repair || unrepaired) ? -1 : 0;
 }
 
-// cp <sourcepath> <destpath> makes an exact copy of the file
-// <sourcepath> to a new file <destpath>
-int FS::cp(std::string srcpath, std::string dstpath)
+// ---------------------------------------------------------------------------
+// defrag
+//
+// A fragmented file is moved into one free run as low on the disk as it
+// fits. The order of the writes keeps the disk consistent at every point:
+// the data is copied and the new blocks are persisted as allocated first,
+// then the directory entry or inode is switched to them, and only then are
+// the old blocks released. An interruption leaves at most leaked blocks,
+// which fsck -r reclaims.
+// ---------------------------------------------------------------------------
+
+// Blocks and runs (maximal contiguous pieces) of the data of a file. Inline
+// data, holes and packed tails take no blocks of their own and are not
+// counted; the chunks of a compressed file count as one piece where they
+// follow each other on the disk.
+void FS::fileRuns(const dir_entry &e, int &blocks, int &runs)
 {
+    blocks = runs = 0;
+    int prev_end = -1;
+    if (!hasInode(e))
+    {
+        int n = disk.get_no_blocks();
+        for (int b = e.first_blk; b > 0 && b < n && blocks < n; b = fat[b])
+        {
+            blocks++;
+            if (b != prev_end)
+                runs++;
+            prev_end = b + 1;
+        }
+        return;
+    }
 
-    // ---------- 1) Resolve source ----------
-    int src_parent;
-    std::string src_name;
+    const inode &in = inodes[e.first_blk];
+    if (in.kind != INODE_EXTENT && in.kind != INODE_COMPRESSED)
+        return;
+    std::vector<extent> ext;
+    loadExtents(e.first_blk, ext);
+    if (in.tail_len)
+        ext.pop_back();
+    for (size_t k = 0; k < ext.size(); k++)
+    {
+        if (in.kind == INODE_EXTENT && ext[k].start == EXTENT_HOLE)
+            continue;
+        int len = in.kind == INODE_COMPRESSED ? (ext[k].len + BLOCK_SIZE - 1) / BLOCK_SIZE : ext[k].len;
+        blocks += len;
+        if (ext[k].start != prev_end)
+            runs++;
+        prev_end = ext[k].start + len;
+    }
+}
 
-    if (!resolvePath(srcpath, src_parent, src_name))
+// Moves the data of the file in slot of node into one run; see above.
+// Returns the number of blocks moved, 0 if the file is not fragmented, is
+// shared with other files, or no free run is long enough.
+int FS::relocate(dir_node &node, int slot)
+{
+    dir_entry &e = node.entries[slot];
+    int blocks, runs;
+    fileRuns(e, blocks, runs);
+    if (runs < 2)
+        return 0;
+
+    // 1) the old pieces, in file order
+    std::vector<extent> old, tail;
+    int kind = hasInode(e) ? inodes[e.first_blk].kind : INODE_FREE;
+    // blocks a piece covers: a compressed chunk keeps its length in bytes
+    auto piece = [kind](const extent &x) {
+        return kind == INODE_COMPRESSED ? (x.len + BLOCK_SIZE - 1) / BLOCK_SIZE : (int)x.len;
+    };
+    if (!hasInode(e))
     {
-        std::cout << "Source file not found\n";
-        return -1;
+        for (int b = e.first_blk, k = 0; k < blocks; b = fat[b], k++)
+        {
+            if (!old.empty() && old.back().start + old.back().len == b)
+                old.back().len++;
+            else
+            {
+                extent x = { (uint16_t)b, 1 };
+                old.push_back(x);
+            }
+        }
+    }
+    else
+    {
+        loadExtents(e.first_blk, old);
+        if (inodes[e.first_blk].tail_len)
+        {
+            tail.push_back(old.back());
+            old.pop_back();
+        }
+        for (size_t k = 0; k < old.size() && !refs.empty(); k++)
+            for (int b = old[k].start; b < old[k].start + piece(old[k]) && old[k].start != EXTENT_HOLE; b++)
+                if (refs[b] > 1)
+                    return 0; // moving a shared block would break the sharing
     }
 
-    dir_entry src_dir[MAX_DIR_ENTRIES];
-    disk.read(src_parent, (uint8_t *)src_dir);
+    int start = findRun(2, disk.get_no_blocks(), blocks);
+    if (start == -1)
+        return 0;
 
-    int src_idx = findEntryIndex(src_dir, MAX_DIR_ENTRIES, src_name);
-    if (src_idx == -1 || src_dir[src_idx].type == TYPE_DIR)
+    // 2) copy the data and persist the new blocks as allocated
+    std::vector<uint8_t> buf((size_t)blocks * BLOCK_SIZE);
+    std::vector<extent> moved;
+    int pos = 0;
+    for (size_t k = 0; k < old.size(); k++)
     {
-        std::cout << "Source file not found\n";
-        return -1;
+        if (kind == INODE_EXTENT && old[k].start == EXTENT_HOLE)
+        {
+            moved.push_back(old[k]); // holes stay holes
+            continue;
+        }
+        int len = piece(old[k]);
+        disk.read_blocks(old[k].start, len, buf.data() + (size_t)pos * BLOCK_SIZE);
+        extent x = { (uint16_t)(start + pos), kind == INODE_COMPRESSED ? old[k].len : (uint16_t)len };
+        moved.push_back(x);
+        pos += len;
     }
+    disk.write_blocks(start, blocks, buf.data());
+    for (int b = start; b < start + blocks; b++)
+        fat[b] = hasInode(e) ? FAT_USED : (b + 1 < start + blocks ? b + 1 : FAT_EOF);
+    flushMeta();
 
-    dir_entry &src_entry = src_dir[src_idx];
+    // 3) switch the file over to them
+    if (!hasInode(e))
+    {
+        int first = e.first_blk;
+        e.first_blk = start;
+        writeDir(node.blk, node.entries.data());
+        if (tails[first])
+        {
+            tails[first] = 0;
+            tails_dirty = true;
+        }
+        setTail(start, start + blocks - 1);
+    }
+    else
+    {
+        if (!refs.empty())
+        {
+            // the moved blocks take over the references and fingerprints
+            for (int b = start, k = 0; k < (int)old.size(); k++)
+                for (int o = old[k].start; o < old[k].start + piece(old[k]) && old[k].start != EXTENT_HOLE; o++, b++)
+                {
+                    if (!refs[o])
+                        continue;
+                    refs[b] = 1;
+                    fps[b] = fps[o];
+                    fp_index.insert(std::make_pair(fps[b], b));
+                }
+            dedup_dirty = true;
+        }
+        std::vector<extent> ext;
+        if (kind == INODE_COMPRESSED)
+            ext = moved;
+        else
+            for (size_t k = 0; k < moved.size(); k++)
+                addExtent(ext, moved[k]);
+        ext.insert(ext.end(), tail.begin(), tail.end());
+        storeExtents(e.first_blk, ext);
+    }
+    flushMeta();
 
-    // ---------- 2) Resolve destination ----------
-    int dst_parent;
-    std::string dst_name;
+    // 4) release the old blocks
+    if (!hasInode(e))
+    {
+        for (size_t k = 0; k < old.size(); k++)
+            for (int b = old[k].start; b < old[k].start + old[k].len; b++)
+                release(b);
+    }
+    else if (kind == INODE_COMPRESSED)
+    {
+        for (size_t k = 0; k < old.size(); k++)
+            freeChunk(old[k]);
+    }
+    else
+        freeExtents(old);
+    flushMeta();
+    return blocks;
+}
 
-    if (!resolvePath(dstpath, dst_parent, dst_name))
+// fragmentation of all files: files with blocks, fragmented ones, blocks,
+// runs and the average over the files of blocks per run
+struct frag_stats {
+    int files, fragmented, blocks, runs;
+    double avg_run;
+};
+
+static frag_stats fragmentation(const std::vector<dir_node> &nodes,
+                                const std::function<void(const dir_entry &, int &, int &)> &runs_of)
+{
+    frag_stats st = { 0, 0, 0, 0, 0.0 };
+    double sum = 0;
+    for (size_t n = 0; n < nodes.size(); n++)
     {
-        std::cout << "Destination not found\n";
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        {
+            const dir_entry &e = nodes[n].entries[i];
+            if (e.file_name[0] == '\0' || !isFile(e))
+                continue;
+            int blocks, runs;
+            runs_of(e, blocks, runs);
+            if (!runs)
+                continue;
+            st.files++;
+            st.fragmented += runs > 1;
+            st.blocks += blocks;
+            st.runs += runs;
+            sum += (double)blocks / runs;
+        }
+    }
+    st.avg_run = st.files ? sum / st.files : 0.0;
+    return st;
+}
+
+// defrag moves every fragmented file into one run and prints the
+// fragmentation before and after; defrag -b switches the background mode,
+// in which idle() moves one file at a time
+int FS::defrag(bool background)
+{
+    if (readOnly())
         return -1;
+    if (background)
+    {
+        defrag_background = !defrag_background;
+        std::cout << "background defrag " << (defrag_background ? "on" : "off") << "\n";
+        return 0;
     }
 
-    dir_entry dst_dir[max];
-    disk.read(dst_parent, (uint8_t *)dst_dir);
+    disk.read(fat_blk, (uint8_t *)fat);
+    std::vector<dir_node> nodes;
+    walk(ROOT_BLOCK, "/", nodes, true);
+    auto runs_of = [this](const dir_entry &e, int &blocks, int &runs) { fileRuns(e, blocks, runs); };
+    frag_stats before = fragmentation(nodes, runs_of);
 
-    // If destination name exists and is a directory -> copy into it using same src name
-    int dst_idx = findEntryIndex(dst_dir, max, dst_name);
-    if (dst_idx != -1 && dst_dir[dst_idx].type == TYPE_DIR)
+    int files = 0, blocks = 0;
+    for (size_t n = 0; n < nodes.size(); n++)
     {
-        dst_parent = dst_dir[dst_idx].first_blk;
-        disk.read(dst_parent, (uint8_t *)dst_dir);
-        dst_name = src_name;
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        {
+            const dir_entry &e = nodes[n].entries[i];
+            if (e.file_name[0] == '\0' || !isFile(e))
+                continue;
+            int moved = relocate(nodes[n], i);
+            files += moved > 0;
+            blocks += moved;
+        }
+    }
+    frag_stats after = fragmentation(nodes, runs_of);
+
+    std::cout << std::left << std::setw(20) << "" << std::setw(11) << "before" << "after\n"
+              << std::setw(20) << "files" << std::setw(11) << before.files << after.files << "\n"
+              << std::setw(20) << "fragmented files" << std::setw(11) << before.fragmented << after.fragmented << "\n"
+              << std::setw(20) << "runs" << std::setw(11) << before.runs << after.runs << "\n"
+              << std::fixed << std::setprecision(2)
+              << std::setw(20) << "avg run length" << std::setw(11) << before.avg_run << after.avg_run << "\n";
+    std::cout.unsetf(std::ios::fixed);
+    std::cout << std::setprecision(6);
+    std::cout << "moved " << files << " files (" << blocks << " blocks)\n";
+    return 0;
+}
+
+// Called by the shell between commands. In background defrag mode the
+// first fragmented file that can be moved is moved.
+void FS::idle()
+{
+    if (!defrag_background || view != -1)
+        return;
+    disk.read(fat_blk, (uint8_t *)fat);
+    std::vector<dir_node> nodes;
+    walk(ROOT_BLOCK, "/", nodes, true);
+    for (size_t n = 0; n < nodes.size(); n++)
+    {
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        {
+            const dir_entry &e = nodes[n].entries[i];
+            if (e.file_name[0] != '\0' && isFile(e) && relocate(nodes[n], i) > 0)
+                return;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Snapshots
+//
+// Taking a snapshot copies only metadata: the FAT, every directory block,
+// the inode table and the indirect blocks go into one new FAT chain, and
+// the data blocks are shared. The live file system never changes a block a
+// snapshot uses: appends copy a shared last block first, a packed tail
+// block is not filled up any further, and a freed block stays FAT_SNAP
+// (see release()) until no snapshot uses it any more.
+// ---------------------------------------------------------------------------
+
+// Collects the blocks used by any snapshot from their FAT copies.
+void FS::loadPins()
+{
+    pinned.clear();
+    std::vector<int16_t> frozen(disk.get_no_blocks());
+    for (size_t i = 0; i < snaps.size(); i++)
+    {
+        if (!snaps[i].name[0])
+            continue;
+        if (pinned.empty())
+            pinned.assign(disk.get_no_blocks(), 0);
+        disk.read(snaps[i].fat_blk, (uint8_t *)frozen.data());
+        for (size_t b = 0; b < frozen.size(); b++)
+            if (frozen[b] != FAT_FREE)
+                pinned[b] = 1;
+    }
+}
+
+void FS::writeSnapshots()
+{
+    disk.barrier();
+    disk.write(super.snap_blk, (uint8_t *)snaps.data());
+    disk.barrier();
+}
+
+int FS::findSnapshot(const std::string &name)
+{
+    for (size_t i = 0; i < snaps.size(); i++)
+        if (name == snaps[i].name)
+            return i;
+    return -1;
+}
+
+bool FS::readOnly()
+{
+    if (view == -1)
+        return false;
+    std::cout << "Snapshot " << snaps[view].name << " is read-only\n";
+    return true;
+}
+
+// snapshot <name> takes a snapshot of the whole file system
+int FS::snapshot(std::string name)
+{
+    if (readOnly())
+        return -1;
+    if (!hasFeature(FEAT_SNAPSHOT))
+    {
+        std::cout << "Snapshots are not enabled (format with snap)\n";
+        return -1;
+    }
+    if (name.empty() || name.size() >= sizeof(snapshot_entry::name))
+    {
+        std::cout << "Invalid snapshot name\n";
+        return -1;
+    }
+    if (findSnapshot(name) != -1)
+    {
+        std::cout << "Snapshot already exists\n";
+        return -1;
+    }
+    int slot = findSnapshot("");
+    if (slot == -1)
+    {
+        std::cout << "Snapshot table is full\n";
+        return -1;
+    }
+
+    // 1) what to copy: the directories and the indirect blocks
+    disk.read(fat_blk, (uint8_t *)fat);
+    std::vector<dir_node> nodes;
+    walk(ROOT_BLOCK, "/", nodes, true);
+    std::vector<int> indirect;
+    for (size_t i = 0; i < inodes.size(); i++)
+        if (inodes[i].kind != INODE_FREE && inodes[i].indirect)
+            indirect.push_back(i);
+
+    // 2) one chain for all of it: FAT, directories, inode table, indirect
+    const int dirs_at = 1, inodes_at = dirs_at + nodes.size();
+    const int indirect_at = inodes_at + inode_blks.size();
+    const int count = indirect_at + indirect.size();
+    std::vector<int> chain;
+    if (!allocBlocks(count, chain))
+    {
+        std::cout << "Not enough disk space\n";
+        return -1;
+    }
+    for (int k = 0; k < count; k++)
+        fat[chain[k]] = k + 1 < count ? chain[k + 1] : FAT_EOF;
+
+    // 3) the directories, linked to each other's copies
+    std::unordered_map<int, int> copy_of;
+    for (size_t k = 0; k < nodes.size(); k++)
+        copy_of[nodes[k].blk] = chain[dirs_at + k];
+    for (size_t k = 0; k < nodes.size(); k++)
+    {
+        std::vector<dir_entry> &dir = nodes[k].entries;
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        {
+            if (dir[i].file_name[0] == '\0' || !isDir(dir[i]))
+                continue;
+            std::unordered_map<int, int>::iterator it = copy_of.find(dir[i].first_blk);
+            if (it != copy_of.end())
+                dir[i].first_blk = it->second;
+        }
+        writeDir(chain[dirs_at + k], dir.data());
     }
 
-    // ---------- 3) Noclobber: destination file must not exist ----------
-    if (findEntryIndex(dst_dir, MAX_DIR_ENTRIES, dst_name) != -1)
+    // 4) the inode table, pointing at copies of the indirect blocks
+    std::vector<inode> table = inodes;
+    for (size_t k = 0; k < indirect.size(); k++)
     {
-        std::cout << "File already exists\n";
-        return -1;
+        uint8_t buf[BLOCK_SIZE];
+        disk.read(inodes[indirect[k]].indirect, buf);
+        disk.write(chain[indirect_at + k], buf);
+        table[indirect[k]].indirect = chain[indirect_at + k];
     }
-
-    // ---------- 4) Find free entry slot ----------
-    int free_idx = findFreeIndex(dst_dir, max);
-    if (free_idx == -1)
+    for (size_t k = 0; k < inode_blks.size(); k++)
+        disk.write(chain[inodes_at + k], (uint8_t *)&table[k * INODES_PER_BLOCK]);
+
+    // 5) the FAT as the snapshot sees it, without the live metadata it
+    //    does not use and without other snapshots
+    const int n = disk.get_no_blocks();
+    std::vector<int16_t> frozen(fat, fat + n);
+    for (size_t k = 0; k < nodes.size(); k++)
+        if (nodes[k].blk != ROOT_BLOCK)
+            frozen[nodes[k].blk] = FAT_FREE;
+    for (size_t k = 0; k < inode_blks.size(); k++)
+        frozen[inode_blks[k]] = FAT_FREE;
+    for (size_t k = 0; k < indirect.size(); k++)
+        frozen[inodes[indirect[k]].indirect] = FAT_FREE;
+    for (size_t i = 0; i < snaps.size(); i++)
     {
-        std::cout << "Directory full\n";
-        return -1;
+        int b = snaps[i].name[0] ? snaps[i].fat_blk : 0;
+        for (uint32_t k = 0; k < snaps[i].blocks && b >= 2 && b < n; k++, b = fat[b])
+            frozen[b] = FAT_FREE;
     }
+    for (int b = 0; b < n; b++)
+        if (frozen[b] == FAT_SNAP)
+            frozen[b] = FAT_FREE;
+    disk.write(chain[0], (uint8_t *)frozen.data());
+
+    // 6) record it; from now on its blocks are not overwritten
+    snapshot_entry &s = snaps[slot];
+    std::memset(&s, 0, sizeof(s));
+    std::strncpy(s.name, name.c_str(), sizeof(s.name) - 1);
+    s.blocks = count;
+    s.fat_blk = chain[0];
+    s.root_blk = chain[dirs_at];
+    s.inode_blk = inode_blks.empty() ? 0 : chain[inodes_at];
+    s.inode_blocks = inode_blks.size();
+    flushMeta();
+    writeSnapshots();
+    loadPins();
+    return 0;
+}
 
-    // ---------- 5) Allocate blocks ----------
-    disk.read(FAT_BLOCK, (uint8_t *)fat);
-
-    int size = src_entry.size;
-    int blocks_needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+// snapshot -l lists the snapshots: the blocks of their own metadata, the
+// data blocks they see, and how many of those the live file system has
+// freed since (what deleting every snapshot using them would give back)
+int FS::listSnapshots()
+{
+    std::vector<int16_t> live(disk.get_no_blocks()), frozen(disk.get_no_blocks());
+    disk.read(FAT_BLOCK, (uint8_t *)live.data());
 
-    std::vector<int> blocks;
-    for (int i = 2; i < disk.get_no_blocks() && (int)blocks.size() < blocks_needed; i++)
+    std::cout << std::left << std::setw(20) << "name" << std::setw(10) << "metadata"
+              << std::setw(10) << "data" << "not live\n";
+    for (size_t i = 0; i < snaps.size(); i++)
     {
-        if (fat[i] == FAT_FREE)
-            blocks.push_back(i);
+        if (!snaps[i].name[0])
+            continue;
+        disk.read(snaps[i].fat_blk, (uint8_t *)frozen.data());
+        int used = 0, gone = 0;
+        for (size_t b = 0; b < frozen.size(); b++)
+        {
+            if (frozen[b] == FAT_FREE)
+                continue;
+            used++;
+            gone += live[b] == FAT_SNAP;
+        }
+        std::cout << std::setw(20) << snaps[i].name << std::setw(10) << snaps[i].blocks
+                  << std::setw(10) << used - (int)snaps[i].blocks << gone
+                  << ((int)i == view ? "  (mounted)" : "") << "\n";
     }
+    std::cout << std::right;
+    return 0;
+}
 
-    if ((int)blocks.size() < blocks_needed)
+// snapshot -d <name> deletes a snapshot; blocks no other snapshot uses and
+// the live file system has freed become free again
+int FS::deleteSnapshot(std::string name)
+{
+    if (readOnly())
+        return -1;
+    int i = findSnapshot(name);
+    if (name.empty() || i == -1)
     {
-        std::cout << "Not enough disk space\n";
+        std::cout << "Snapshot not found\n";
         return -1;
     }
 
-    // ---------- 6) Copy data block-by-block and link FAT ----------
-    int cur = src_entry.first_blk;
+    disk.read(fat_blk, (uint8_t *)fat);
+    freeChain(snaps[i].fat_blk);
+    std::memset(&snaps[i], 0, sizeof(snapshot_entry));
+    writeSnapshots();
+    loadPins();
+    for (int b = 0; b < (int)disk.get_no_blocks(); b++)
+        if (fat[b] == FAT_SNAP && !isPinned(b))
+            fat[b] = FAT_FREE;
+    flushMeta();
+    return 0;
+}
 
-    for (int i = 0; i < (int)blocks.size(); i++)
+// snapshot -m <name> mounts a snapshot read-only in place of the file
+// system; without a name (snapshot -u) the live file system comes back
+int FS::mountSnapshot(std::string name)
+{
+    int i = -1;
+    if (!name.empty())
     {
-        uint8_t buf[BLOCK_SIZE] = {0};
-        disk.read(cur, buf);
-        disk.write(blocks[i], buf);
-
-        fat[blocks[i]] = (i + 1 < (int)blocks.size()) ? blocks[i + 1] : FAT_EOF;
-        cur = fat[cur]; // follow source chain
+        i = findSnapshot(name);
+        if (i == -1)
+        {
+            std::cout << "Snapshot not found\n";
+            return -1;
+        }
+    }
+    else if (view == -1)
+    {
+        std::cout << "No snapshot is mounted\n";
+        return -1;
     }
 
-    // ---------- 7) Create destination directory entry ----------
-    std::strncpy(dst_dir[free_idx].file_name, dst_name.c_str(), MAX_NAME_LEN);
-    dst_dir[free_idx].file_name[MAX_NAME_LEN] = '\0';
-    dst_dir[free_idx].type = TYPE_FILE;
-    dst_dir[free_idx].size = size;
-    dst_dir[free_idx].first_blk = blocks[0];
-
-    // ---------- 8) Persist ----------
-    disk.write(dst_parent, (uint8_t *)dst_dir);
-    disk.write(FAT_BLOCK, (uint8_t *)fat);
-
+    view = i;
+    root_blk = i == -1 ? ROOT_BLOCK : snaps[i].root_blk;
+    fat_blk = i == -1 ? FAT_BLOCK : snaps[i].fat_blk;
+    mount();
+    cwd_blk = root_blk;
+    cwd_path.clear();
+    cwd_trail.clear();
+    cwd_valid = true;
+    dir_names.clear();
     return 0;
 }
 
-// mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
-// or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
-int FS::mv(std::string srcpath, std::string dstpath)
+// ---------------------------------------------------------------------------
+// Sparse and preallocated files
+//
+// Both need an extent file, so other files are converted first. A hole is
+// an extent with start EXTENT_HOLE: it covers blocks that were never
+// written (or were all zeros, see writeBlocks()) and reads as zeros.
+// Preallocated blocks are ordinary extents behind the data, marked by
+// INODE_PREALLOC; appendData() fills them before it allocates anything.
+// Bytes past the size in the last block are not kept zero, so growing a
+// file clears them.
+// ---------------------------------------------------------------------------
+
+// Rewrites any other kind of file (FAT chain, inline, packed tail or
+// compressed) as plain extents under a new inode. Only the in-memory state
+// changes; on failure the file is left as it was.
+int FS::plainExtents(dir_entry &entry)
 {
-    // ---------- 1) Resolve source ----------
-    int src_parent;
-    std::string src_name;
+    if (hasInode(entry) && inodes[entry.first_blk].kind == INODE_EXTENT &&
+        !inodes[entry.first_blk].tail_len)
+        return 0;
 
-    if (!resolvePath(srcpath, src_parent, src_name))
+    std::vector<uint8_t> data;
+    readData(entry, data);
+    std::vector<extent> ext;
+    if (!writeBlocks(data.data(), data.size(), 2, ext))
+        return -1;
+    int ino = allocInode();
+    if (ino == -1)
     {
-        std::cout << "File not found\n";
+        freeExtents(ext);
+        return -1;
+    }
+    std::memset(&inodes[ino], 0, sizeof(inode));
+    inodes[ino].kind = INODE_EXTENT;
+    if (!storeExtents(ino, ext))
+    {
+        freeExtents(ext);
+        inodes[ino].kind = INODE_FREE;
         return -1;
     }
 
-    dir_entry src_dir[MAX_DIR_ENTRIES];
-    disk.read(src_parent, (uint8_t *)src_dir);
+    freeData(entry);
+    entry.type = TYPE_FILE | TYPE_INODE;
+    entry.first_blk = ino;
+    return 0;
+}
 
-    int src_idx = findEntryIndex(src_dir, MAX_DIR_ENTRIES, src_name);
-    if (src_idx == -1)
+// Looks up a file for fallocate and truncate; prints why it cannot be used.
+static dir_entry *writableFile(dir_entry *dir, const std::string &name)
+{
+    int idx = findEntryIndex(dir, MAX_DIR_ENTRIES, name);
+    if (idx == -1)
     {
         std::cout << "File not found\n";
-        return -1;
+        return 0;
     }
-
-    if (isDir(src_dir[src_idx]))
+    if (!isFile(dir[idx]))
     {
-        std::cout << "Cannot move directory\n";
-        return -1;
+        std::cout << "Not a file\n";
+        return 0;
     }
+    if (!(dir[idx].access_rights & WRITE))
+    {
+        std::cout << "Permission denied\n";
+        return 0;
+    }
+    return &dir[idx];
+}
 
-    // ---------- 2) Resolve destination ----------
-    int dst_parent;
-    std::string dst_name;
-
-    if (!resolvePath(dstpath, dst_parent, dst_name))
+// fallocate <file> <bytes>: reserves blocks for the file to grow to bytes,
+// as one run right behind its data if there is room
+int FS::fallocate(std::string filepath, long bytes)
+{
+    if (readOnly())
+        return -1;
+    if (super.magic != FS_MAGIC)
     {
-        std::cout << "Destination not found\n";
+        std::cout << "Volume has no inodes (format with extent)\n";
         return -1;
     }
-
-    dir_entry dst_dir[MAX_DIR_ENTRIES];
-    disk.read(dst_parent, (uint8_t *)dst_dir);
-
-    // If dst_name exists and is a directory => move into it, keep same filename
-    int dst_idx = findEntryIndex(dst_dir, MAX_DIR_ENTRIES, dst_name);
-    if (dst_idx != -1 && dst_dir[dst_idx].type == TYPE_DIR)
+    if (bytes < 0 || bytes > INT32_MAX)
     {
-        dst_parent = dst_dir[dst_idx].first_blk;
-        disk.read(dst_parent, (uint8_t *)dst_dir);
-        dst_name = src_name;
+        std::cout << "Invalid size\n";
+        return -1;
     }
 
-    // ---------- 3) Noclobber: destination name must not exist ----------
-    if (findEntryIndex(dst_dir, MAX_DIR_ENTRIES, dst_name) != -1)
+    // 1) find the file and make it a plain extent file
+    int parentBlk;
+    std::string name;
+    if (!resolvePath(filepath, parentBlk, name))
     {
-        std::cout << "File already exists\n";
+        std::cout << "File not found\n";
         return -1;
     }
-
-    // ---------- 4) Find free slot in destination directory ----------
-    int free_idx = findFreeIndex(dst_dir, MAX_DIR_ENTRIES);
-    if (free_idx == -1)
+    dir_entry dir[MAX_DIR_ENTRIES];
+    readDir(parentBlk, dir);
+    dir_entry *e = writableFile(dir, name);
+    if (!e)
+        return -1;
+    disk.read(fat_blk, (uint8_t *)fat);
+    if (plainExtents(*e) == -1)
     {
-        std::cout << "Directory full\n";
+        std::cout << "Not enough disk space\n";
         return -1;
     }
 
-    // ---------- 5) Move directory entry ----------
-    dst_dir[free_idx] = src_dir[src_idx];
-
-    std::strncpy(dst_dir[free_idx].file_name, dst_name.c_str(), MAX_NAME_LEN);
-    dst_dir[free_idx].file_name[MAX_NAME_LEN] = '\0';
-
-    std::memset(&src_dir[src_idx], 0, sizeof(dir_entry));
-
-    // ---------- 6) Write back ----------
-    disk.write(src_parent, (uint8_t *)src_dir);
-    disk.write(dst_parent, (uint8_t *)dst_dir);
+    // 2) add the missing blocks behind everything the file has
+    int ino = e->first_blk;
+    std::vector<extent> ext, more;
+    loadExtents(ino, ext);
+    int need = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE - extentBlocks(ext);
+    if (need > 0)
+    {
+        int goal = 2;
+        for (size_t k = 0; k < ext.size(); k++)
+            if (ext[k].start != EXTENT_HOLE)
+                goal = ext[k].start + ext[k].len;
+        if (!allocExtents(need, more, goal))
+        {
+            flushMeta();
+            writeDir(parentBlk, dir);
+            std::cout << "Not enough disk space\n";
+            return -1;
+        }
+        for (size_t k = 0; k < more.size(); k++)
+        {
+            addExtent(ext, more[k]);
+            for (int b = more[k].start; b < more[k].start + more[k].len && !refs.empty(); b++)
+                refs[b] = 1; // owned, but without a fingerprint
+        }
+        dedup_dirty = !refs.empty();
+        if (!storeExtents(ino, ext))
+        {
+            freeExtents(more);
+            flushMeta();
+            writeDir(parentBlk, dir);
+            std::cout << "Too many extents\n";
+            return -1;
+        }
+        inodes[ino].flags |= INODE_PREALLOC;
+        markInode(ino);
+    }
 
+    // 3) persist the reservation, then the entry
+    flushMeta();
+    writeDir(parentBlk, dir);
     return 0;
 }
 
-int FS::rm(std::string path)
+// truncate <file> <bytes>: a shrinking file gives back the blocks past its
+// new end, a growing one gets a hole; either way a reservation ends
+int FS::truncate(std::string filepath, long bytes)
 {
-    int parentBlk;
-    std::string name;
-
-    // 1) Resolve path -> parent directory block + object name
-    if (!resolvePath(path, parentBlk, name))
+    if (readOnly())
+        return -1;
+    if (bytes < 0 || bytes > INT32_MAX)
     {
-        std::cout << "File not found\n";
+        std::cout << "Invalid size\n";
         return -1;
     }
 
-    // 2) Read parent directory (where the entry lives)
-    dir_entry parentDir[MAX_DIR_ENTRIES];
-    disk.read(parentBlk, (uint8_t *)parentDir);
-
-    // 3) Find the entry to remove
-    int idx = findEntryIndex(parentDir, MAX_DIR_ENTRIES, name);
-    if (idx == -1)
+    int parentBlk;
+    std::string name;
+    if (!resolvePath(filepath, parentBlk, name))
     {
         std::cout << "File not found\n";
         return -1;
     }
+    dir_entry dir[MAX_DIR_ENTRIES];
+    readDir(parentBlk, dir);
+    dir_entry *e = writableFile(dir, name);
+    if (!e)
+        return -1;
+    disk.read(fat_blk, (uint8_t *)fat);
 
-    dir_entry &entry = parentDir[idx];
+    // 1) without inodes the file is rewritten with the zeros written out;
+    //    the new blocks are taken before the old ones are freed
+    if (super.magic != FS_MAGIC)
+    {
+        if (blocksFor(bytes) > fat_count(fat, disk.get_no_blocks(), FAT_FREE))
+        {
+            std::cout << "Not enough disk space\n";
+            return -1;
+        }
+        std::vector<uint8_t> data;
+        readData(*e, data);
+        data.resize(bytes, 0);
+        dir_entry old = *e;
+        if (writeData(*e, data.data(), data.size(), dataGoal(parentBlk)) == -1)
+        {
+            std::cout << "Not enough disk space\n";
+            return -1;
+        }
+        freeData(old);
+        flushMeta();
+        writeDir(parentBlk, dir);
+        return 0;
+    }
 
-    // 4) Check WRITE permission on the object itself
-    if (!(entry.access_rights & WRITE))
+    if (plainExtents(*e) == -1)
     {
-        std::cout << "Permission denied\n";
+        std::cout << "Not enough disk space\n";
         return -1;
     }
 
-    // 5) If entry is a directory, ensure it is empty (only ".." allowed)
-    if (entry.type == TYPE_DIR)
+    // 2) split off the reservation and what lies past the new end
+    int ino = e->first_blk;
+    long size = e->size;
+    std::vector<extent> ext, gone, cut;
+    loadExtents(ino, ext);
+    splitExtents(ext, (size + BLOCK_SIZE - 1) / BLOCK_SIZE, gone);
+    if (bytes < size)
     {
-        dir_entry subDir[MAX_DIR_ENTRIES];
-        disk.read(entry.first_blk, (uint8_t *)subDir);
+        splitExtents(ext, (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE, cut);
+        gone.insert(gone.end(), cut.begin(), cut.end());
+    }
 
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+    // 3) a growing file: clear the rest of the last block (on a copy if the
+    //    block is shared), then add the hole
+    std::vector<extent> copy;
+    if (bytes > size && size % BLOCK_SIZE && ext.back().start != EXTENT_HOLE)
+    {
+        int lastBlk = ext.back().start + ext.back().len - 1;
+        uint8_t buf[BLOCK_SIZE];
+        disk.read(lastBlk, buf);
+        std::memset(buf + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+        if (hasFeature(FEAT_DEDUP) || isPinned(lastBlk))
         {
-            if (subDir[i].file_name[0] != '\0' &&
-                std::strcmp(subDir[i].file_name, "..") != 0)
+            if (!writeBlocks(buf, BLOCK_SIZE, lastBlk + 1, copy))
             {
-                std::cout << "Directory not empty\n";
+                flushMeta(); // keeps a conversion done above
+                writeDir(parentBlk, dir);
+                std::cout << "Not enough disk space\n";
                 return -1;
             }
+            splitExtents(ext, (size - 1) / BLOCK_SIZE, cut);
+            gone.insert(gone.end(), cut.begin(), cut.end());
+            addExtent(ext, copy[0]);
         }
+        else
+            disk.write(lastBlk, buf);
     }
-
-    // 6) Free all FAT blocks used by the file/directory content
-    disk.read(FAT_BLOCK, (uint8_t *)fat);
-
-    int cur = entry.first_blk;
-    while (cur != FAT_EOF)
+    if (bytes > size)
     {
-        int next = fat[cur];
-        fat[cur] = FAT_FREE;
-        cur = next;
+        int grow = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE - (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        extent hole = { EXTENT_HOLE, 0 };
+        for (; grow > 0; grow -= hole.len)
+        {
+            hole.len = std::min(grow, (int)UINT16_MAX);
+            addExtent(ext, hole);
+        }
     }
 
-    // 7) Remove the directory entry (mark as empty)
-    std::memset(&parentDir[idx], 0, sizeof(dir_entry));
-
-    // 8) Write back changes
-    disk.write(parentBlk, (uint8_t *)parentDir);
-    disk.write(FAT_BLOCK, (uint8_t *)fat);
-
+    // 4) store the new layout before anything is released
+    if (!storeExtents(ino, ext))
+    {
+        freeExtents(copy);
+        flushMeta();
+        writeDir(parentBlk, dir);
+        std::cout << "Too many extents\n";
+        return -1;
+    }
+    freeExtents(gone);
+    inodes[ino].flags &= ~INODE_PREALLOC;
+    markInode(ino);
+    e->size = bytes;
+    flushMeta();
+    writeDir(parentBlk, dir);
     return 0;
 }
 
-// append <filepath1> <filepath2> appends the contents of file <filepath1> to
-// the end of file <filepath2>. The file <filepath1> is unchanged.
-int FS::append(std::string filepath1, std::string filepath2)
+// ---------------------------------------------------------------------------
+// Import and export
+//
+// Whole files move between the host and the image in one read or write
+// each. The host side of the work (opening, reading and writing files)
+// runs on the pool, one task per file; the FS side stays on the calling
+// thread. An import reserves one run for the data of the whole tree first,
+// so it is laid out contiguously when the disk has such a run.
+// ---------------------------------------------------------------------------
+
+// a file or directory of a host tree, parents before their children
+struct host_item
 {
-    int parent1, parent2;
-    std::string name1, name2;
+    std::string host;
+    std::string path; // in the file system
+    bool dir;
+    long size;
+    long blocks; // disk blocks on the host (fewer than size needs if sparse)
+};
+
+// Lists hostpath and, for a directory, everything below it into items.
+// Prints what is wrong and returns false if the tree cannot be imported.
+static bool scanHost(const std::string &host, const std::string &path, bool compact,
+                     std::vector<host_item> &items)
+{
+    struct stat st;
+    if (lstat(host.c_str(), &st) == -1 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+    {
+        std::cout << "Cannot read " << host << "\n";
+        return false;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > INT32_MAX)
+    {
+        std::cout << "File too large: " << host << "\n";
+        return false;
+    }
+    host_item item = { host, path, (bool)S_ISDIR(st.st_mode), (long)st.st_size, (long)st.st_blocks * 512 };
+    items.push_back(item);
+    if (!item.dir)
+        return true;
 
-    // 1) Resolve both paths
-    if (!resolvePath(filepath1, parent1, name1) ||
-        !resolvePath(filepath2, parent2, name2))
+    DIR *d = opendir(host.c_str());
+    if (d == NULL)
     {
-        std::cout << "File not found\n";
-        return -1;
+        std::cout << "Cannot read " << host << "\n";
+        return false;
+    }
+    std::vector<std::string> names;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+        if (std::strcmp(de->d_name, ".") != 0 && std::strcmp(de->d_name, "..") != 0)
+            names.push_back(de->d_name);
+    closedir(d);
+
+    // sorted, so that the layout does not depend on the host's order; other
+    // kinds of files (links, devices) are left out
+    std::sort(names.begin(), names.end());
+    int bytes = sizeof(dir_block_header) + DIR_RECORD + 2; // with ".."
+    for (size_t i = 0; i < names.size(); i++)
+        bytes += DIR_RECORD + std::min<int>(names[i].size(), MAX_NAME_LEN);
+    bool full = compact ? (int)names.size() > MAX_DIR_ENTRIES - 1 || bytes > BLOCK_SIZE
+                        : (int)names.size() > PLAIN_DIR_ENTRIES - 1;
+    if (full)
+    {
+        std::cout << "Too many entries in " << host << "\n";
+        return false;
+    }
+    std::string prefix = path == "/" ? "" : path;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        if ((int)names[i].size() > MAX_NAME_LEN)
+        {
+            std::cout << "Name too long: " << host << "/" << names[i] << "\n";
+            return false;
+        }
+        std::string child = host + "/" + names[i];
+        if (lstat(child.c_str(), &st) == -1 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+            continue;
+        if (!scanHost(child, prefix + "/" + names[i], compact, items))
+            return false;
     }
+    return true;
+}
 
-    // 2) Read both parent directories
-    dir_entry dir1[MAX_DIR_ENTRIES], dir2[MAX_DIR_ENTRIES];
-    disk.read(parent1, (uint8_t *)dir1);
-    disk.read(parent2, (uint8_t *)dir2);
+static bool readHost(const std::string &host, long size, std::vector<uint8_t> &data)
+{
+    int fd = open(host.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    data.resize(size);
+    long done = 0;
+    while (done < size)
+    {
+        ssize_t n = read(fd, data.data() + done, size - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    close(fd);
+    data.resize(done); // the file may have shrunk meanwhile
+    return true;
+}
 
-    // 3) Find source and destination entries
-    int srcIdx = findEntryIndex(dir1, MAX_DIR_ENTRIES, name1);
-    int dstIdx = findEntryIndex(dir2, MAX_DIR_ENTRIES, name2);
+// Writes a new host file; whole zero blocks are skipped, so holes stay holes.
+static bool writeHost(const std::string &host, const std::vector<uint8_t> &data, int rights)
+{
+    int fd = open(host.c_str(), O_WRONLY | O_CREAT | O_EXCL, (rights & 7) << 6);
+    if (fd == -1)
+        return false;
+    bool ok = true;
+    size_t size = data.size();
+    size_t i = 0;
+    while (ok && i < size)
+    {
+        // a run of blocks that are not all zero
+        size_t end = i;
+        while (end < size)
+        {
+            size_t len = std::min<size_t>(BLOCK_SIZE, size - end);
+            if (len == BLOCK_SIZE && std::memcmp(data.data() + end, zero_block, BLOCK_SIZE) == 0)
+                break;
+            end += len;
+        }
+        for (size_t done = i; ok && done < end;)
+        {
+            ssize_t n = pwrite(fd, data.data() + done, end - done, done);
+            ok = n > 0;
+            done += n;
+        }
+        i = end + BLOCK_SIZE;
+    }
+    ok = ok && ftruncate(fd, size) == 0;
+    close(fd);
+    return ok;
+}
 
-    if (srcIdx == -1 || dstIdx == -1)
+int FS::importTree(std::string hostpath, std::string fspath)
+{
+    if (readOnly())
+        return -1;
+    int parentBlk;
+    std::string name;
+    if (!resolvePath(fspath, parentBlk, name))
     {
-        std::cout << "File not found\n";
+        std::cout << "Directory not found\n";
         return -1;
     }
-
-    dir_entry &src = dir1[srcIdx];
-    dir_entry &dst = dir2[dstIdx];
-
-    // Optional but clearer/safe: both must be files
-    if (src.type == TYPE_DIR || dst.type == TYPE_DIR)
+    if (name.length() > MAX_NAME_LEN)
     {
-        std::cout << "Not a file\n";
+        std::cout << "File name too long\n";
+        return -1;
+    }
+    dir_entry existing;
+    if (lookup(fspath, existing))
+    {
+        std::cout << "File already exists\n";
+        return -1;
+    }
+    dir_entry parentDir[MAX_DIR_ENTRIES];
+    readDir(parentBlk, parentDir);
+    if (freeSlot(parentDir, name) == -1)
+    {
+        std::cout << "Directory full\n";
         return -1;
     }
 
-    // 4) Permissions
-    if (!(src.access_rights & READ) || !(dst.access_rights & WRITE))
+    // 1) the host tree, checked before anything is changed
+    std::vector<host_item> items;
+    if (!scanHost(hostpath, fspath, hasFeature(FEAT_COMPACT_DIRS), items))
+        return -1;
+
+    // 2) the space it takes: a block per directory and the blocks of the
+    //    data, less what sparse host files leave out on extent volumes.
+    //    Compressed and deduplicated volumes may need less, so they only
+    //    find out while writing
+    disk.read(fat_blk, (uint8_t *)fat);
+    int no_blocks = disk.get_no_blocks();
+    long need = 0, data_blocks = 0;
+    for (size_t i = 0; i < items.size(); i++)
     {
-        std::cout << "Permission denied\n";
+        long n = items[i].dir ? 0 : (items[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (hasFeature(FEAT_EXTENTS))
+            n = std::min(n, (items[i].blocks + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        data_blocks += n;
+        need += items[i].dir ? 1 : n;
+    }
+    if (!hasFeature(FEAT_COMPRESS | FEAT_DEDUP) && need > fat_count(fat, no_blocks, FAT_FREE))
+    {
+        std::cout << "Not enough disk space\n";
         return -1;
     }
 
-    // 5) Load FAT
-    disk.read(FAT_BLOCK, (uint8_t *)fat);
-
-    // 6) Read all data from file1 into RAM
-    int size1 = src.size;
-    std::vector<uint8_t> data1(size1);
-
-    int srcBlk = src.first_blk;
-    int offset = 0;
-
-    while (srcBlk != FAT_EOF && offset < size1)
+    // 3) read every file in parallel
+    std::vector<std::vector<uint8_t> > contents(items.size());
+    std::vector<char> failed(items.size(), 0);
+    for (size_t i = 0; i < items.size(); i++)
     {
-        uint8_t buf[BLOCK_SIZE];
-        disk.read(srcBlk, buf);
-
-        int n = std::min(BLOCK_SIZE, size1 - offset);
-        std::memcpy(&data1[offset], buf, n);
-
-        offset += n;
-        srcBlk = fat[srcBlk];
+        if (items[i].dir)
+            continue;
+        const host_item *item = &items[i];
+        std::vector<uint8_t> *data = &contents[i];
+        char *fail = &failed[i];
+        pool.submit([item, data, fail]() { *fail = !readHost(item->host, item->size, *data); });
     }
-
-    // 7) Find last block of file2
-    int lastBlk = dst.first_blk;
-    while (fat[lastBlk] != FAT_EOF)
-        lastBlk = fat[lastBlk];
-
-    // 8) Append into the last block of file2 (fill remaining space)
-    uint8_t last_buf[BLOCK_SIZE];
-    disk.read(lastBlk, last_buf);
-
-    int offset2 = dst.size % BLOCK_SIZE;
-    int written = std::min(BLOCK_SIZE - offset2, size1);
-
-    std::memcpy(last_buf + offset2, data1.data(), written);
-    disk.write(lastBlk, last_buf);
-
-    // 9) If more data remains, allocate new blocks and write
-    int remaining = size1 - written;
-    int pos = written;
-
-    while (remaining > 0)
+    pool.wait();
+    for (size_t i = 0; i < items.size(); i++)
     {
-        int new_blk = -1;
-        for (int i = 2; i < disk.get_no_blocks(); i++)
+        if (failed[i])
         {
-            if (fat[i] == FAT_FREE)
-            {
-                new_blk = i;
-                break;
-            }
-        }
-
-        if (new_blk == -1)
-        {
-            std::cout << "Not enough disk space\n";
+            std::cout << "Cannot read " << items[i].host << "\n";
             return -1;
         }
-
-        // Link new block to end of dst chain
-        fat[lastBlk] = new_blk;
-        fat[new_blk] = FAT_EOF;
-        lastBlk = new_blk;
-
-        // Write next chunk
-        uint8_t buf[BLOCK_SIZE] = {0};
-        int n = std::min(BLOCK_SIZE, remaining);
-        std::memcpy(buf, data1.data() + pos, n);
-        disk.write(new_blk, buf);
-
-        pos += n;
-        remaining -= n;
     }
 
-    // 10) Update file2 size and write back FAT + dst directory
-    dst.size += size1;
-
-    disk.write(FAT_BLOCK, (uint8_t *)fat);
-    disk.write(parent2, (uint8_t *)dir2);
+    // 4) the directories, then the files into one run if there is one;
+    //    the directory blocks are taken first so they do not split it
+    int result = 0;
+    for (size_t i = 0; i < items.size() && result == 0; i++)
+        if (items[i].dir)
+            result = mkdir(items[i].path);
+    if (result == 0)
+    {
+        disk.read(fat_blk, (uint8_t *)fat);
+        int run = findRun(2, no_blocks, data_blocks);
+        data_goal = run == -1 ? 0 : run;
+    }
+    for (size_t i = 0; i < items.size() && result == 0; i++)
+    {
+        if (items[i].dir)
+            continue;
+        result = writeFile(items[i].path, contents[i].data(), contents[i].size());
+        if (result == -1)
+            std::cout << "Not enough disk space\n";
+        std::vector<uint8_t>().swap(contents[i]);
+    }
+    data_goal = 0;
 
+    // 5) a failed import leaves nothing behind
+    if (result == -1)
+    {
+        if (lookup(fspath, existing))
+            rm(fspath, true);
+        return -1;
+    }
     return 0;
 }
 
-// mkdir <dirpath> creates a new sub-directory with the name <dirpath>
-// in the current directory
-int FS::mkdir(std::string dirpath)
+int FS::exportTree(std::string fspath, std::string hostpath)
 {
-    int parentBlk;
-    std::string name;
-
-    // 1) Resolve path -> where to create + new directory name
-    if (!resolvePath(dirpath, parentBlk, name))
+    dir_entry top;
+    if (!lookup(fspath, top))
     {
-        std::cout << "Directory not found\n";
+        std::cout << "File not found\n";
         return -1;
     }
-
-    if (name.length() > MAX_NAME_LEN)
+    struct stat st;
+    if (lstat(hostpath.c_str(), &st) == 0)
     {
-        std::cout << "Directory name too long\n";
+        std::cout << hostpath << " already exists\n";
         return -1;
     }
 
-    // 2) Read parent directory block
-    dir_entry parentDir[MAX_DIR_ENTRIES];
-    disk.read(parentBlk, (uint8_t*)parentDir);
-
-    // 3) Name must not already exist
-    int existing = findEntryIndex(parentDir, MAX_DIR_ENTRIES, name);
-    if (existing != -1)
+    // 1) what to copy: the file, or every directory below top with the
+    //    host path of each; walk() builds the paths from the label. Names
+    //    are joined onto host paths, so one that could leave hostpath
+    //    stops the export before anything is created
+    std::vector<dir_node> nodes;
+    if (isDir(top))
+        walk(top.first_blk, hostpath, nodes, true);
+    for (size_t d = 0; d < nodes.size(); d++)
     {
-        if (parentDir[existing].type == TYPE_DIR)
-            std::cout << "Directory already exists\n";
-        else
-            std::cout << "File with same name exists\n";
-        return -1;
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        {
+            const dir_entry &e = nodes[d].entries[i];
+            if (e.file_name[0] == '\0' || (isDir(e) && std::strcmp(e.file_name, "..") == 0))
+                continue;
+            if (std::strchr(e.file_name, '/') || std::strcmp(e.file_name, ".") == 0 ||
+                std::strcmp(e.file_name, "..") == 0)
+            {
+                std::cout << "Cannot export " << e.file_name << ": invalid name\n";
+                return -1;
+            }
+            if (isFile(e) && !(e.access_rights & READ))
+            {
+                std::cout << "Permission denied\n";
+                return -1;
+            }
+        }
     }
-
-    // 4) Find free slot in parent directory
-    int free_idx = findFreeIndex(parentDir, MAX_DIR_ENTRIES);
-    if (free_idx == -1)
+    if (isFile(top) && !(top.access_rights & READ))
     {
-        std::cout << "Directory full\n";
+        std::cout << "Permission denied\n";
         return -1;
     }
 
-    // 5) Read FAT and allocate a free block for the new directory
-    disk.read(FAT_BLOCK, (uint8_t*)fat);
+    // 2) the directories, parents first
+    for (size_t d = 0; d < nodes.size(); d++)
+    {
+        if (::mkdir(nodes[d].path.c_str(), 0777) == -1)
+        {
+            std::cout << "Cannot write " << nodes[d].path << "\n";
+            return -1;
+        }
+    }
 
-    int newDirBlk = -1;
-    for (int i = 2; i < disk.get_no_blocks(); i++)
+    // 3) the files: read here, written by the pool; at most about 64 MB
+    //    (sparse files can be much larger than the disk) wait to be written
+    disk.read(fat_blk, (uint8_t *)fat);
+    std::mutex lock;
+    std::vector<std::string> failed;
+    long pending = 0;
+    auto out = [&](const dir_entry &e, const std::string &host)
     {
-        if (fat[i] == FAT_FREE)
+        std::shared_ptr<std::vector<uint8_t> > data(new std::vector<uint8_t>);
+        readData(e, *data);
+        pending += data->size();
+        int rights = e.access_rights;
+        pool.submit([&lock, &failed, data, host, rights]()
+                    {
+                        if (!writeHost(host, *data, rights))
+                        {
+                            std::lock_guard<std::mutex> guard(lock);
+                            failed.push_back(host);
+                        }
+                    });
+        if (pending > (64 << 20))
         {
-            newDirBlk = i;
-            fat[i] = FAT_EOF;   // mark block as used (end of chain)
-            break;
+            pool.wait();
+            pending = 0;
+        }
+    };
+    if (isFile(top))
+        out(top, hostpath);
+    for (size_t d = 0; d < nodes.size(); d++)
+    {
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        {
+            const dir_entry &e = nodes[d].entries[i];
+            if (e.file_name[0] != '\0' && isFile(e))
+                out(e, nodes[d].path + "/" + e.file_name);
         }
     }
+    pool.wait();
 
-    if (newDirBlk == -1)
+    if (!failed.empty())
     {
-        std::cout << "No free blocks\n";
+        std::cout << "Cannot write " << failed[0] << "\n";
         return -1;
     }
+    return 0;
+}
 
-    // 6) Create the new directory block content:
-    //    first entry ".." points to the parent directory block
-    dir_entry newDir[MAX_DIR_ENTRIES];
-    std::memset(newDir, 0, sizeof(newDir));
+// ---------------------------------------------------------------------------
+// Front-end access
+//
+// The shell commands above report to the user. Other front-ends (the FUSE
+// daemon) need the same operations without the messages, and decide for
+// themselves what an error means.
+// ---------------------------------------------------------------------------
 
-    std::strncpy(newDir[0].file_name, "..", MAX_NAME_LEN);
-    newDir[0].file_name[MAX_NAME_LEN] = '\0';
-    newDir[0].type = TYPE_DIR;
-    newDir[0].first_blk = parentBlk;
+bool FS::entryOf(const std::string &path, dir_entry &entry)
+{
+    return lookup(path, entry);
+}
 
-    disk.write(newDirBlk, (uint8_t*)newDir);
+// Looks up many paths at once. Each directory prefix is resolved and each
+// directory block read once, however many of the paths go through it.
+void FS::statPaths(const std::vector<std::string> &paths, std::vector<file_stat> &stats)
+{
+    disk.read(fat_blk, (uint8_t *)fat);
+    // prefix ("/a/b" or "./a/b" below the cwd) -> its block, -1: none
+    std::unordered_map<std::string, int> prefixes;
+    // directory block -> its entries, read when first needed
+    std::unordered_map<int, std::vector<dir_entry> > blocks;
+    auto find = [&](int blk, const std::string &name) -> const dir_entry *
+    {
+        std::vector<dir_entry> &dir = blocks[blk];
+        if (dir.empty())
+        {
+            dir.resize(MAX_DIR_ENTRIES);
+            readDir(blk, dir.data());
+        }
+        int idx = findEntryIndex(dir.data(), MAX_DIR_ENTRIES, name);
+        return idx == -1 ? NULL : &dir[idx];
+    };
 
-    // 7) Add directory entry into the parent directory
-    std::strncpy(parentDir[free_idx].file_name, name.c_str(), MAX_NAME_LEN);
-    parentDir[free_idx].file_name[MAX_NAME_LEN] = '\0';
-    parentDir[free_idx].type = TYPE_DIR;
-    parentDir[free_idx].first_blk = newDirBlk;
+    stats.assign(paths.size(), file_stat());
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        file_stat &st = stats[i];
+        std::memset(&st, 0, sizeof(st));
+        std::vector<std::string> parts = splitPath(paths[i]);
+        bool found = false;
+        if (parts.empty())
+            found = lookup(paths[i], st.entry);
+        else
+        {
+            // 1) the parent directory, one prefix at a time
+            bool absolute = paths[i][0] == '/';
+            int cur = absolute ? root_blk : cwd_blk;
+            std::string key = absolute ? "" : ".";
+            for (size_t k = 0; k + 1 < parts.size() && cur != -1; k++)
+            {
+                key += "/" + parts[k];
+                std::unordered_map<std::string, int>::iterator it = prefixes.find(key);
+                if (it == prefixes.end())
+                {
+                    const dir_entry *e = find(cur, parts[k]);
+                    int next = -1;
+                    if (e && (parts[k] == ".." || e->type == TYPE_DIR))
+                        next = e->first_blk;
+                    it = prefixes.insert(std::make_pair(key, next)).first;
+                }
+                cur = it->second;
+            }
 
-    // (Optional) if your system expects directory permissions:
-    // parentDir[free_idx].access_rights = READ | WRITE | EXECUTE;
+            // 2) the entry itself
+            if (cur != -1)
+            {
+                const dir_entry *e = find(cur, parts.back());
+                if (e)
+                {
+                    st.entry = *e;
+                    found = true;
+                }
+            }
+        }
 
-    // 8) Write back parent directory and FAT
-    disk.write(parentBlk, (uint8_t*)parentDir);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
+        if (!found)
+            continue;
+        st.found = 1;
+        if (isDir(st.entry))
+        {
+            st.blocks = st.runs = 1;
+            continue;
+        }
+        fileRuns(st.entry, st.blocks, st.runs);
+    }
+}
 
+int FS::listDir(const std::string &path, std::vector<dir_entry> &entries)
+{
+    dir_entry top;
+    if (!lookup(path, top) || !isDir(top))
+        return -1;
+    dir_entry dir[MAX_DIR_ENTRIES];
+    readDir(top.first_blk, dir);
+    entries.clear();
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+        if (dir[i].file_name[0] != '\0' && std::strcmp(dir[i].file_name, "..") != 0)
+            entries.push_back(dir[i]);
     return 0;
 }
 
-// cd <dirpath> changes the current (working) directory to the directory named <dirpath>
-int FS::cd(std::string path)
+int FS::readFile(const std::string &path, std::vector<uint8_t> &data)
 {
-    int parentBlk;
-    std::string name;
+    dir_entry e;
+    if (!lookup(path, e) || !isFile(e) || !(e.access_rights & READ))
+        return -1;
+    disk.read(fat_blk, (uint8_t *)fat);
+    return readData(e, data);
+}
 
-    // 1) Resolve path -> parent directory block + target name
-    if (!resolvePath(path, parentBlk, name))
-    {
-        std::cout << "Directory not found\n";
+int FS::readFileAt(const std::string &path, long offset, size_t size, std::vector<uint8_t> &data)
+{
+    dir_entry e;
+    if (!lookup(path, e) || !isFile(e) || !(e.access_rights & READ))
         return -1;
-    }
+    disk.read(fat_blk, (uint8_t *)fat);
+    return readRange(e, offset, (int)std::min<size_t>(size, INT32_MAX), data);
+}
 
-    // 2) Read parent directory
+int FS::writeFile(const std::string &path, const uint8_t *data, size_t size)
+{
+    int parentBlk;
+    std::string name;
+    if (view != -1 || size > INT32_MAX || !resolvePath(path, parentBlk, name) || name.size() > MAX_NAME_LEN)
+        return -1;
     dir_entry dir[MAX_DIR_ENTRIES];
-    disk.read(parentBlk, (uint8_t*)dir);
-
-    // 3) Find the entry
+    readDir(parentBlk, dir);
     int idx = findEntryIndex(dir, MAX_DIR_ENTRIES, name);
     if (idx == -1)
-    {
-        std::cout << "Directory not found\n";
+        idx = freeSlot(dir, name);
+    else if (!isFile(dir[idx]) || !(dir[idx].access_rights & WRITE))
+        return -1;
+    if (idx == -1)
         return -1;
-    }
-
-    dir_entry& entry = dir[idx];
 
-    // 4) Must be a directory
-    if (entry.type != TYPE_DIR)
-    {
-        std::cout << "Not a directory\n";
+    // 1) the new content first; the old one is released only on success
+    disk.read(fat_blk, (uint8_t *)fat);
+    dir_entry old = dir[idx];
+    if (writeData(dir[idx], data, size, dataGoal(parentBlk)) == -1)
         return -1;
+    if (old.file_name[0] != '\0')
+        freeData(old);
+    else
+    {
+        std::strncpy(dir[idx].file_name, name.c_str(), MAX_NAME_LEN);
+        dir[idx].file_name[MAX_NAME_LEN] = '\0';
+        dir[idx].access_rights = READ | WRITE;
     }
 
-    // 5) Need EXECUTE permission to enter
-    if (!(entry.access_rights & EXECUTE))
-    {
-        std::cout << "Permission denied\n";
+    // 2) persist the blocks, then the entry
+    flushMeta();
+    writeDir(parentBlk, dir);
+    return 0;
+}
+
+int FS::appendFile(const std::string &path, const uint8_t *data, size_t size)
+{
+    int parentBlk;
+    std::string name;
+    if (view != -1 || !resolvePath(path, parentBlk, name))
+        return -1;
+    dir_entry dir[MAX_DIR_ENTRIES];
+    readDir(parentBlk, dir);
+    int idx = findEntryIndex(dir, MAX_DIR_ENTRIES, name);
+    if (idx == -1 || !isFile(dir[idx]) || !(dir[idx].access_rights & WRITE) ||
+        dir[idx].size + size > INT32_MAX)
         return -1;
-    }
 
-    // 6) Change current working directory
-    cwd_blk = entry.first_blk;
+    disk.read(fat_blk, (uint8_t *)fat);
+    if (appendData(dir[idx], data, size, dataGoal(parentBlk)) == -1)
+        return -1;
+    flushMeta();
+    writeDir(parentBlk, dir);
     return 0;
 }
 
-// pwd prints the full path, i.e., from the root directory, to the current
-// directory, including the currect directory name
-int FS::pwd()
+// adds len bytes at data to the view, merging with the span before if the
+// two are adjacent in memory
+static void addSpan(file_view &view, const uint8_t *data, size_t len)
 {
-    if (cwd_blk == ROOT_BLOCK)
+    if (len == 0)
+        return;
+    if (!view.spans.empty() && view.spans.back().data + view.spans.back().len == data)
+        view.spans.back().len += len;
+    else
     {
-        std::cout << "/\n";
-        return 0;
+        file_span span = { data, len };
+        view.spans.push_back(span);
     }
+}
 
-    std::vector<std::string> parts;
-    int current = cwd_blk;
+// empties a view that could not be made whole; returns -1
+static int dropView(file_view &view)
+{
+    view.spans.clear();
+    view.owned.clear();
+    view.size = 0;
+    return -1;
+}
+
+// what holes read as: spans of up to this many zeros
+static const uint8_t zero_span[1 << 20] = {0};
 
-    while (current != ROOT_BLOCK)
+static void addZeros(file_view &view, size_t len)
+{
+    while (len > 0)
     {
-        dir_entry curDir[MAX_DIR_ENTRIES];
-        disk.read(current, (uint8_t*)curDir);
+        size_t n = std::min(len, sizeof(zero_span));
+        file_span span = { zero_span, n };
+        view.spans.push_back(span);
+        len -= n;
+    }
+}
 
-        // 1) Find parent using ".."
-        int parentIdx = findEntryIndex(curDir, MAX_DIR_ENTRIES, "..");
-        if (parentIdx == -1)
-            break;
+int FS::mapFile(const std::string &path, file_view &view)
+{
+    view.spans.clear();
+    view.owned.clear();
+    view.size = 0;
+    dir_entry e;
+    if (!lookup(path, e) || !isFile(e) || !(e.access_rights & READ))
+        return -1;
+    disk.read(fat_blk, (uint8_t *)fat);
+    size_t size = e.size;
+    view.size = size;
 
-        int parent = curDir[parentIdx].first_blk;
+    // without a mapping of the image there is nothing to point into
+    if (!disk.mappable())
+    {
+        view.owned.push_back(std::vector<uint8_t>());
+        readData(e, view.owned.back());
+        addSpan(view, view.owned.back().data(), size);
+        return 0;
+    }
 
-        // 2) Find the name of current directory inside parent directory
-        dir_entry parentDir[MAX_DIR_ENTRIES];
-        disk.read(parent, (uint8_t*)parentDir);
+    // adds len bytes from offset on in count blocks; blocks still in the
+    // write-back cache are written back first, false if that fails
+    auto span = [this, &view](int blk, int count, int offset, size_t len) {
+        const uint8_t *p = disk.map(blk, count);
+        if (!p && disk.write_back_range(blk, count) == 0)
+            p = disk.map(blk, count);
+        if (p)
+            addSpan(view, p + offset, len);
+        return p != NULL;
+    };
+
+    if (hasInode(e) && inodes[e.first_blk].kind == INODE_INLINE)
+    {
+        addSpan(view, inodes[e.first_blk].data, size);
+        return 0;
+    }
 
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+    if (hasInode(e) && inodes[e.first_blk].kind == INODE_COMPRESSED)
+    {
+        // chunks that did not compress are stored as they are
+        std::vector<extent> chunks;
+        loadExtents(e.first_blk, chunks);
+        for (size_t k = 0; k < chunks.size(); k++)
         {
-            if (parentDir[i].type == TYPE_DIR &&
-                parentDir[i].first_blk == current)
+            int raw = std::min<int>(COMPRESS_CHUNK, size - k * COMPRESS_CHUNK);
+            if (chunks[k].len == raw)
             {
-                parts.push_back(parentDir[i].file_name);
-                break;
+                if (!span(chunks[k].start, (raw + BLOCK_SIZE - 1) / BLOCK_SIZE, 0, raw))
+                    return dropView(view);
+            }
+            else
+            {
+                view.owned.push_back(std::vector<uint8_t>(raw));
+                readChunk(chunks[k], raw, view.owned.back().data());
+                addSpan(view, view.owned.back().data(), raw);
             }
         }
-
-        current = parent;
+        return 0;
     }
 
-    // print in reverse order
-    std::cout << "/";
-    for (int i = (int)parts.size() - 1; i >= 0; i--)
+    size_t pos = 0;
+    if (!hasInode(e))
     {
-        std::cout << parts[i];
-        if (i > 0) std::cout << "/";
+        for (int cur = e.first_blk; pos < size && cur > 0; cur = fat[cur])
+        {
+            size_t len = std::min<size_t>(BLOCK_SIZE, size - pos);
+            if (!span(cur, 1, 0, len))
+                return dropView(view);
+            pos += len;
+        }
+        return 0;
     }
-    std::cout << "\n";
-
-    return 0;
-}
 
-// chmod <accessrights> <filepath> changes the access rights for the
-// file <filepath> to <accessrights>.
-int FS::chmod(std::string accessrights, std::string filepath)
-{
-    // 1) Convert accessrights to int
-    int rights;
-    try
-    {
-        rights = std::stoi(accessrights);
-    }
-    catch (...)
+    std::vector<extent> ext;
+    loadExtents(e.first_blk, ext);
+    int tail_len = inodes[e.first_blk].tail_len;
+    extent tail = { 0, 0 };
+    if (tail_len)
     {
-        std::cout << "Invalid access rights\n";
-        return -1;
+        tail = ext.back();
+        ext.pop_back();
     }
-
-    if (rights < 0 || rights > 7)
+    for (size_t k = 0; k < ext.size() && pos < size - tail_len; k++)
     {
-        std::cout << "Invalid access rights\n";
-        return -1;
+        size_t len = std::min<size_t>((size_t)ext[k].len * BLOCK_SIZE, size - tail_len - pos);
+        if (ext[k].start == EXTENT_HOLE)
+            addZeros(view, len);
+        else if (!span(ext[k].start, ext[k].len, 0, len))
+            return dropView(view);
+        pos += len;
     }
+    if (tail_len && !span(tail.start, 1, tail.len, tail_len))
+        return dropView(view);
+    return 0;
+}
 
-    // 2) Resolve path -> parent directory block + entry name
-    int parentBlk;
-    std::string name;
-
-    if (!resolvePath(filepath, parentBlk, name))
+// sync writes every block still in the write-back cache to the image
+int FS::sync()
+{
+    if (disk.sync())
     {
-        std::cout << "File not found\n";
+        std::cout << "Error: could not write back the cache\n";
         return -1;
     }
+    return 0;
+}
 
-    // 3) Read parent directory
-    dir_entry dir[MAX_DIR_ENTRIES];
-    disk.read(parentBlk, (uint8_t*)dir);
-
-    // 4) Find entry and update rights
-    int idx = findEntryIndex(dir, MAX_DIR_ENTRIES, name);
-    if (idx == -1)
-    {
-        std::cout << "File not found\n";
-        return -1;
-    }
+void FS::writeback(bool on)
+{
+    disk.set_writeback(on);
+}
 
-    dir[idx].access_rights = rights;
-    disk.write(parentBlk, (uint8_t*)dir);
-    return 0;
+void FS::space(int &total, int &free_blks)
+{
+    disk.read(fat_blk, (uint8_t *)fat);
+    total = disk.get_no_blocks();
+    free_blks = fat_count(fat, total, FAT_FREE);
 }
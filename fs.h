@@ -1,19 +1,29 @@
 #include <iostream>
 #include <cstdint>
 #include "disk.h"
+#include "threadpool.h"
 
 #include <vector>
+#include <string>
+#include <functional>
+#include <unordered_map>
+#include <map>
 
 #ifndef __FS_H__
 #define __FS_H__
 
 #define ROOT_BLOCK 0
 #define FAT_BLOCK 1
+#define SUPER_BLOCK 2 // only on volumes formatted with features
 #define FAT_FREE 0
 #define FAT_EOF -1
+#define FAT_USED -2 // allocated, but not part of a chain (extent data, metadata)
+#define FAT_SNAP -3 // free, but still part of a snapshot, so not to be allocated
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
+#define TYPE_MASK 0x0f
+#define TYPE_INODE 0x10 // flag: first_blk is an inode number, not a FAT chain
 #define READ 0x04
 #define WRITE 0x02
 #define EXECUTE 0x01
@@ -26,36 +36,304 @@ struct dir_entry {
     uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
 };
 
+// Volume features, chosen at format time and recorded in the superblock
+#define FS_MAGIC 0x31585346 // "FSX1"
+#define FS_VERSION 1
+#define FEAT_EXTENTS 0x0001 // new files are stored as extents instead of FAT chains
+#define FEAT_TAILS 0x0002 // the last block of every FAT chain is kept in a table
+#define FEAT_INLINE 0x0004 // small files are stored inside their inode
+#define FEAT_PACK 0x0008 // last partial blocks of extent files share blocks (implies FEAT_EXTENTS)
+#define FEAT_COMPRESS 0x0010 // new files are compressed in chunks of COMPRESS_CHUNK bytes
+#define FEAT_DEDUP 0x0020 // identical blocks of extent files are stored once (implies FEAT_EXTENTS)
+#define FEAT_SNAPSHOT 0x0040 // read-only snapshots that share the data blocks
+#define FEAT_COMPACT_DIRS 0x0080 // directory blocks hold variable-length records
+
+struct superblock {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t features;
+    uint16_t inode_blk; // first block of the inode table (a FAT chain)
+    uint16_t inode_blocks; // number of blocks in the inode table
+    uint16_t tail_blk; // block holding the tail table, 0 if none
+    uint16_t dedup_blk; // refcount block followed by 2 fingerprint blocks, 0 if none
+    uint16_t snap_blk; // block holding the snapshot table, 0 if none
+};
+
+// One snapshot in the table at super.snap_blk. All its metadata is one FAT
+// chain (in the live FAT) starting at fat_blk: the FAT as it was, reduced to
+// the data blocks and this chain, then copies of the directory tree (the
+// root at root_blk), of the inode table (from inode_blk on) and of the
+// indirect blocks. The data blocks are shared with the live file system.
+struct snapshot_entry {
+    char name[48]; // empty: slot unused
+    uint32_t blocks; // blocks in the chain
+    uint16_t fat_blk;
+    uint16_t root_blk;
+    uint16_t inode_blk; // 0 without an inode table
+    uint16_t inode_blocks;
+    uint8_t unused[4];
+};
+#define MAX_SNAPSHOTS (BLOCK_SIZE / sizeof(snapshot_entry))
+
+// A run of contiguous blocks
+struct extent {
+    uint16_t start;
+    uint16_t len;
+};
+#define EXTENT_HOLE 0 // start of an extent without blocks; it reads as zeros
+
+#define INODE_FREE 0
+#define INODE_EXTENT 1
+#define INODE_INLINE 2
+#define INODE_COMPRESSED 3
+#define INODE_PREALLOC 0x01 // flag: extents past the size are reserved for appends
+#define COMPRESS_CHUNK (8 * BLOCK_SIZE) // uncompressed bytes per compressed chunk
+#define INODE_EXTENTS 14 // extents stored in the inode itself
+#define INLINE_MAX (INODE_EXTENTS * sizeof(extent)) // bytes of an inline file
+#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(inode))
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof(extent))
+
+// File metadata for files with TYPE_INODE. The first INODE_EXTENTS extents are
+// kept here, further ones in a single indirect block. If tail_len is set, the
+// last extent is a packed tail: start is the shared pack block and len the
+// byte offset of the tail in it. An INODE_INLINE file keeps its data (at most
+// INLINE_MAX bytes) in place of the extents. For INODE_COMPRESSED every extent
+// describes one chunk instead: start is its first block and len its
+// compressed size in bytes (a chunk that does not shrink is stored as is).
+// Extents of an INODE_EXTENT file may be holes (EXTENT_HOLE), and with
+// INODE_PREALLOC blocks may follow the data, waiting for appends.
+struct inode {
+    uint8_t kind; // INODE_FREE, INODE_EXTENT, INODE_INLINE or INODE_COMPRESSED
+    uint8_t flags;
+    uint16_t n_extents; // total number of extents
+    uint16_t indirect; // block with extents INODE_EXTENTS.., 0 if none
+    uint16_t tail_len; // bytes in the packed tail, 0 if none
+    union {
+        extent ext[INODE_EXTENTS];
+        uint8_t data[INLINE_MAX];
+    };
+};
+
+// one directory reached by FS::walk
+struct dir_node {
+    int blk;        // block holding the directory
+    int parent;     // index of the parent node, -1 for the start directory
+    int slot;       // index of the directory's entry in its parent
+    int depth;      // 0 for the start directory
+    std::string path;
+    std::vector<dir_entry> entries;
+};
+
+// Read-only view of a file's content, from FS::mapFile: the spans in order
+// make up the file. They point into the mapped image (or, for inline files,
+// the in-memory inode table) wherever the data is stored as it is; only
+// compressed chunks are decompressed into owned. A view is valid until the
+// file system is changed.
+struct file_span {
+    const uint8_t *data;
+    size_t len;
+};
+struct file_view {
+    std::vector<file_span> spans;
+    size_t size;
+    std::vector<std::vector<uint8_t> > owned;
+    bool contiguous() const { return spans.size() <= 1; }
+};
+
+// What stat reports on a path, from FS::statPaths
+struct file_stat {
+    dir_entry entry;
+    int32_t blocks; // blocks holding the data (1 for a directory)
+    int32_t runs;   // contiguous runs of them; more than 1: fragmented
+    int32_t found;  // 0 if there is no such path
+};
+
+// orders of ls()
+#define LS_SLOT 0 // as stored
+#define LS_NAME 1
+#define LS_SIZE 2 // then by name
+
+struct fsck_entry; // fs.cpp
+
 class FS {
 private:
     Disk disk;
     // size of a FAT entry is 2 bytes
     int16_t fat[BLOCK_SIZE/2];
     uint16_t cwd_blk; // current working directory block number
-    std::vector<std::string> cwd_path; // för pwd (senare)
+    std::vector<std::string> cwd_path; // names from the root down to the cwd
+    std::vector<int> cwd_trail; // directory blocks along cwd_path
+    bool cwd_valid; // cleared when a directory on cwd_path is renamed or moved
+    // reverse index: directory block -> (parent block, name in parent)
+    std::unordered_map<int, std::pair<int, std::string> > dir_names;
+    ThreadPool pool; // reads directory blocks in parallel for walk()
+
+    superblock super; // valid if super.magic == FS_MAGIC
+    std::vector<inode> inodes; // the whole inode table, kept in memory
+    std::vector<int> inode_blks; // blocks of the inode table
+    std::vector<char> inode_dirty; // per inode table block
+    // last block of each FAT chain, indexed by its first block (0: unknown);
+    // persisted in super.tail_blk on FEAT_TAILS volumes
+    std::vector<uint16_t> tails;
+    bool tails_dirty;
+    // used byte ranges (offset -> length) of every block holding packed
+    // tails; rebuilt from the inode table by mount()
+    std::map<int, std::map<int, int> > packs;
+    // FEAT_DEDUP: references to every extent block (0: not shared data),
+    // content fingerprints per block and the index fingerprint -> blocks
+    std::vector<uint16_t> refs;
+    std::vector<uint32_t> fps;
+    std::unordered_multimap<uint32_t, int> fp_index;
+    bool dedup_dirty;
+    struct {
+        long blocks;   // blocks passed through the dedup write path
+        long shared;   // of these, stored as a reference to an existing block
+        long verified; // candidate blocks read back to rule out collisions
+        long collisions; // candidates with equal fingerprint but other data
+        long us;       // time spent fingerprinting and looking up
+    } dedup_stats;
 
+    // reads the FAT and, if present, the superblock and inode table
+    void mount();
+    // writes the FAT and every modified inode table block, after the data
+    // written before (see Disk::barrier())
+    void flushMeta();
+    bool hasFeature(int feature) { return super.magic == FS_MAGIC && (super.features & feature); }
+    // directory blocks in the volume's format, decoded to and from
+    // MAX_DIR_ENTRIES slots; findInDir() looks one name up in place and
+    // freeSlot() finds room for a new entry
+    void readDir(int blk, dir_entry* dir);
+    void writeDir(int blk, const dir_entry* dir);
+    int findInDir(int blk, const std::string& name, dir_entry& entry);
+    int freeSlot(dir_entry* dir, const std::string& name);
+    // the entries of a directory after the cursor in LS_NAME or LS_SIZE order
+    int listPage(int blk, int order, const std::string& after, int limit,
+                 std::vector<dir_entry>& page, bool& more);
+
+    // inode table
+    int allocInode();
+    void markInode(int ino) { inode_dirty[ino / INODES_PER_BLOCK] = 1; }
+    void writeSuper();
+    // extent lists (direct + indirect)
+    void loadExtents(int ino, std::vector<extent>& ext);
+    bool storeExtents(int ino, const std::vector<extent>& ext);
+    // allocates n blocks as few, preferably contiguous, runs starting at goal
+    bool allocExtents(int n, std::vector<extent>& ext, int goal = 2);
+    int findRun(int from, int to, int n);
+
+    // file data independent of the layout (FAT chain or extents); these
+    // only change the in-memory FAT/inodes, flushMeta() persists them
+    int readData(const dir_entry& entry, std::vector<uint8_t>& data);
+    // up to count bytes from offset on, reading only the blocks they are in
+    int readRange(const dir_entry& entry, long offset, int count, std::vector<uint8_t>& data);
+    int writeData(dir_entry& entry, const uint8_t* data, int size, int goal = 2);
+    int appendData(dir_entry& entry, const uint8_t* data, int size, int goal = 2);
+    void freeData(const dir_entry& entry);
+    // packed tails: places len bytes in a pack block, or releases them
+    bool allocTail(int len, extent& where);
+    void freeTail(const extent& where);
+    // compressed chunks: writeChunks() appends the chunks for data to chunks
+    bool writeChunks(const uint8_t* data, int size, std::vector<extent>& chunks);
+    void readChunk(const extent& chunk, int raw, uint8_t* out);
+    void freeChunk(const extent& chunk);
+    // stores size bytes in newly placed whole blocks near goal and appends
+    // them to ext; on FEAT_DEDUP volumes blocks with equal content are shared
+    bool writeBlocks(const uint8_t* data, int size, int goal, std::vector<extent>& ext);
+    int findDuplicate(uint32_t fp, const uint8_t* blk);
+    // releases extent blocks, honouring the reference counts of shared ones
+    void freeExtents(const std::vector<extent>& ext);
+    // number of disk blocks holding the data of a file
+    int dataBlocks(const dir_entry& entry);
+    // create: the slot for a new file in the cwd, and storing its data
+    int newFileSlot(const std::string& filepath, dir_entry* dir);
+    int storeNewFile(const std::string& filepath, dir_entry* dir, int free_index,
+                     const uint8_t* data, int size);
+    // turns an inline file, or one with a packed tail, into plain extents
+    int plainExtents(dir_entry& entry);
+
+    // allocates n free blocks first-fit from goal on in the in-memory FAT
+    // (not marked)
+    bool allocBlocks(int n, std::vector<int>& blocks, int goal = 2);
+    // block groups: where the block of a new directory below parent_blk is
+    // looked for, and the data of a file in directory dir_blk
+    int dirGoal(int parent_blk);
+    int dataGoal(int dir_blk) { return data_goal ? data_goal : dir_blk; }
+    // a run import reserved for the files of the whole tree (0: none)
+    int data_goal;
+    // releases a FAT chain in the in-memory FAT
+    void freeChain(int first_blk);
+    // last block of the chain starting at first_blk, from the tail table
+    int tailOf(int first_blk);
+    void setTail(int first_blk, int last_blk);
+    // true if directory block blk is top_blk or lies below it
+    bool inSubtree(int blk, int top_blk);
+    // copies the directory tree rooted at src_blk below dst_parent
+    int copyTree(int src_blk, int dst_parent);
+    // keeps the reverse directory index up to date
+    void learnDir(int blk, int parent_blk, const std::string& name);
+    void forgetDir(int blk);
+    // rebuilds cwd_path/cwd_trail from cwd_blk, using dir_names where possible
+    bool deriveCwdPath();
+    // looks up the entry for path; "" is the current and "/" the root directory
+    bool lookup(const std::string& path, dir_entry& entry);
+    // blocks used by a directory entry, for fsck
+    void fsckClaims(const dir_entry& e, fsck_entry& out);
+    // defrag: data blocks and contiguous runs of a file, and moving a
+    // fragmented file into one run
+    void fileRuns(const dir_entry& e, int& blocks, int& runs);
+    int relocate(dir_node& node, int slot);
+    bool defrag_background; // idle() moves fragmented files
+
+    // snapshots: the table, the blocks any of them uses, and the one mounted
+    // instead of the live file system (-1: none), whose root and FAT are
+    // root_blk and fat_blk
+    std::vector<snapshot_entry> snaps;
+    std::vector<char> pinned;
+    int view;
+    int root_blk;
+    int fat_blk;
+    bool isPinned(int blk) { return !pinned.empty() && pinned[blk]; }
+    // frees a block; one a snapshot still uses becomes FAT_SNAP instead
+    void release(int blk) { fat[blk] = isPinned(blk) ? FAT_SNAP : FAT_FREE; }
+    void loadPins();
+    void writeSnapshots();
+    int findSnapshot(const std::string& name);
+    // prints an error and returns true if a snapshot is mounted
+    bool readOnly();
+    // reads every directory below start_blk in parallel (see fs.cpp)
+    void walk(int start_blk, const std::string& label, std::vector<dir_node>& nodes,
+              bool ordered, const std::function<void(const dir_node&)>& visit = nullptr);
 
 public:
     FS();
     ~FS();
     // formats the disk, i.e., creates an empty file system
-    int format();
+    // format [extent] [tail] [inline] [pack] [compress] [dedup] [snap] also
+    // writes a superblock selecting the given features
+    int format(int features = 0);
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
     int create(std::string filepath);
+    // create <filepath> <bytes> instead reads exactly bytes bytes of raw data
+    // that follow the command, any bytes at all (bytes < 0: all of the input)
+    int create(std::string filepath, long bytes);
     // cat <filepath> reads the content of a file and prints it on the screen
     int cat(std::string filepath);
     // ls lists the content in the current directory (files and sub-directories)
-    int ls();
+    // in slot order, or one page of it sorted by name or size: the limit
+    // entries (0: all) that follow the entry called after
+    int ls(int order = LS_SLOT, const std::string& after = "", int limit = 0);
 
     // cp <sourcepath> <destpath> makes an exact copy of the file
     // <sourcepath> to a new file <destpath>
-    int cp(std::string sourcepath, std::string destpath);
-    // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
-    // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
+    // cp -r also copies a directory <sourcepath> including everything below it
+    int cp(std::string sourcepath, std::string destpath, bool recursive = false);
+    // mv <sourcepath> <destpath> renames the file or directory <sourcepath> to
+    // the name <destpath>, or moves it to the directory <destpath> (if dest is a directory)
     int mv(std::string sourcepath, std::string destpath);
     // rm <filepath> removes / deletes the file <filepath>
-    int rm(std::string filepath);
+    // rm -r also removes a directory <filepath> and everything below it
+    int rm(std::string filepath, bool recursive = false);
     // append <filepath1> <filepath2> appends the contents of file <filepath1> to
     // the end of file <filepath2>. The file <filepath1> is unchanged.
     int append(std::string filepath1, std::string filepath2);
@@ -73,6 +351,68 @@ public:
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
 
+    // du [<path>] prints the disk usage of every directory below <path>
+    // (default the current directory); sub-directories come before their parent
+    int du(std::string path = "");
+    // find [-s] <pattern> [<path>] prints every file and directory below <path>
+    // whose name matches the pattern ('*' and '?' wildcards); -s sorts the output
+    int find(std::string pattern, std::string path = "", bool sorted = false);
+    // stat <path>... prints entry, blocks and runs of every path
+    int stat(const std::vector<std::string>& paths);
+    // dedup prints how much space block sharing saves and what it costs
+    int dedup();
+    // df prints the free and used space of the disk, counted from the FAT
+    int df();
+    // fsck [-r] checks that the FAT, the directory tree and the inodes agree:
+    // leaked, cross-linked and wrongly marked blocks, broken or looping
+    // chains and sizes that do not match the data; -r repairs what it can
+    int fsck(bool repair = false);
+    // defrag moves fragmented files into contiguous runs and prints the
+    // fragmentation before and after; defrag -b switches background mode on
+    // or off, in which idle() moves one fragmented file at a time
+    int defrag(bool background = false);
+    // lets the file system do background work between commands
+    void idle();
+    // sync writes every block the write-back cache holds to the disk; the
+    // cache (on by default) can be switched off for synchronous writes
+    int sync();
+    void writeback(bool on);
+    // snapshot <name> takes a snapshot of the whole file system; snapshot -l
+    // lists them, -d deletes one and -m mounts one read-only in place of the
+    // file system (-u goes back)
+    int snapshot(std::string name);
+    int listSnapshots();
+    int deleteSnapshot(std::string name);
+    int mountSnapshot(std::string name = "");
+    // fallocate <file> <bytes> reserves blocks for the file to grow to bytes
+    // without writing them (the size stays); truncate <file> <bytes> sets
+    // the size, growing the file by a hole that takes no blocks
+    int fallocate(std::string filepath, long bytes);
+    int truncate(std::string filepath, long bytes);
+    // import <hostpath> <fspath> copies a host file or directory tree to
+    // the new path fspath; export <fspath> <hostpath> copies a file or tree
+    // out to the new host path. Content is copied as it is, binary or not
+    int importTree(std::string hostpath, std::string fspath);
+    int exportTree(std::string fspath, std::string hostpath);
+
+    // access for front-ends other than the shell (fuse_main.cpp): these
+    // print nothing and return -1 (false) if the path cannot be used
+    bool entryOf(const std::string& path, dir_entry& entry);
+    int listDir(const std::string& path, std::vector<dir_entry>& entries);
+    // one file_stat per path, sharing the lookups of common prefixes
+    void statPaths(const std::vector<std::string>& paths, std::vector<file_stat>& stats);
+    int readFile(const std::string& path, std::vector<uint8_t>& data);
+    // up to size bytes of a file from offset on; shorter at the end of it
+    int readFileAt(const std::string& path, long offset, size_t size, std::vector<uint8_t>& data);
+    // replaces the content of a file, creating it (rights rw-) if needed
+    int writeFile(const std::string& path, const uint8_t* data, size_t size);
+    int appendFile(const std::string& path, const uint8_t* data, size_t size);
+    // the content of a file without copying it (see file_view); also -1 if
+    // cached blocks of it cannot be written back to be mapped
+    int mapFile(const std::string& path, file_view& view);
+    // blocks on the disk and how many of them are free
+    void space(int& total, int& free_blks);
+
     bool resolvePath(const std::string& path,
                  int& parent_block,
                  std::string& name);
@@ -0,0 +1,24 @@
+/******************************************************************************
+ *             File : fsck_main.cpp
+ *
+ * Offline checker for the disk image: fsck [-r]. Checks diskfile.bin and,
+ * with -r, repairs it. The exit status is 0 if the image is consistent
+ * afterwards and 1 if problems are left.
+ *****************************************************************************/
+
+#include <iostream>
+#include <cstring>
+#include "fs.h"
+#include "disk.h"
+
+int
+main(int argc, char **argv)
+{
+    bool repair = argc == 2 && std::strcmp(argv[1], "-r") == 0;
+    if (argc > 2 || (argc == 2 && !repair)) {
+        std::cout << "Usage: " << argv[0] << " [-r]\n";
+        return 2;
+    }
+    FS filesystem;
+    return filesystem.fsck(repair) ? 1 : 0;
+}
@@ -0,0 +1,414 @@
+/******************************************************************************
+ *             File : fuse_main.cpp
+ *
+ * Mounts diskfile.bin as a Linux file system through libfuse3:
+ * fusefs <mountpoint> [fuse options]. The image is taken from the directory
+ * fusefs is started in. The kernel sends requests from several threads;
+ * FS itself is not thread-safe, so every call into it holds fs_lock, while
+ * getattr/lookup and readdir are answered from a cache of directory
+ * listings without touching FS at all. Files have no time stamps and belong
+ * to the user who mounted the image; the owner bits of the mode are the
+ * access rights.
+ *****************************************************************************/
+
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "fs.h"
+#include "disk.h"
+
+static FS *fs;
+static std::mutex fs_lock;
+static std::string image_dir;
+// longest name a dir_entry holds
+static const size_t max_name = sizeof(dir_entry().file_name) - 1;
+
+// Directory listings by path. Any change to the tree or to a file size
+// drops the whole cache.
+static std::mutex cache_lock;
+static std::map<std::string, std::vector<dir_entry> > dir_cache;
+
+static void
+changed()
+{
+    std::lock_guard<std::mutex> guard(cache_lock);
+    dir_cache.clear();
+}
+
+static void
+split(const std::string& path, std::string& parent, std::string& name)
+{
+    size_t slash = path.find_last_of('/');
+    parent = slash == 0 ? "/" : path.substr(0, slash);
+    name = path.substr(slash + 1);
+}
+
+// listing of the directory at path, from the cache or read through FS
+static bool
+listing(const std::string& path, std::vector<dir_entry>& entries)
+{
+    {
+        std::lock_guard<std::mutex> guard(cache_lock);
+        std::map<std::string, std::vector<dir_entry> >::iterator it = dir_cache.find(path);
+        if (it != dir_cache.end()) {
+            entries = it->second;
+            return true;
+        }
+    }
+
+    // holding fs_lock, no change can come between reading and caching
+    std::lock_guard<std::mutex> guard(fs_lock);
+    if (fs->listDir(path, entries) == -1)
+        return false;
+    std::lock_guard<std::mutex> cache_guard(cache_lock);
+    dir_cache[path] = entries;
+    return true;
+}
+
+static bool
+lookup(const std::string& path, dir_entry& entry)
+{
+    if (path == "/") {
+        std::memset(&entry, 0, sizeof(dir_entry));
+        entry.type = TYPE_DIR;
+        entry.access_rights = READ | WRITE | EXECUTE;
+        return true;
+    }
+
+    std::string parent, name;
+    split(path, parent, name);
+    std::vector<dir_entry> entries;
+    if (!listing(parent, entries))
+        return false;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (name == entries[i].file_name) {
+            entry = entries[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+fill_stat(const dir_entry& entry, struct stat *st)
+{
+    std::memset(st, 0, sizeof(struct stat));
+    bool dir = (entry.type & TYPE_DIR) != 0;
+    st->st_mode = (dir ? S_IFDIR : S_IFREG) | (entry.access_rights & 7) << 6;
+    st->st_nlink = dir ? 2 : 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_size = dir ? BLOCK_SIZE : entry.size;
+    st->st_blksize = BLOCK_SIZE;
+    st->st_blocks = (st->st_size + 511) / 512;
+}
+
+static void *
+fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    (void)conn;
+    // FS starts its worker threads; they have to be started after fuse has
+    // daemonized, and the image is found relative to where we were started
+    if (chdir(image_dir.c_str()) == -1)
+        return NULL;
+    fs = new FS;
+
+    // nothing but this daemon changes the image, so the kernel may keep
+    // pages and attributes
+    cfg->kernel_cache = 1;
+    cfg->attr_timeout = 1.0;
+    cfg->entry_timeout = 1.0;
+    cfg->negative_timeout = 1.0;
+    return NULL;
+}
+
+static void
+fs_destroy(void *private_data)
+{
+    (void)private_data;
+    delete fs;
+}
+
+static int
+fs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    (void)fi;
+    dir_entry entry;
+    if (!lookup(path, entry))
+        return -ENOENT;
+    fill_stat(entry, st);
+    return 0;
+}
+
+static int
+fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+           struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    (void)offset;
+    (void)fi;
+    (void)flags;
+    std::vector<dir_entry> entries;
+    if (!listing(path, entries))
+        return -ENOENT;
+
+    filler(buf, ".", NULL, 0, (fuse_fill_dir_flags)0);
+    filler(buf, "..", NULL, 0, (fuse_fill_dir_flags)0);
+    for (size_t i = 0; i < entries.size(); i++) {
+        struct stat st;
+        fill_stat(entries[i], &st);
+        if (filler(buf, entries[i].file_name, &st, 0, FUSE_FILL_DIR_PLUS))
+            break;
+    }
+    return 0;
+}
+
+static int
+fs_open(const char *path, struct fuse_file_info *fi)
+{
+    dir_entry entry;
+    if (!lookup(path, entry))
+        return -ENOENT;
+    if (entry.type & TYPE_DIR)
+        return -EISDIR;
+    int mode = fi->flags & O_ACCMODE;
+    if ((mode != O_WRONLY && !(entry.access_rights & READ)) ||
+        (mode != O_RDONLY && !(entry.access_rights & WRITE)))
+        return -EACCES;
+
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int
+fs_read(const char *path, char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+    (void)fi;
+    std::lock_guard<std::mutex> guard(fs_lock);
+
+    // the kernel reads a file in pieces; each reads only its own blocks
+    std::vector<uint8_t> data;
+    if (fs->readFileAt(path, offset, size, data) == -1)
+        return -EIO;
+    std::memcpy(buf, data.data(), data.size());
+    return data.size();
+}
+
+static int
+fs_write(const char *path, const char *buf, size_t size, off_t offset,
+         struct fuse_file_info *fi)
+{
+    (void)fi;
+    std::lock_guard<std::mutex> guard(fs_lock);
+    dir_entry entry;
+    if (!fs->entryOf(path, entry))
+        return -ENOENT;
+    if (offset + size > INT32_MAX)
+        return -EFBIG;
+
+    int result;
+    if (offset == (off_t)entry.size) {
+        // 1) the common case, sequential writes, appends in place
+        result = fs->appendFile(path, (const uint8_t *)buf, size);
+    } else {
+        // 2) anything else rewrites the file
+        std::vector<uint8_t> data;
+        if (fs->readFile(path, data) == -1)
+            return -EIO;
+        if (data.size() < offset + size)
+            data.resize(offset + size, 0);
+        std::memcpy(data.data() + offset, buf, size);
+        result = fs->writeFile(path, data.data(), data.size());
+    }
+    changed();
+    return result == -1 ? -ENOSPC : (int)size;
+}
+
+static int
+fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    std::string parent, name;
+    split(path, parent, name);
+    if (name.size() > max_name)
+        return -ENAMETOOLONG;
+
+    std::lock_guard<std::mutex> guard(fs_lock);
+    uint8_t none = 0;
+    if (fs->writeFile(path, &none, 0) == -1)
+        return -ENOSPC;
+    if ((mode >> 6 & 7) != (READ | WRITE))
+        fs->chmod(std::to_string(mode >> 6 & 7), path);
+    changed();
+
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int
+fs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    (void)fi;
+    std::lock_guard<std::mutex> guard(fs_lock);
+    int result = fs->truncate(path, size);
+    changed();
+    return result == -1 ? -EIO : 0;
+}
+
+static int
+fs_unlink(const char *path)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    dir_entry entry;
+    if (!fs->entryOf(path, entry))
+        return -ENOENT;
+    if (!(entry.access_rights & WRITE))
+        return -EACCES;
+    int result = fs->rm(path);
+    changed();
+    return result == -1 ? -EIO : 0;
+}
+
+static int
+fs_rmdir(const char *path)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    std::vector<dir_entry> entries;
+    if (fs->listDir(path, entries) == -1)
+        return -ENOTDIR;
+    if (!entries.empty())
+        return -ENOTEMPTY;
+    int result = fs->rm(path);
+    changed();
+    return result == -1 ? -EACCES : 0;
+}
+
+static int
+fs_mkdir(const char *path, mode_t mode)
+{
+    (void)mode;
+    std::lock_guard<std::mutex> guard(fs_lock);
+    int result = fs->mkdir(path);
+    changed();
+    return result == -1 ? -ENOSPC : 0;
+}
+
+static int
+fs_rename(const char *from, const char *to, unsigned int flags)
+{
+    if (flags)
+        return -EINVAL;
+    std::lock_guard<std::mutex> guard(fs_lock);
+
+    // 1) what FS::mv would refuse, checked while the target is still there
+    std::string source_path = from, target_path = to, parent, name;
+    dir_entry source, dir;
+    if (!fs->entryOf(from, source))
+        return -ENOENT;
+    if (source_path == target_path)
+        return 0;
+    split(target_path, parent, name);
+    if (name.size() > max_name)
+        return -ENAMETOOLONG;
+    if (!fs->entryOf(parent, dir) || !(dir.type & TYPE_DIR))
+        return -ENOENT;
+    if ((source.type & TYPE_DIR) && target_path.compare(0, source_path.size() + 1, source_path + "/") == 0)
+        return -EINVAL;
+
+    // 2) FS::mv moves into an existing directory and refuses to overwrite;
+    //    rename replaces the target instead. Its slot is the one the moved
+    //    entry takes, so a full directory can't fail the move any more
+    dir_entry target;
+    if (fs->entryOf(to, target)) {
+        if ((source.type & TYPE_DIR) && !(target.type & TYPE_DIR))
+            return -ENOTDIR;
+        if (!(source.type & TYPE_DIR) && (target.type & TYPE_DIR))
+            return -EISDIR;
+        std::vector<dir_entry> entries;
+        if ((target.type & TYPE_DIR) && (fs->listDir(to, entries) == -1 || !entries.empty()))
+            return -ENOTEMPTY;
+        if (fs->rm(to) == -1)
+            return -EACCES;
+    }
+    int result = fs->mv(from, to);
+    changed();
+    return result == -1 ? -EACCES : 0;
+}
+
+static int
+fs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    (void)fi;
+    std::lock_guard<std::mutex> guard(fs_lock);
+    int result = fs->chmod(std::to_string(mode >> 6 & 7), path);
+    changed();
+    return result == -1 ? -ENOENT : 0;
+}
+
+static int
+fs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+{
+    // there are no time stamps to set; succeed so that touch works
+    (void)tv;
+    (void)fi;
+    dir_entry entry;
+    return lookup(path, entry) ? 0 : -ENOENT;
+}
+
+static int
+fs_statfs(const char *path, struct statvfs *st)
+{
+    (void)path;
+    int total, free_blks;
+    {
+        std::lock_guard<std::mutex> guard(fs_lock);
+        fs->space(total, free_blks);
+    }
+    std::memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = total;
+    st->f_bfree = free_blks;
+    st->f_bavail = free_blks;
+    st->f_namemax = max_name;
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        std::cout << "Cannot find the current directory\n";
+        return 1;
+    }
+    image_dir = cwd;
+
+    struct fuse_operations ops;
+    std::memset(&ops, 0, sizeof(ops));
+    ops.init = fs_init;
+    ops.destroy = fs_destroy;
+    ops.getattr = fs_getattr;
+    ops.readdir = fs_readdir;
+    ops.open = fs_open;
+    ops.read = fs_read;
+    ops.write = fs_write;
+    ops.create = fs_create;
+    ops.truncate = fs_truncate;
+    ops.unlink = fs_unlink;
+    ops.rmdir = fs_rmdir;
+    ops.mkdir = fs_mkdir;
+    ops.rename = fs_rename;
+    ops.chmod = fs_chmod;
+    ops.utimens = fs_utimens;
+    ops.statfs = fs_statfs;
+    return fuse_main(argc, argv, &ops, NULL);
+}
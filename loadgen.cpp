@@ -0,0 +1,205 @@
+/******************************************************************************
+ *             File : loadgen.cpp
+ *
+ * Load generator for fsserver:
+ *   loadgen [-c clients] [-n requests] [-d depth] [-s size] [-w percent] <socket>
+ * Every client is a thread with its own connection and its own file of
+ * size bytes. It sends n requests, keeping depth of them in flight: reads
+ * of the whole file, with percent of them replaced by rewrites of it.
+ * Prints the throughput and the latency of a request from send to
+ * response; the exit status is 1 if a request failed.
+ *****************************************************************************/
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "rpc.h"
+
+typedef std::chrono::steady_clock clock_type;
+
+struct client_result {
+    long requests;
+    long bytes;
+    long failed;
+    std::vector<double> latency; // microseconds
+};
+
+static int
+connect_to(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool
+send_all(int fd, const std::string& out)
+{
+    size_t done = 0;
+    while (done < out.size()) {
+        ssize_t n = send(fd, out.data() + done, out.size() - done, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// next response on fd; in and pos keep what was received beyond it
+static bool
+next_response(int fd, std::string& in, size_t& pos, rpc_response& resp)
+{
+    char buf[65536];
+    int got;
+    while ((got = rpc_decode_response(in, pos, resp)) == 0) {
+        if (pos > 0) {
+            in.erase(0, pos);
+            pos = 0;
+        }
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            return false;
+        in.append(buf, n);
+    }
+    return got == 1;
+}
+
+static void
+client(const char *socket_path, int index, long requests, int depth, size_t size,
+       int write_percent, client_result& result)
+{
+    result.requests = result.bytes = result.failed = 0;
+    int fd = connect_to(socket_path);
+    if (fd == -1) {
+        result.failed = requests;
+        return;
+    }
+
+    std::string path = "/lg" + std::to_string(index);
+    std::string content(size, (char)('a' + index % 26));
+    std::string in, out;
+    size_t pos = 0;
+    rpc_response resp;
+
+    // 1) the file to work on
+    rpc_encode_path(out, 0, RPC_WRITE, path, content.data(), content.size());
+    if (!send_all(fd, out) || !next_response(fd, in, pos, resp) || resp.status != 0) {
+        result.failed = requests;
+        close(fd);
+        return;
+    }
+
+    // 2) a window of depth requests: every response lets the next one go
+    std::vector<clock_type::time_point> sent(requests + 1);
+    std::vector<uint8_t> op(requests + 1);
+    unsigned seed = index + 1;
+    long next = 1, done = 0;
+    while (done < requests) {
+        out.clear();
+        while (next <= requests && next - done <= depth) {
+            op[next] = (long)(rand_r(&seed) % 100) < write_percent ? RPC_WRITE : RPC_READ;
+            if (op[next] == RPC_WRITE)
+                rpc_encode_path(out, next, RPC_WRITE, path, content.data(), content.size());
+            else
+                rpc_encode_path(out, next, RPC_READ, path);
+            sent[next] = clock_type::now();
+            next++;
+        }
+        if (!out.empty() && !send_all(fd, out))
+            break;
+
+        if (!next_response(fd, in, pos, resp) || resp.id == 0 || resp.id > (uint32_t)requests)
+            break;
+        clock_type::time_point now = clock_type::now();
+        result.latency.push_back(std::chrono::duration<double, std::micro>(now - sent[resp.id]).count());
+        bool ok = resp.status == 0 && (op[resp.id] == RPC_WRITE || resp.payload == content);
+        result.failed += !ok;
+        result.bytes += size;
+        result.requests++;
+        done++;
+    }
+    result.failed += requests - done;
+
+    // 3) clean up
+    out.clear();
+    std::string cmd = "rm " + path + "\n";
+    rpc_encode_request(out, 0, RPC_COMMAND, cmd.data(), cmd.size());
+    if (send_all(fd, out))
+        next_response(fd, in, pos, resp);
+    close(fd);
+}
+
+int
+main(int argc, char **argv)
+{
+    int clients = 4, depth = 8, write_percent = 0;
+    long requests = 10000;
+    size_t size = 4096;
+    int arg = 1;
+    while (arg + 1 < argc && argv[arg][0] == '-') {
+        long v = std::atol(argv[arg + 1]);
+        switch (argv[arg][1]) {
+        case 'c': clients = v; break;
+        case 'n': requests = v; break;
+        case 'd': depth = v; break;
+        case 's': size = v; break;
+        case 'w': write_percent = v; break;
+        default: clients = 0;
+        }
+        arg += 2;
+    }
+    if (arg + 1 != argc || clients <= 0 || requests <= 0 || depth <= 0 || write_percent < 0 ||
+        write_percent > 100) {
+        std::cout << "Usage: " << argv[0] << " [-c clients] [-n requests] [-d depth] [-s size] [-w percent] <socket>\n";
+        return 2;
+    }
+    const char *socket_path = argv[arg];
+
+    std::vector<client_result> results(clients);
+    std::vector<std::thread> threads;
+    clock_type::time_point start = clock_type::now();
+    for (int i = 0; i < clients; i++)
+        threads.push_back(std::thread(client, socket_path, i, requests, depth, size,
+                                      write_percent, std::ref(results[i])));
+    for (int i = 0; i < clients; i++)
+        threads[i].join();
+    double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+
+    long total = 0, bytes = 0, failed = 0;
+    std::vector<double> latency;
+    for (int i = 0; i < clients; i++) {
+        total += results[i].requests;
+        bytes += results[i].bytes;
+        failed += results[i].failed;
+        latency.insert(latency.end(), results[i].latency.begin(), results[i].latency.end());
+    }
+    std::sort(latency.begin(), latency.end());
+    double p50 = latency.empty() ? 0 : latency[latency.size() / 2];
+    double p99 = latency.empty() ? 0 : latency[latency.size() * 99 / 100];
+
+    std::cout << clients << " clients, depth " << depth << ", " << size << " bytes, "
+              << write_percent << "% writes: " << total << " requests in " << seconds << " s\n";
+    std::cout << "  " << (long)(total / seconds) << " requests/s, "
+              << (long)(bytes / seconds / (1 << 20)) << " MB/s, latency p50 "
+              << (long)p50 << " us, p99 " << (long)p99 << " us\n";
+    if (failed)
+        std::cout << "  " << failed << " requests failed\n";
+    return failed ? 1 : 0;
+}
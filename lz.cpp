@@ -0,0 +1,152 @@
+#include <cstring>
+#include "lz.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5 // the end of the input is never part of a match
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline int
+hash32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// writes a length that did not fit in its nibble as 255-byte steps
+static bool
+putLength(uint8_t *dst, int& op, int cap, int len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op >= cap)
+            return false;
+        dst[op++] = 255;
+    }
+    if (op >= cap)
+        return false;
+    dst[op++] = len;
+    return true;
+}
+
+// emits one sequence; match_len 0 marks the final, literals-only sequence
+static bool
+putSequence(uint8_t *dst, int& op, int cap, const uint8_t *lit, int lit_len,
+            int offset, int match_len)
+{
+    if (op >= cap)
+        return false;
+    int ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    uint8_t& token = dst[op++];
+    token = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+    if (lit_len >= 15 && !putLength(dst, op, cap, lit_len - 15))
+        return false;
+    if (op + lit_len > cap)
+        return false;
+    std::memcpy(dst + op, lit, lit_len);
+    op += lit_len;
+    if (!match_len)
+        return true;
+
+    if (op + 2 > cap)
+        return false;
+    dst[op++] = offset & 0xff;
+    dst[op++] = offset >> 8;
+    if (ml >= 15 && !putLength(dst, op, cap, ml - 15))
+        return false;
+    return true;
+}
+
+int
+lz_compress(const uint8_t *src, int n, uint8_t *dst, int cap)
+{
+    int table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+        table[i] = -1;
+
+    int ip = 0, anchor = 0, op = 0;
+    int misses = 0;
+    const int limit = n - LZ_LAST_LITERALS;
+
+    while (ip + LZ_MIN_MATCH <= limit) {
+        uint32_t seq = read32(src + ip);
+        int h = hash32(seq);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(src + ref) != seq) {
+            // skip faster through data that does not compress
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        int len = LZ_MIN_MATCH;
+        while (ip + len < limit && src[ref + len] == src[ip + len])
+            len++;
+        if (!putSequence(dst, op, cap, src + anchor, ip - anchor, ip - ref, len))
+            return -1;
+        ip += len;
+        anchor = ip;
+    }
+
+    if (!putSequence(dst, op, cap, src + anchor, n - anchor, 0, 0))
+        return -1;
+    return op;
+}
+
+// reads the extra bytes of a length whose nibble was 15
+static bool
+getLength(const uint8_t *src, int& ip, int n, int& len)
+{
+    uint8_t b;
+    do {
+        if (ip >= n)
+            return false;
+        b = src[ip++];
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+int
+lz_decompress(const uint8_t *src, int n, uint8_t *dst, int cap)
+{
+    int ip = 0, op = 0;
+    while (ip < n) {
+        uint8_t token = src[ip++];
+
+        int lit_len = token >> 4;
+        if (lit_len == 15 && !getLength(src, ip, n, lit_len))
+            return -1;
+        if (ip + lit_len > n || op + lit_len > cap)
+            return -1;
+        std::memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == n)
+            break; // the final sequence
+
+        if (ip + 2 > n)
+            return -1;
+        int offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        int match_len = token & 15;
+        if (match_len == 15 && !getLength(src, ip, n, match_len))
+            return -1;
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + match_len > cap)
+            return -1;
+
+        // byte by byte: the match may overlap the bytes it produces
+        const uint8_t *ref = dst + op - offset;
+        for (int i = 0; i < match_len; i++)
+            dst[op + i] = ref[i];
+        op += match_len;
+    }
+    return op;
+}
@@ -0,0 +1,20 @@
+#include <cstdint>
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+// A small LZ77 block codec in the style of LZ4. A compressed block is a list
+// of sequences: a token byte (high nibble literal count, low nibble match
+// length - LZ_MIN_MATCH, 15 meaning "more length bytes follow"), the literals,
+// a 16-bit little-endian match offset and the extra match length bytes. The
+// last sequence has literals only.
+#define LZ_MIN_MATCH 4
+
+// compresses n bytes of src into dst; returns the compressed size, or -1 if
+// it would not fit in cap bytes
+int lz_compress(const uint8_t *src, int n, uint8_t *dst, int cap);
+// decompresses n bytes of src into dst; returns the decompressed size, or -1
+// if the input is corrupt or would overflow cap bytes
+int lz_decompress(const uint8_t *src, int n, uint8_t *dst, int cap);
+
+#endif // __LZ_H__
@@ -0,0 +1,190 @@
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifndef __RPC_H__
+#define __RPC_H__
+
+// The protocol between fsserver and its clients over a Unix domain socket.
+// Every message is one frame; integers are in host byte order, the socket
+// being local.
+//
+//   request:  uint32 length | uint32 id | uint8 op     | payload
+//   response: uint32 length | uint32 id | int32 status | payload
+//
+// length counts the payload only. A client may send any number of requests
+// without waiting (pipelining); the responses of one connection come back
+// in request order, carrying the id of their request. status is 0, or -1
+// if the operation failed or its result is over RPC_MAX_PAYLOAD.
+//
+// Requests on a path start with a uint16 path length and the path; WRITE
+// and APPEND follow it with the file content, up to the end of the frame.
+// STATS carries any number of paths in that form, one after the other.
+
+enum rpc_op {
+    RPC_STAT = 1,    // path -> dir_entry
+    RPC_LIST = 2,    // path -> the dir_entry of every entry in the directory
+    RPC_READ = 3,    // path -> file content
+    RPC_WRITE = 4,   // path, content: creates the file or replaces its content
+    RPC_APPEND = 5,  // path, content: appends to the file
+    RPC_SPACE = 6,   // -> int32 blocks, int32 free blocks
+    RPC_COMMAND = 7, // shell command lines (create reads its data from the
+                     // lines after it) -> what they print
+    RPC_STATS = 8,   // paths -> a file_stat (fs.h) for each, found or not
+};
+
+static const uint32_t RPC_REQUEST_HEADER = 9;
+static const uint32_t RPC_RESPONSE_HEADER = 12;
+// larger than the disk, but sparse files can be larger still: the server
+// answers a request whose result would not fit with status -1
+static const uint32_t RPC_MAX_PAYLOAD = 64 << 20;
+
+struct rpc_request {
+    uint32_t id;
+    uint8_t op;
+    std::string payload;
+};
+
+struct rpc_response {
+    uint32_t id;
+    int32_t status;
+    std::string payload;
+};
+
+static inline void
+rpc_put32(std::string& out, uint32_t v)
+{
+    out.append((const char *)&v, 4);
+}
+
+static inline uint32_t
+rpc_get32(const char *p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+// appends a request frame to out
+static inline void
+rpc_encode_request(std::string& out, uint32_t id, uint8_t op, const void *payload, size_t size)
+{
+    rpc_put32(out, size);
+    rpc_put32(out, id);
+    out.push_back((char)op);
+    out.append((const char *)payload, size);
+}
+
+// the same for a request on a path, with data behind the path
+static inline void
+rpc_encode_path(std::string& out, uint32_t id, uint8_t op, const std::string& path,
+                const void *data = nullptr, size_t size = 0)
+{
+    uint16_t path_len = path.size();
+    rpc_put32(out, 2 + path.size() + size);
+    rpc_put32(out, id);
+    out.push_back((char)op);
+    out.append((const char *)&path_len, 2);
+    out.append(path);
+    out.append((const char *)data, size);
+}
+
+// the same for a request on many paths
+static inline void
+rpc_encode_paths(std::string& out, uint32_t id, uint8_t op, const std::vector<std::string>& paths)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < paths.size(); i++)
+        size += 2 + paths[i].size();
+    rpc_put32(out, size);
+    rpc_put32(out, id);
+    out.push_back((char)op);
+    for (size_t i = 0; i < paths.size(); i++) {
+        uint16_t path_len = paths[i].size();
+        out.append((const char *)&path_len, 2);
+        out.append(paths[i]);
+    }
+}
+
+static inline void
+rpc_encode_response(std::string& out, uint32_t id, int32_t status, const std::string& payload)
+{
+    rpc_put32(out, payload.size());
+    rpc_put32(out, id);
+    rpc_put32(out, (uint32_t)status);
+    out.append(payload);
+}
+
+// Takes the frame at buf[pos] if it is complete, advancing pos past it.
+// Returns 1 for a frame, 0 if more bytes are needed and -1 if the frame is
+// too large to be valid.
+static inline int
+rpc_decode_request(const std::string& buf, size_t& pos, rpc_request& req)
+{
+    if (buf.size() - pos < RPC_REQUEST_HEADER)
+        return 0;
+    uint32_t length = rpc_get32(buf.data() + pos);
+    if (length > RPC_MAX_PAYLOAD)
+        return -1;
+    if (buf.size() - pos < RPC_REQUEST_HEADER + length)
+        return 0;
+    req.id = rpc_get32(buf.data() + pos + 4);
+    req.op = (uint8_t)buf[pos + 8];
+    req.payload.assign(buf, pos + RPC_REQUEST_HEADER, length);
+    pos += RPC_REQUEST_HEADER + length;
+    return 1;
+}
+
+static inline int
+rpc_decode_response(const std::string& buf, size_t& pos, rpc_response& resp)
+{
+    if (buf.size() - pos < RPC_RESPONSE_HEADER)
+        return 0;
+    uint32_t length = rpc_get32(buf.data() + pos);
+    if (length > RPC_MAX_PAYLOAD)
+        return -1;
+    if (buf.size() - pos < RPC_RESPONSE_HEADER + length)
+        return 0;
+    resp.id = rpc_get32(buf.data() + pos + 4);
+    resp.status = (int32_t)rpc_get32(buf.data() + pos + 8);
+    resp.payload.assign(buf, pos + RPC_RESPONSE_HEADER, length);
+    pos += RPC_RESPONSE_HEADER + length;
+    return 1;
+}
+
+// splits a request payload into its path and the data behind it; false if
+// the payload is too short
+static inline bool
+rpc_path(const std::string& payload, std::string& path, size_t& data_pos)
+{
+    if (payload.size() < 2)
+        return false;
+    uint16_t path_len;
+    std::memcpy(&path_len, payload.data(), 2);
+    if (payload.size() < 2u + path_len)
+        return false;
+    path.assign(payload, 2, path_len);
+    data_pos = 2 + path_len;
+    return true;
+}
+
+// splits a STATS payload into its paths; false if it is cut short
+static inline bool
+rpc_paths(const std::string& payload, std::vector<std::string>& paths)
+{
+    size_t pos = 0;
+    while (pos < payload.size()) {
+        uint16_t path_len;
+        if (payload.size() - pos < 2)
+            return false;
+        std::memcpy(&path_len, payload.data() + pos, 2);
+        if (payload.size() - pos - 2 < path_len)
+            return false;
+        paths.push_back(payload.substr(pos + 2, path_len));
+        pos += 2 + path_len;
+    }
+    return true;
+}
+
+#endif // __RPC_H__
@@ -0,0 +1,409 @@
+/******************************************************************************
+ *             File : server_main.cpp
+ *
+ * Serves diskfile.bin to local clients: fsserver [-t threads] <socket>.
+ * Clients connect to the Unix domain socket and speak the protocol of
+ * rpc.h. One thread runs an epoll loop that does all socket I/O: it reads
+ * whatever a connection sent, splits it into requests (a client may have
+ * many in flight) and writes back the responses as far as the socket takes
+ * them. The requests themselves run on a worker pool. FS is not
+ * thread-safe, so a worker takes all requests a connection has queued and
+ * runs them under one hold of fs_lock; the other workers meanwhile decode
+ * and encode for other connections. SIGINT or SIGTERM stops the server.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <cerrno>
+#include <cstdlib>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "shell.h"
+#include "fs.h"
+#include "disk.h"
+#include "threadpool.h"
+#include "rpc.h"
+
+struct connection {
+    int fd;
+    std::string in;          // received, not yet decoded (loop thread only)
+    bool eof;                // the client sent all it will (loop thread only)
+    std::mutex lock;         // guards the members below
+    std::deque<rpc_request> queue;
+    std::string out;         // encoded responses not yet written
+    bool busy;               // a worker is running the queue
+    bool closed;
+};
+
+typedef std::shared_ptr<connection> conn_ptr;
+
+static std::mutex fs_lock;
+// connections with new responses, for the loop thread to write
+static std::mutex ready_lock;
+static std::vector<conn_ptr> ready;
+static int wake_fd;
+
+// Runs one request and returns its status; the result goes to payload.
+static int32_t
+serve(Shell& shell, const rpc_request& req, std::string& payload)
+{
+    FS& fs = shell.fs();
+    std::string path;
+    size_t data_pos = 0;
+    if (req.op != RPC_SPACE && req.op != RPC_COMMAND && req.op != RPC_STATS &&
+        !rpc_path(req.payload, path, data_pos))
+        return -1;
+
+    switch (req.op) {
+    case RPC_STAT: {
+        dir_entry entry;
+        if (!fs.entryOf(path, entry))
+            return -1;
+        payload.assign((const char *)&entry, sizeof(entry));
+        return 0;
+    }
+    case RPC_LIST: {
+        std::vector<dir_entry> entries;
+        if (fs.listDir(path, entries) == -1)
+            return -1;
+        payload.assign((const char *)entries.data(), entries.size() * sizeof(dir_entry));
+        return 0;
+    }
+    case RPC_READ: {
+        // a sparse file may be too large for one frame; don't even read it
+        dir_entry entry;
+        if (!fs.entryOf(path, entry) || entry.size > RPC_MAX_PAYLOAD)
+            return -1;
+        std::vector<uint8_t> data;
+        if (fs.readFile(path, data) == -1)
+            return -1;
+        payload.assign((const char *)data.data(), data.size());
+        return 0;
+    }
+    case RPC_WRITE:
+    case RPC_APPEND: {
+        const uint8_t *data = (const uint8_t *)req.payload.data() + data_pos;
+        size_t size = req.payload.size() - data_pos;
+        if (req.op == RPC_WRITE)
+            return fs.writeFile(path, data, size);
+        return fs.appendFile(path, data, size);
+    }
+    case RPC_SPACE: {
+        int total, free_blks;
+        fs.space(total, free_blks);
+        rpc_put32(payload, total);
+        rpc_put32(payload, free_blks);
+        return 0;
+    }
+    case RPC_STATS: {
+        std::vector<std::string> paths;
+        std::vector<file_stat> stats;
+        if (!rpc_paths(req.payload, paths))
+            return -1;
+        fs.statPaths(paths, stats);
+        payload.assign((const char *)stats.data(), stats.size() * sizeof(file_stat));
+        return 0;
+    }
+    case RPC_COMMAND: {
+        // the commands talk to std::cin and std::cout; point those at the
+        // request and the response (nothing else uses them meanwhile, all
+        // FS work being under fs_lock)
+        std::istringstream script(req.payload);
+        std::ostringstream printed;
+        std::streambuf *cin_buf = std::cin.rdbuf(script.rdbuf());
+        std::streambuf *cout_buf = std::cout.rdbuf(printed.rdbuf());
+        std::string line;
+        while (std::getline(std::cin, line))
+            shell.execute(line); // quit ends nothing but the script
+        std::cin.rdbuf(cin_buf);
+        std::cout.rdbuf(cout_buf);
+        std::cin.clear();
+        payload = printed.str();
+        return 0;
+    }
+    }
+    return -1;
+}
+
+// Worker task: runs the queue of c until it is empty.
+static void
+drain(Shell& shell, conn_ptr c)
+{
+    std::deque<rpc_request> batch;
+    bool more = true;
+    while (more) {
+        {
+            std::lock_guard<std::mutex> guard(c->lock);
+            if (c->closed) {
+                c->busy = false;
+                return;
+            }
+            batch.swap(c->queue);
+        }
+
+        // 1) run the whole batch under one hold of the lock
+        std::vector<int32_t> status(batch.size());
+        std::vector<std::string> payload(batch.size());
+        {
+            std::lock_guard<std::mutex> guard(fs_lock);
+            for (size_t i = 0; i < batch.size(); i++) {
+                status[i] = serve(shell, batch[i], payload[i]);
+                if (payload[i].size() > RPC_MAX_PAYLOAD) {
+                    // the client would take the frame for a corrupt one
+                    status[i] = -1;
+                    payload[i].clear();
+                }
+            }
+        }
+
+        // 2) encode outside of it; busy ends together with the last
+        //    output, so the loop never sees an idle connection with
+        //    responses still to come
+        std::string out;
+        for (size_t i = 0; i < batch.size(); i++)
+            rpc_encode_response(out, batch[i].id, status[i], payload[i]);
+        batch.clear();
+        {
+            std::lock_guard<std::mutex> guard(c->lock);
+            c->out.append(out);
+            more = !c->queue.empty();
+            c->busy = more;
+        }
+        {
+            std::lock_guard<std::mutex> guard(ready_lock);
+            ready.push_back(c);
+        }
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) == -1) {
+            // the counter is already non-zero, the loop wakes anyway
+        }
+    }
+}
+
+// Writes as much of c->out as the socket takes. False if the connection
+// broke, or if the client is done sending and has got every response.
+static bool
+flush(int epfd, const conn_ptr& c)
+{
+    std::lock_guard<std::mutex> guard(c->lock);
+    size_t done = 0;
+    while (done < c->out.size()) {
+        ssize_t n = send(c->fd, c->out.data() + done, c->out.size() - done, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN)
+            break;
+        if (n == -1)
+            return false;
+        done += n;
+    }
+    c->out.erase(0, done);
+    if (c->eof && !c->busy && c->queue.empty() && c->out.empty())
+        return false;
+
+    // wait for room in the socket only while something is left over
+    struct epoll_event ev;
+    ev.events = (c->eof ? 0u : (uint32_t)EPOLLIN) | (c->out.empty() ? 0u : (uint32_t)EPOLLOUT);
+    ev.data.fd = c->fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    return true;
+}
+
+static void
+close_conn(int epfd, std::map<int, conn_ptr>& conns, const conn_ptr& c)
+{
+    {
+        std::lock_guard<std::mutex> guard(c->lock);
+        c->closed = true;
+        c->queue.clear();
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    conns.erase(c->fd);
+}
+
+// reads what c sent and queues the complete requests; false if the
+// connection is to be closed
+static bool
+receive(int epfd, ThreadPool& pool, Shell& shell, const conn_ptr& c)
+{
+    char buf[65536];
+    for (;;) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN)
+            break;
+        if (n <= 0) {
+            c->eof = true;
+            break;
+        }
+        c->in.append(buf, n);
+    }
+
+    std::vector<rpc_request> reqs;
+    size_t pos = 0;
+    rpc_request req;
+    int got;
+    while ((got = rpc_decode_request(c->in, pos, req)) == 1)
+        reqs.push_back(req);
+    c->in.erase(0, pos);
+    if (got == -1)
+        return false;
+
+    if (!reqs.empty()) {
+        std::lock_guard<std::mutex> guard(c->lock);
+        for (size_t i = 0; i < reqs.size(); i++)
+            c->queue.push_back(reqs[i]);
+        if (!c->busy) {
+            c->busy = true;
+            conn_ptr keep = c;
+            pool.submit([&shell, keep]() { drain(shell, keep); });
+        }
+    }
+    // after the end of the input, the responses still go out
+    return !c->eof || flush(epfd, c);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned threads = std::thread::hardware_concurrency();
+    int arg = 1;
+    if (argc == 4 && std::strcmp(argv[1], "-t") == 0) {
+        threads = std::atoi(argv[2]);
+        arg = 3;
+    }
+    if (argc != arg + 1 || threads == 0) {
+        std::cout << "Usage: " << argv[0] << " [-t threads] <socket>\n";
+        return 2;
+    }
+    const char *socket_path = argv[arg];
+
+    // 1) listening socket
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (std::strlen(socket_path) >= sizeof(addr.sun_path)) {
+        std::cout << "Socket path too long\n";
+        return 1;
+    }
+    std::strcpy(addr.sun_path, socket_path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    unlink(socket_path);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 128) == -1) {
+        std::cout << "Cannot listen on " << socket_path << ": " << std::strerror(errno) << "\n";
+        return 1;
+    }
+
+    // 2) the signals arrive as events, like everything else
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop, NULL);
+    int signal_fd = signalfd(-1, &stop, SFD_NONBLOCK);
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+
+    int epfd = epoll_create1(0);
+    int fds[] = { listen_fd, signal_fd, wake_fd };
+    for (int i = 0; i < 3; i++) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fds[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+    }
+
+    Shell shell;
+    std::map<int, conn_ptr> conns;
+    {
+        ThreadPool pool(threads);
+        std::cout << "Serving on " << socket_path << " with " << threads << " workers\n";
+
+        // 3) the event loop
+        bool running = true;
+        while (running) {
+            struct epoll_event events[64];
+            int n = epoll_wait(epfd, events, 64, 100);
+            if (n == -1 && errno != EINTR)
+                break;
+            if (n == 0) {
+                // quiet for a while: background work, as between shell commands
+                pool.submit([&shell]() {
+                    std::lock_guard<std::mutex> guard(fs_lock);
+                    shell.fs().idle();
+                });
+                continue;
+            }
+
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == signal_fd) {
+                    running = false;
+                } else if (fd == listen_fd) {
+                    int cfd;
+                    while ((cfd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+                        conn_ptr c(new connection);
+                        c->fd = cfd;
+                        c->eof = false;
+                        c->busy = false;
+                        c->closed = false;
+                        conns[cfd] = c;
+                        struct epoll_event ev;
+                        ev.events = EPOLLIN;
+                        ev.data.fd = cfd;
+                        epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev);
+                    }
+                } else if (fd == wake_fd) {
+                    uint64_t count;
+                    if (read(wake_fd, &count, sizeof(count)) == -1) {
+                        // nothing to reset
+                    }
+                    std::vector<conn_ptr> now;
+                    {
+                        std::lock_guard<std::mutex> guard(ready_lock);
+                        now.swap(ready);
+                    }
+                    for (size_t k = 0; k < now.size(); k++) {
+                        if (conns.count(now[k]->fd) && conns[now[k]->fd] == now[k] && !flush(epfd, now[k]))
+                            close_conn(epfd, conns, now[k]);
+                    }
+                } else if (conns.count(fd)) {
+                    conn_ptr c = conns[fd];
+                    if ((events[i].events & EPOLLOUT) && !flush(epfd, c))
+                        close_conn(epfd, conns, c);
+                    else if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !receive(epfd, pool, shell, c))
+                        close_conn(epfd, conns, c);
+                }
+            }
+        }
+
+        // 4) finish what was accepted, then stop the workers
+        pool.wait();
+    }
+
+    std::vector<conn_ptr> all;
+    for (std::map<int, conn_ptr>::iterator it = conns.begin(); it != conns.end(); ++it)
+        all.push_back(it->second);
+    for (size_t i = 0; i < all.size(); i++)
+        close_conn(epfd, conns, all[i]);
+    close(listen_fd);
+    unlink(socket_path);
+    std::cout << "Server stopped\n";
+    return 0;
+}
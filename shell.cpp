@@ -9,10 +9,36 @@ std::string commands_str[] = {
     "format", "create", "cat", "ls",
     "cp", "mv", "rm", "append",
     "mkdir", "cd", "pwd",
-    "chmod",
-    "help", "quit"
+    "chmod", "du", "stat", "find", "dedup", "df", "fsck", "defrag",
+    "sync", "snapshot", "fallocate", "truncate", "import", "export", "help", "quit"
 };
 
+// optional volume features accepted by "format"
+struct format_feature {
+    const char *name;
+    int flag;
+};
+static const format_feature format_features[] = {
+    { "extent", FEAT_EXTENTS },
+    { "tail", FEAT_TAILS },
+    { "inline", FEAT_INLINE },
+    { "pack", FEAT_PACK },
+    { "compress", FEAT_COMPRESS },
+    { "dedup", FEAT_DEDUP },
+    { "snap", FEAT_SNAPSHOT },
+    { "compact", FEAT_COMPACT_DIRS },
+};
+static const int no_format_features = sizeof(format_features) / sizeof(format_features[0]);
+
+// a size in bytes: digits only
+static bool parse_size(const std::string& str, long& bytes)
+{
+    if (str.empty() || str.size() > 10 || str.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    bytes = std::stol(str);
+    return true;
+}
+
 Shell::Shell()
 {
     std::cout << "Starting shell...\n";
@@ -28,225 +54,436 @@ Shell::run()
 {
     bool running = true;
     std::string line;
+    while (running) {
+        filesystem.idle(); // background work between commands
+        std::cout << "filesystem> ";
+        // the end of the input (e.g. after create <file> -) ends the shell
+        running = std::getline(std::cin, line) && execute(line);
+    }
+}
+
+bool
+Shell::execute(const std::string& line)
+{
     std::string str;
     char c;
     std::vector<std::string> cmd_line;
     std::string cmd, arg1, arg2;
     int ret_val = 0;
-    while (running) {
-        std::cout << "filesystem> ";
-        std::getline(std::cin, line);
-        std::stringstream linestream(line);
-        cmd_line.clear();
-        str.clear();
-        while (linestream.get(c)) {
-            //std::cout << "parsing cmd line: " << c << "\n";
-            if (c != ' ') {
-                str += c;
-            } else {
-                // strip multiple blanks
-                if (!str.empty()) {
-                    cmd_line.push_back(str);
-                    str.clear();
-                }
+    std::stringstream linestream(line);
+    while (linestream.get(c)) {
+        //std::cout << "parsing cmd line: " << c << "\n";
+        if (c != ' ') {
+            str += c;
+        } else {
+            // strip multiple blanks
+            if (!str.empty()) {
+                cmd_line.push_back(str);
+                str.clear();
             }
         }
-        if (!str.empty())
-            cmd_line.push_back(str);
-        if (line.empty())
-            cmd = "";
-        else
-            cmd = cmd_line[0];
+    }
+    if (!str.empty())
+        cmd_line.push_back(str);
+    if (line.empty())
+        cmd = "";
+    else
+        cmd = cmd_line[0];
 
-        if (DEBUG) {
-            std::cout << "Line: " << line << std::endl;
-            std::cout << "cmd: " << cmd << std::endl;
-            for (unsigned i = 0; i < cmd_line.size(); ++i)
-                std::cout << "cmd/arg: " << cmd_line[i] << "\n";
-        }
+    if (DEBUG) {
+        std::cout << "Line: " << line << std::endl;
+        std::cout << "cmd: " << cmd << std::endl;
+        for (unsigned i = 0; i < cmd_line.size(); ++i)
+            std::cout << "cmd/arg: " << cmd_line[i] << "\n";
+    }
 
-        if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.format();
-            if (ret_val) {
-                std::cout << "Error: format failed, error code " << ret_val << std::endl;
-            }
+    if (cmd == "format") {
+        int features = 0;
+        bool known = true;
+        for (unsigned i = 1; i < cmd_line.size(); ++i) {
+            int k = 0;
+            while (k < no_format_features && cmd_line[i] != format_features[k].name)
+                k++;
+            if (k == no_format_features)
+                known = false;
+            else
+                features |= format_features[k].flag;
+        }
+        if (!known) {
+            std::cout << "Usage: format [";
+            for (int k = 0; k < no_format_features; k++)
+                std::cout << (k ? "] [" : "") << format_features[k].name;
+            std::cout << "]\n";
+            return true;
+        }
+        // check return value so everything is ok
+        ret_val = filesystem.format(features);
+        if (ret_val) {
+            std::cout << "Error: format failed, error code " << ret_val << std::endl;
         }
+    }
 
-        else if (cmd == "create") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: create <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
+    else if (cmd == "create") {
+        // create <file> <bytes> takes that many raw bytes after the command,
+        // create <file> - all of the remaining input
+        long bytes = -1;
+        if (cmd_line.size() < 2 || cmd_line.size() > 3 ||
+            (cmd_line.size() == 3 && cmd_line[2] != "-" && !parse_size(cmd_line[2], bytes))) {
+            std::cout << "Usage: create <file> [<bytes> | -]\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        if (cmd_line.size() == 3) {
+            ret_val = filesystem.create(arg1, bytes);
+        } else {
             std::cout << "Enter data. Empty line to end.\n";
-            // check return value so everything is ok
             ret_val = filesystem.create(arg1);
-            if (ret_val) {
-                std::cout << "Error: create " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
         }
+        if (ret_val) {
+            std::cout << "Error: create " << arg1;
+            std::cout << " failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "cat") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cat <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.cat(arg1);
-            if (ret_val) {
-                std::cout << "Error: cat " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "cat") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: cat <file>\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = filesystem.cat(arg1);
+        if (ret_val) {
+            std::cout << "Error: cat " << arg1;
+            std::cout << " failed, error code " << ret_val << std::endl;
         }
+    }
 
-        else if (cmd == "ls") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: ls\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.ls();
-            if (ret_val) {
-                std::cout << "Error: ls failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "ls") {
+        // options page through the directory sorted by name, or by size
+        int order = LS_SLOT, limit = 0;
+        std::string after;
+        bool ok = cmd_line.size() % 2 == 1;
+        for (size_t i = 1; ok && i + 1 < cmd_line.size(); i += 2) {
+            long n;
+            if (order == LS_SLOT)
+                order = LS_NAME;
+            if (cmd_line[i] == "--sort" && (cmd_line[i + 1] == "name" || cmd_line[i + 1] == "size"))
+                order = cmd_line[i + 1] == "name" ? LS_NAME : LS_SIZE;
+            else if (cmd_line[i] == "--limit" && parse_size(cmd_line[i + 1], n) && n > 0 && n <= INT32_MAX)
+                limit = n;
+            else if (cmd_line[i] == "--after")
+                after = cmd_line[i + 1];
+            else
+                ok = false;
+        }
+        if (!ok) {
+            std::cout << "Usage: ls [--sort name|size] [--limit <n>] [--after <name>]\n";
+            return true;
         }
+        // check return value so everything is ok
+        ret_val = filesystem.ls(order, after, limit);
+        if (ret_val) {
+            std::cout << "Error: ls failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "cp") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: <oldfile> <newfile>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.cp(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: cp " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "cp") {
+        bool recursive = cmd_line.size() == 4 && cmd_line[1] == "-r";
+        if (cmd_line.size() != 3 && !recursive) {
+            std::cout << "Usage: cp [-r] <oldfile> <newfile>\n";
+            return true;
         }
+        arg1 = cmd_line[cmd_line.size() - 2];
+        arg2 = cmd_line[cmd_line.size() - 1];
+        // check return value so everything is ok
+        ret_val = filesystem.cp(arg1, arg2, recursive);
+        if (ret_val) {
+            std::cout << "Error: cp " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "mv") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: mv <sourcepath> <destpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.mv(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: mv " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "mv") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: mv <sourcepath> <destpath>\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.mv(arg1, arg2);
+        if (ret_val) {
+            std::cout << "Error: mv " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << std::endl;
         }
+    }
 
-        else if (cmd == "rm") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: rm <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.rm(arg1);
-            if (ret_val) {
-                std::cout << "Error: rm " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "rm") {
+        bool recursive = cmd_line.size() == 3 && cmd_line[1] == "-r";
+        if (cmd_line.size() != 2 && !recursive) {
+            std::cout << "Usage: rm [-r] <file>\n";
+            return true;
+        }
+        arg1 = cmd_line[cmd_line.size() - 1];
+        // check return value so everything is ok
+        ret_val = filesystem.rm(arg1, recursive);
+        if (ret_val) {
+            std::cout << "Error: rm " << arg1;
+            std::cout << " failed, error code " << ret_val << std::endl;
         }
+    }
 
-        else if (cmd == "append") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: append <filepath1> <filepath2>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.append(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: append " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "append") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: append <filepath1> <filepath2>\n";
+            return true;
         }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.append(arg1, arg2);
+        if (ret_val) {
+            std::cout << "Error: append " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "mkdir") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: mkdir <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.mkdir(arg1);
-            if (ret_val) {
-                std::cout << "Error: mkdir " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "mkdir") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: mkdir <dirpath>\n";
+            return true;
         }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = filesystem.mkdir(arg1);
+        if (ret_val) {
+            std::cout << "Error: mkdir " << arg1;
+            std::cout << " failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "cd") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cd <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.cd(arg1);
-            if (ret_val) {
-                std::cout << "Error: cd " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "cd") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: cd <dirpath>\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = filesystem.cd(arg1);
+        if (ret_val) {
+            std::cout << "Error: cd " << arg1;
+            std::cout << " failed, error code " << ret_val << std::endl;
         }
+    }
 
-        else if (cmd == "pwd") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: pwd\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.pwd();
-            if (ret_val) {
-                std::cout << "Error: pwd failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "pwd") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: pwd\n";
+            return true;
+        }
+        // check return value so everything is ok
+        ret_val = filesystem.pwd();
+        if (ret_val) {
+            std::cout << "Error: pwd failed, error code " << ret_val << std::endl;
         }
+    }
 
-        else if (cmd == "chmod") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: chmod <accessrights> <filepath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.chmod(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: chmod " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "chmod") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: chmod <accessrights> <filepath>\n";
+            return true;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = filesystem.chmod(arg1, arg2);
+        if (ret_val) {
+            std::cout << "Error: chmod " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << std::endl;
         }
+    }
 
-        else if (cmd == "quit")
-            running = false;
+    else if (cmd == "du") {
+        if (cmd_line.size() > 2) {
+            std::cout << "Usage: du [<path>]\n";
+            return true;
+        }
+        arg1 = cmd_line.size() == 2 ? cmd_line[1] : "";
+        // check return value so everything is ok
+        ret_val = filesystem.du(arg1);
+        if (ret_val) {
+            std::cout << "Error: du failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "help") {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+    else if (cmd == "stat") {
+        if (cmd_line.size() < 2) {
+            std::cout << "Usage: stat <path>...\n";
+            return true;
+        }
+        std::vector<std::string> paths(cmd_line.begin() + 1, cmd_line.end());
+        // check return value so everything is ok
+        ret_val = filesystem.stat(paths);
+        if (ret_val) {
+            std::cout << "Error: stat failed, error code " << ret_val << std::endl;
         }
+    }
+
+    else if (cmd == "find") {
+        bool sorted = cmd_line.size() > 1 && cmd_line[1] == "-s";
+        size_t first = sorted ? 2 : 1;
+        if (cmd_line.size() < first + 1 || cmd_line.size() > first + 2) {
+            std::cout << "Usage: find [-s] <pattern> [<path>]\n";
+            return true;
+        }
+        arg1 = cmd_line[first];
+        arg2 = cmd_line.size() == first + 2 ? cmd_line[first + 1] : "";
+        // check return value so everything is ok
+        ret_val = filesystem.find(arg1, arg2, sorted);
+        if (ret_val) {
+            std::cout << "Error: find " << arg1;
+            std::cout << " failed, error code " << ret_val << std::endl;
+        }
+    }
+
+    else if (cmd == "dedup") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: dedup\n";
+            return true;
+        }
+        // check return value so everything is ok
+        ret_val = filesystem.dedup();
+        if (ret_val) {
+            std::cout << "Error: dedup failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else if (cmd == "") {
-            ; // do nothing
+    else if (cmd == "df") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: df\n";
+            return true;
         }
+        // check return value so everything is ok
+        ret_val = filesystem.df();
+        if (ret_val) {
+            std::cout << "Error: df failed, error code " << ret_val << std::endl;
+        }
+    }
 
-        else {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+    else if (cmd == "fsck") {
+        bool repair = cmd_line.size() == 2 && cmd_line[1] == "-r";
+        if (cmd_line.size() != 1 && !repair) {
+            std::cout << "Usage: fsck [-r]\n";
+            return true;
         }
+        // check return value so everything is ok
+        ret_val = filesystem.fsck(repair);
+        if (ret_val) {
+            std::cout << "Error: fsck failed, error code " << ret_val << std::endl;
+        }
+    }
+
+    else if (cmd == "defrag") {
+        bool background = cmd_line.size() == 2 && cmd_line[1] == "-b";
+        if (cmd_line.size() != 1 && !background) {
+            std::cout << "Usage: defrag [-b]\n";
+            return true;
+        }
+        // check return value so everything is ok
+        ret_val = filesystem.defrag(background);
+        if (ret_val) {
+            std::cout << "Error: defrag failed, error code " << ret_val << std::endl;
+        }
+    }
+
+    else if (cmd == "sync") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: sync\n";
+            return true;
+        }
+        // check return value so everything is ok
+        ret_val = filesystem.sync();
+        if (ret_val) {
+            std::cout << "Error: sync failed, error code " << ret_val << std::endl;
+        }
+    }
+
+    else if (cmd == "snapshot") {
+        std::string opt = cmd_line.size() > 1 ? cmd_line[1] : "";
+        bool named = cmd_line.size() == 2 && opt[0] != '-';
+        bool flag_only = cmd_line.size() == 2 && (opt == "-l" || opt == "-u");
+        bool with_name = cmd_line.size() == 3 && (opt == "-d" || opt == "-m");
+        if (!named && !flag_only && !with_name) {
+            std::cout << "Usage: snapshot <name> | -l | -d <name> | -m <name> | -u\n";
+            return true;
+        }
+        // check return value so everything is ok
+        if (named)
+            ret_val = filesystem.snapshot(opt);
+        else if (opt == "-l")
+            ret_val = filesystem.listSnapshots();
+        else if (opt == "-u")
+            ret_val = filesystem.mountSnapshot();
+        else if (opt == "-d")
+            ret_val = filesystem.deleteSnapshot(cmd_line[2]);
+        else
+            ret_val = filesystem.mountSnapshot(cmd_line[2]);
+        if (ret_val) {
+            std::cout << "Error: snapshot failed, error code " << ret_val << std::endl;
+        }
+    }
+
+    else if (cmd == "fallocate" || cmd == "truncate") {
+        long bytes;
+        if (cmd_line.size() != 3 || !parse_size(cmd_line[2], bytes)) {
+            std::cout << "Usage: " << cmd << " <file> <bytes>\n";
+            return true;
+        }
+        // check return value so everything is ok
+        if (cmd == "fallocate")
+            ret_val = filesystem.fallocate(cmd_line[1], bytes);
+        else
+            ret_val = filesystem.truncate(cmd_line[1], bytes);
+        if (ret_val) {
+            std::cout << "Error: " << cmd << " " << cmd_line[1] << " failed, error code " << ret_val << std::endl;
+        }
+    }
+
+    else if (cmd == "import" || cmd == "export") {
+        if (cmd_line.size() != 3) {
+            if (cmd == "import")
+                std::cout << "Usage: import <hostpath> <path>\n";
+            else
+                std::cout << "Usage: export <path> <hostpath>\n";
+            return true;
+        }
+        // check return value so everything is ok
+        if (cmd == "import")
+            ret_val = filesystem.importTree(cmd_line[1], cmd_line[2]);
+        else
+            ret_val = filesystem.exportTree(cmd_line[1], cmd_line[2]);
+        if (ret_val) {
+            std::cout << "Error: " << cmd << " " << cmd_line[1] << " failed, error code " << ret_val << std::endl;
+        }
+    }
+
+    else if (cmd == "quit")
+        return false;
+
+    else if (cmd == "help") {
+        std::cout << "Available commands:\n";
+        std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, du, stat, find, dedup, df, fsck, defrag, sync, snapshot, fallocate, truncate, import, export, help, quit\n";
+    }
+
+    else if (cmd == "") {
+        ; // do nothing
+    }
+
+    else {
+        std::cout << "Available commands:\n";
+        std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, du, stat, find, dedup, df, fsck, defrag, sync, snapshot, fallocate, truncate, import, export, help, quit\n";
     }
+    return true;
 }
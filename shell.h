@@ -11,6 +11,10 @@ public:
     Shell();
     ~Shell();
     void run();
+    // runs one command line (create reads its data from std::cin);
+    // false if it was quit
+    bool execute(const std::string& line);
+    FS& fs() { return filesystem; }
 };
 
 #endif // __SHELL_H__
@@ -0,0 +1,748 @@
+/******************************************************************************
+ *             File : test_script6.cpp
+ *
+ * Test program for the extended commands of the file system: recursive
+ * cp/rm, moving directories, du and the extent, inline, packed, compressed
+ * and deduplicated file layouts.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+void
+Shell::run()
+{
+    int fw;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Extended commands ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Creating /d1/d2 with the files f1, d2/f2 and d2/f3..." << std::endl;
+    filesystem.format();
+    filesystem.mkdir("d1");
+    filesystem.mkdir("d1/d2");
+    filesystem.cd("d1");
+    fw = open("input1.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f1");
+    close(fw);
+    filesystem.cd("d2");
+    fw = open("input2.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f2");
+    close(fw);
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f3");
+    close(fw);
+    filesystem.cd("..");
+    filesystem.cd("..");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "size\t blocks\t path" << std::endl;
+    std::cout << "4152\t 4\t /d1/d2" << std::endl;
+    std::cout << "4168\t 6\t /d1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.du("/d1");
+    PRINTDIV2;
+
+    std::cout << "Testing cp -r (d1,d4)..." << std::endl;
+    filesystem.cp("d1", "d4", true);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "hej heja hejare hejast" << std::endl;
+    std::cout << "size\t blocks\t path" << std::endl;
+    std::cout << "4152\t 4\t d4/d2" << std::endl;
+    std::cout << "4168\t 6\t d4" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("d4/d2/f2");
+    filesystem.du("d4");
+    std::cout << "--------\nTry to copy a directory into itself... cp -r (d1,d1/d2)" << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "... some kind of error message" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cp("d1", "d1/d2", true);
+    PRINTDIV2;
+
+    std::cout << "Testing mv of a directory, mv(d4,d1/d2)..." << std::endl;
+    filesystem.mv("d4", "d1/d2");
+    filesystem.cd("d1/d2/d4/d2");
+    filesystem.cd("../../..");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "/d1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.pwd();
+    filesystem.cd("..");
+    PRINTDIV2;
+
+    std::cout << "Testing pwd after renaming a directory above the cwd..." << std::endl;
+    filesystem.cd("/d1/d2");
+    filesystem.mv("/d1", "/d9");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "/d9/d2" << std::endl;
+    std::cout << "/" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.pwd();
+    filesystem.mv("/d9", "/d1");
+    filesystem.cd("/");
+    filesystem.cd("..");
+    filesystem.pwd();
+    PRINTDIV2;
+
+    std::cout << "Testing rm on a non-empty directory..." << std::endl;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "... some kind of error message" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.rm("d1");
+    std::cout << "--------\nTesting rm -r (d1)..." << std::endl;
+    filesystem.rm("d1", true);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "size\t blocks\t path" << std::endl;
+    std::cout << "0\t 1\t /" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.du("/");
+    PRINTDIV2;
+
+    std::cout << "Testing the extent layout, format(FEAT_EXTENTS)..." << std::endl;
+    filesystem.format(FEAT_EXTENTS);
+    fw = open("input2.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f2");
+    close(fw);
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f3");
+    close(fw);
+    filesystem.cp("f3", "f4");
+    filesystem.append("f2", "f4");
+    filesystem.rm("f3");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "hej heja hejare hejast" << std::endl;
+    std::cout << "size\t blocks\t path" << std::endl;
+    std::cout << "4175\t 4\t /" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("f2");
+    filesystem.du("/");
+    PRINTDIV2;
+
+    std::cout << "Testing inline files, format(FEAT_INLINE)..." << std::endl;
+    filesystem.format(FEAT_INLINE);
+    fw = open("input1.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f1");
+    close(fw);
+    filesystem.cp("f1", "f5");
+    filesystem.append("f1", "f5");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "hej heja hejare" << std::endl;
+    std::cout << "hej heja hejare" << std::endl;
+    std::cout << "size\t blocks\t path" << std::endl;
+    std::cout << "48\t 1\t /" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("f5");
+    filesystem.du("/");
+    PRINTDIV2;
+
+    std::cout << "Testing packed tails, format(FEAT_PACK)..." << std::endl;
+    filesystem.format(FEAT_PACK);
+    fw = open("input1.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f1");
+    close(fw);
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f3");
+    close(fw);
+    filesystem.cp("f1", "f5");
+    filesystem.append("f3", "f5");
+    filesystem.rm("f1");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "size\t blocks\t path" << std::endl;
+    std::cout << "8274\t 3\t /" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.du("/");
+    PRINTDIV2;
+
+    std::cout << "Testing compressed files, format(FEAT_COMPRESS)..." << std::endl;
+    filesystem.format(FEAT_COMPRESS);
+    fw = open("input2.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f2");
+    close(fw);
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f3");
+    close(fw);
+    filesystem.append("f3", "f3");
+    filesystem.append("f2", "f3");
+    filesystem.cp("f3", "f4");
+    filesystem.rm("f3");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "size\t blocks\t path" << std::endl;
+    std::cout << "8304\t 3\t /" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.du("/");
+    PRINTDIV2;
+
+    std::cout << "Testing shared blocks, format(FEAT_DEDUP)..." << std::endl;
+    filesystem.format(FEAT_DEDUP);
+    fw = open("input2.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f2");
+    close(fw);
+    filesystem.cp("f2", "f4");
+    filesystem.append("f2", "f4");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "hej heja hejare hejast" << std::endl;
+    std::cout << "hej heja hejare hejast" << std::endl;
+    std::cout << "hej heja hejare hejast" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("f2");
+    filesystem.cat("f4");
+    PRINTDIV2;
+
+    std::cout << "Testing df..." << std::endl;
+    filesystem.format();
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f3");
+    close(fw);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "total blocks        2048 (8388608 bytes)" << std::endl;
+    std::cout << "used blocks         4 (16384 bytes, 0%)" << std::endl;
+    std::cout << "free blocks         2044 (8372224 bytes)" << std::endl;
+    std::cout << "largest free run    2044 blocks" << std::endl;
+    std::cout << "FAT chains          3" << std::endl;
+    std::cout << "extent blocks       0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.df();
+    PRINTDIV2;
+
+    std::cout << "Testing fsck on a damaged disk..." << std::endl;
+    filesystem.format();
+    fw = open("input1.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f1");
+    close(fw);
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f3");
+    close(fw);
+    // the image itself only has what was written back
+    filesystem.sync();
+    {
+        // f3 is blocks 3 and 4; make it loop and leak block 100
+        Disk disk;
+        int16_t fat[BLOCK_SIZE / 2];
+        disk.read(FAT_BLOCK, (uint8_t *)fat);
+        fat[4] = 3;
+        fat[100] = FAT_EOF;
+        disk.write(FAT_BLOCK, (uint8_t *)fat);
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "/f3: chain loops back at block 4, chain ended there" << std::endl;
+    std::cout << "FAT: 1 blocks are marked used but not referenced, freed" << std::endl;
+    std::cout << "fsck: 2 problems found, 2 repaired" << std::endl;
+    std::cout << "fsck: no problems found" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.fsck(true);
+    filesystem.fsck();
+    PRINTDIV2;
+
+    std::cout << "Testing defrag..." << std::endl;
+    filesystem.format();
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f3");
+    close(fw);
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f5");
+    close(fw);
+    for (int i = 0; i < 3; i++) {
+        filesystem.append("f3", "f3");
+        filesystem.append("f5", "f5");
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "                    before     after" << std::endl;
+    std::cout << "files               2          2" << std::endl;
+    std::cout << "fragmented files    2          0" << std::endl;
+    std::cout << "runs                8          2" << std::endl;
+    std::cout << "avg run length      2.25       9.00" << std::endl;
+    std::cout << "moved 2 files (18 blocks)" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.defrag();
+    PRINTDIV2;
+
+    std::cout << "Testing defrag on a compress and dedup volume..." << std::endl;
+    filesystem.format(FEAT_COMPRESS | FEAT_DEDUP);
+    fw = open("input1.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f1");
+    close(fw);
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f3");
+    close(fw);
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f5");
+    close(fw);
+    for (int i = 0; i < 3; i++) {
+        filesystem.append("f3", "f3");
+        filesystem.append("f5", "f5");
+    }
+    // f1 becomes a plain extent file whose blocks carry references
+    filesystem.fallocate("f1", 8 * 4096);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "                    before     after" << std::endl;
+    std::cout << "files               3          3" << std::endl;
+    std::cout << "fragmented files    3          0" << std::endl;
+    std::cout << "runs                6          3" << std::endl;
+    std::cout << "avg run length      2.00       4.00" << std::endl;
+    std::cout << "moved 3 files (12 blocks)" << std::endl;
+    std::cout << "fsck: no problems found" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.defrag();
+    filesystem.fsck();
+    PRINTDIV2;
+
+    std::cout << "Testing snapshots..." << std::endl;
+    filesystem.format(FEAT_SNAPSHOT);
+    fw = open("input2.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f2");
+    close(fw);
+    filesystem.snapshot("s1");
+    filesystem.append("f2", "f2");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "hej heja hejare hejast" << std::endl;
+    std::cout << "Snapshot s1 is read-only" << std::endl;
+    std::cout << "hej heja hejare hejast" << std::endl;
+    std::cout << "hej heja hejare hejast" << std::endl;
+    std::cout << "fsck: no problems found" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.mountSnapshot("s1");
+    filesystem.cat("f2");
+    filesystem.rm("f2");
+    filesystem.mountSnapshot();
+    filesystem.cat("f2");
+    filesystem.deleteSnapshot("s1");
+    filesystem.fsck();
+    PRINTDIV2;
+
+    std::cout << "Testing fallocate and truncate..." << std::endl;
+    filesystem.format(FEAT_EXTENTS);
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("f3");
+    close(fw);
+    filesystem.fallocate("f3", 5 * 4096);
+    filesystem.append("f3", "f3");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "size       blocks  path" << std::endl;
+    std::cout << "8258       5       f3" << std::endl;
+    std::cout << "size       blocks  path" << std::endl;
+    std::cout << "1048576    3       f3" << std::endl;
+    std::cout << "fsck: no problems found" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.du("f3");
+    filesystem.truncate("f3", 1048576);
+    filesystem.du("f3");
+    filesystem.fsck();
+    PRINTDIV2;
+
+    std::cout << "Testing import and export..." << std::endl;
+    filesystem.format(FEAT_EXTENTS);
+    mkdir("import_src", 0755);
+    mkdir("import_src/sub", 0755);
+    fw = open("import_src/lines", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write(fw, "one\n\ntwo\n", 9);
+    close(fw);
+    fw = open("import_src/sub/binary", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write(fw, "a\0b\n", 4);
+    close(fw);
+    filesystem.importTree("import_src", "t");
+    filesystem.exportTree("t", "import_out");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "one" << std::endl;
+    std::cout << std::endl;
+    std::cout << "two" << std::endl;
+    std::cout << "size       blocks  path" << std::endl;
+    std::cout << "4          2       t/sub" << std::endl;
+    std::cout << "13         4       t" << std::endl;
+    std::cout << "exported 9 and 4 bytes" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("t/lines");
+    filesystem.du("t");
+    {
+        char buf[16];
+        fw = open("import_out/lines", O_RDONLY);
+        int n1 = fw == -1 || read(fw, buf, sizeof(buf)) != 9 || std::memcmp(buf, "one\n\ntwo\n", 9) ? -1 : 9;
+        close(fw);
+        fw = open("import_out/sub/binary", O_RDONLY);
+        int n2 = fw == -1 || read(fw, buf, sizeof(buf)) != 4 || std::memcmp(buf, "a\0b\n", 4) ? -1 : 4;
+        close(fw);
+        std::cout << "exported " << n1 << " and " << n2 << " bytes" << std::endl;
+    }
+    unlink("import_src/sub/binary");
+    unlink("import_src/lines");
+    rmdir("import_src/sub");
+    rmdir("import_src");
+    unlink("import_out/sub/binary");
+    unlink("import_out/lines");
+    rmdir("import_out/sub");
+    rmdir("import_out");
+    PRINTDIV2;
+
+    std::cout << "Testing export of a name that leaves the target..." << std::endl;
+    filesystem.format();
+    fw = open("input1.txt", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("../x");
+    close(fw);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Cannot export ../x: invalid name" << std::endl;
+    std::cout << "host paths created: 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.exportTree("/", "export_out");
+    {
+        struct stat st;
+        int n = (lstat("export_out", &st) == 0) + (lstat("x", &st) == 0);
+        std::cout << "host paths created: " << n << std::endl;
+    }
+    PRINTDIV2;
+
+    std::cout << "Testing create with a byte count..." << std::endl;
+    filesystem.format();
+    fw = open("create_input", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write(fw, "one\n\ntwo\n\0\n", 11);
+    close(fw);
+    fw = open("create_input", O_RDONLY);
+    dup2(fw, 0);
+    filesystem.create("b", 9);
+    filesystem.create("c", 2);
+    close(fw);
+    unlink("create_input");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "one" << std::endl;
+    std::cout << std::endl;
+    std::cout << "two" << std::endl;
+    std::cout << "size       blocks  path" << std::endl;
+    std::cout << "2          1       c" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("b");
+    filesystem.du("c");
+    PRINTDIV2;
+
+    std::cout << "Testing mapped reads..." << std::endl;
+    {
+        // prints the spans of a file and whether they add up to its content
+        auto mapped = [this](const std::string& name) {
+            file_view view;
+            std::vector<uint8_t> data, joined;
+            filesystem.mapFile(name, view);
+            filesystem.readFile(name, data);
+            for (size_t i = 0; i < view.spans.size(); i++)
+                joined.insert(joined.end(), view.spans[i].data, view.spans[i].data + view.spans[i].len);
+            std::cout << name << ": " << view.spans.size() << " spans, " << view.size << " bytes, "
+                      << (joined == data ? "same as read" : "differs") << std::endl;
+        };
+        filesystem.format();
+        fw = open("input3.txt", O_RDONLY);
+        dup2(fw, 0);
+        filesystem.create("f3");
+        close(fw);
+        fw = open("input3.txt", O_RDONLY);
+        dup2(fw, 0);
+        filesystem.create("f5");
+        close(fw);
+        filesystem.append("f3", "f3");
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "f5: 1 spans, 4129 bytes, same as read" << std::endl;
+        std::cout << "f3: 2 spans, 8258 bytes, same as read" << std::endl;
+        std::cout << "f3: 1 spans, 4129 bytes, same as read" << std::endl;
+        std::cout << "f3: 4 spans, 2097152 bytes, same as read" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        mapped("f5");
+        mapped("f3");
+        filesystem.format(FEAT_EXTENTS | FEAT_TAILS | FEAT_PACK);
+        fw = open("input3.txt", O_RDONLY);
+        dup2(fw, 0);
+        filesystem.create("f3");
+        close(fw);
+        mapped("f3");
+        filesystem.truncate("f3", 1048576);
+        filesystem.append("f3", "f3");
+        mapped("f3");
+    }
+    PRINTDIV2;
+
+    std::cout << "Testing reads at an offset..." << std::endl;
+    {
+        // every layout: FAT chain, extents with a hole and a packed tail,
+        // compressed chunks and inline; fragmented by appending in turns
+        int layouts[] = { 0, FEAT_PACK, FEAT_COMPRESS, FEAT_INLINE };
+        int differ = 0, ranges = 0;
+        for (int l = 0; l < 4; l++) {
+            filesystem.format(layouts[l]);
+            fw = open(l == 3 ? "input1.txt" : "input3.txt", O_RDONLY);
+            dup2(fw, 0);
+            filesystem.create("f3");
+            close(fw);
+            fw = open("input3.txt", O_RDONLY);
+            dup2(fw, 0);
+            filesystem.create("f5");
+            close(fw);
+            for (int i = 0; i < 3 && l != 3; i++) {
+                filesystem.append("f3", "f3");
+                filesystem.append("f5", "f5");
+            }
+            if (l == 1)
+                filesystem.truncate("f3", 100000);
+            const char *names[] = { "f3", "f5" };
+            for (int f = 0; f < 2; f++) {
+                std::vector<uint8_t> whole, part;
+                filesystem.readFile(names[f], whole);
+                long offsets[] = { 0, 1, 4095, 4096, 5000, 33000, 40000, 99990, 100000, 200000 };
+                size_t sizes[] = { 1, 100, 4096, 9000, 70000 };
+                for (int o = 0; o < 10; o++) {
+                    for (int z = 0; z < 5; z++) {
+                        filesystem.readFileAt(names[f], offsets[o], sizes[z], part);
+                        size_t from = std::min<size_t>(offsets[o], whole.size());
+                        size_t n = std::min(sizes[z], whole.size() - from);
+                        if (part.size() != n || !std::equal(part.begin(), part.end(), whole.begin() + from))
+                            differ++;
+                        ranges++;
+                    }
+                }
+            }
+        }
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "400 ranges, 0 differ from the whole file" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        std::cout << ranges << " ranges, " << differ << " differ from the whole file" << std::endl;
+    }
+    PRINTDIV2;
+
+    std::cout << "Testing compact directories..." << std::endl;
+    {
+        // fills a directory with short names and reports how many fit
+        auto fill = [this](int features) {
+            filesystem.format(features);
+            filesystem.mkdir("d");
+            int n = 0;
+            for (int i = 0; i < 300; i++) {
+                std::string name = "/d/n" + std::to_string(i);
+                n += filesystem.writeFile(name, (const uint8_t *)name.data(), name.size()) == 0;
+            }
+            std::vector<dir_entry> entries;
+            dir_entry e;
+            filesystem.listDir("/d", entries);
+            bool found = filesystem.entryOf("/d/n42", e) && e.size == 6;
+            std::cout << n << " created, " << entries.size() << " listed, "
+                      << (found ? "n42 found" : "n42 missing") << std::endl;
+        };
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "63 created, 63 listed, n42 found" << std::endl;
+        std::cout << "255 created, 255 listed, n42 found" << std::endl;
+        std::cout << "fsck: no problems found" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        fill(0);
+        fill(FEAT_COMPACT_DIRS);
+        filesystem.fsck();
+    }
+    PRINTDIV2;
+
+    std::cout << "Testing sorted ls pages..." << std::endl;
+    filesystem.format(FEAT_COMPACT_DIRS);
+    filesystem.writeFile("/c", (const uint8_t *)"c", 1);
+    filesystem.writeFile("/a", (const uint8_t *)"aaa", 3);
+    filesystem.writeFile("/d", (const uint8_t *)"dddd", 4);
+    filesystem.writeFile("/b", (const uint8_t *)"bb", 2);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "name             type       accessrights    size" << std::endl;
+    std::cout << "a                file       rw-             3" << std::endl;
+    std::cout << "b                file       rw-             2" << std::endl;
+    std::cout << "more after b" << std::endl;
+    std::cout << "name             type       accessrights    size" << std::endl;
+    std::cout << "c                file       rw-             1" << std::endl;
+    std::cout << "d                file       rw-             4" << std::endl;
+    std::cout << "name             type       accessrights    size" << std::endl;
+    std::cout << "b                file       rw-             2" << std::endl;
+    std::cout << "a                file       rw-             3" << std::endl;
+    std::cout << "d                file       rw-             4" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.ls(LS_NAME, "", 2);
+    filesystem.ls(LS_NAME, "b", 2);
+    filesystem.ls(LS_SIZE, "c", 0);
+    PRINTDIV2;
+
+    std::cout << "Testing stat..." << std::endl;
+    {
+        filesystem.format();
+        filesystem.mkdir("d");
+        std::string block(BLOCK_SIZE, 'a');
+        filesystem.writeFile("/d/a", (const uint8_t *)block.data(), block.size());
+        filesystem.writeFile("/d/c", (const uint8_t *)"c", 1);
+        filesystem.writeFile("/b", (const uint8_t *)"b", 1);
+        filesystem.appendFile("/d/a", (const uint8_t *)"a", 1);
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "size       blocks  runs  type  rights  path" << std::endl;
+        std::cout << "4097       2       2     file  rw-     /d/a" << std::endl;
+        std::cout << "1          1       1     file  rw-     b" << std::endl;
+        std::cout << "-          1       1     dir   rwx     d/../d" << std::endl;
+        std::cout << "nope: File not found" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        std::vector<std::string> paths;
+        paths.push_back("/d/a");
+        paths.push_back("b");
+        paths.push_back("d/../d");
+        paths.push_back("nope");
+        filesystem.stat(paths);
+    }
+    PRINTDIV2;
+
+    std::cout << "Testing block groups..." << std::endl;
+    {
+        // the group (256 blocks) that holds each path's first block
+        auto group = [this](const std::string& path) {
+            dir_entry e;
+            filesystem.entryOf(path, e);
+            std::cout << path << ": group " << e.first_blk / 256 << std::endl;
+        };
+        filesystem.format();
+        filesystem.mkdir("a");
+        filesystem.mkdir("b");
+        filesystem.mkdir("a/sub");
+        filesystem.writeFile("/z", (const uint8_t *)"z", 1);
+        filesystem.writeFile("/b/y", (const uint8_t *)"y", 1);
+        filesystem.writeFile("/a/x", (const uint8_t *)"x", 1);
+        filesystem.writeFile("/a/sub/w", (const uint8_t *)"w", 1);
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "/z: group 0" << std::endl;
+        std::cout << "/a: group 1" << std::endl;
+        std::cout << "/a/x: group 1" << std::endl;
+        std::cout << "/a/sub/w: group 1" << std::endl;
+        std::cout << "/b: group 2" << std::endl;
+        std::cout << "/b/y: group 2" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        group("/z");
+        group("/a");
+        group("/a/x");
+        group("/a/sub/w");
+        group("/b");
+        group("/b/y");
+    }
+    PRINTDIV2;
+
+    std::cout << "Testing write-back..." << std::endl;
+    {
+        // reads and mapped views see what is still in the cache; the image
+        // has it after sync
+        std::vector<uint8_t> data(3 * BLOCK_SIZE), back;
+        for (size_t i = 0; i < data.size(); i++)
+            data[i] = (uint8_t)(i * 7 + i / BLOCK_SIZE);
+        filesystem.format();
+        filesystem.writeFile("/wb", data.data(), data.size());
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "read: ok" << std::endl;
+        std::cout << "map: ok" << std::endl;
+        std::cout << "image after sync: ok" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        filesystem.readFile("/wb", back);
+        std::cout << "read: " << (back == data ? "ok" : "differs") << std::endl;
+        file_view view;
+        filesystem.mapFile("/wb", view);
+        back.clear();
+        for (size_t k = 0; k < view.spans.size(); k++)
+            back.insert(back.end(), view.spans[k].data, view.spans[k].data + view.spans[k].len);
+        std::cout << "map: " << (back == data ? "ok" : "differs") << std::endl;
+        filesystem.writeFile("/wb", data.data() + BLOCK_SIZE, BLOCK_SIZE);
+        filesystem.sync();
+        dir_entry e;
+        filesystem.entryOf("/wb", e);
+        std::vector<uint8_t> blk(BLOCK_SIZE);
+        fw = open(DISKNAME, O_RDONLY);
+        bool same = pread(fw, blk.data(), BLOCK_SIZE, (off_t)e.first_blk * BLOCK_SIZE) == BLOCK_SIZE &&
+            std::memcmp(blk.data(), data.data() + BLOCK_SIZE, BLOCK_SIZE) == 0;
+        close(fw);
+        std::cout << "image after sync: " << (same ? "ok" : "differs") << std::endl;
+    }
+    PRINTDIV2;
+
+    std::cout << "Testing write-back order after a crash..." << std::endl;
+    {
+        // a child writes files and ends without writing its cache back, at
+        // a point where the blocks of the format but not of the files have
+        // expired; whatever the image then lists must have its content
+        std::vector<uint8_t> data(72 * 1024);
+        for (size_t i = 0; i < data.size(); i++)
+            data[i] = (uint8_t)('a' + i % 26);
+        filesystem.sync();
+        std::cout.flush();
+        pid_t child = fork();
+        if (child == 0)
+        {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, 1);
+            FS crashing;
+            crashing.format(FEAT_EXTENTS);
+            usleep(300000);
+            for (int f = 1; f <= 3; f++)
+                crashing.writeFile("/f" + std::to_string(f), data.data(), data.size());
+            usleep(350000);
+            _exit(0);
+        }
+        waitpid(child, NULL, 0);
+        int bad = 0;
+        {
+            FS mounted;
+            for (int f = 1; f <= 3; f++)
+            {
+                std::vector<uint8_t> back;
+                dir_entry e;
+                if (mounted.entryOf("/f" + std::to_string(f), e) &&
+                    (mounted.readFile("/f" + std::to_string(f), back) == -1 || back != data))
+                    bad++;
+            }
+        }
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "files without their content: 0" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        std::cout << "files without their content: " << bad << std::endl;
+        filesystem.format();
+    }
+    PRINTDIV2;
+
+    std::cout << "... Extended commands done" << std::endl;
+    PRINTDIV;
+}
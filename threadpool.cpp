@@ -0,0 +1,108 @@
+#include "threadpool.h"
+
+// identifies the pool and queue of the calling thread when it is a worker
+static thread_local ThreadPool *current_pool = nullptr;
+static thread_local unsigned current_queue = 0;
+
+ThreadPool::ThreadPool(unsigned threads)
+    : pending(0), next_queue(0), stopping(false)
+{
+    if (threads == 0)
+        threads = 1;
+    for (unsigned i = 0; i < threads; i++)
+        queues.push_back(new Queue);
+    for (unsigned i = 0; i < threads; i++)
+        workers.push_back(std::thread(&ThreadPool::worker, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(idle_lock);
+        stopping = true;
+    }
+    work_cv.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    for (size_t i = 0; i < queues.size(); i++)
+        delete queues[i];
+}
+
+void
+ThreadPool::submit(std::function<void()> task)
+{
+    unsigned q = (current_pool == this) ? current_queue
+                                        : next_queue++ % queues.size();
+    pending++;
+    {
+        std::lock_guard<std::mutex> guard(queues[q]->lock);
+        queues[q]->tasks.push_back(task);
+    }
+    // taking idle_lock orders the push before a sleeping worker re-checks
+    std::lock_guard<std::mutex> guard(idle_lock);
+    work_cv.notify_one();
+}
+
+// Pops from the back of the worker's own deque, otherwise steals from the
+// front of another worker's deque.
+bool
+ThreadPool::take(unsigned id, std::function<void()>& task)
+{
+    {
+        std::lock_guard<std::mutex> guard(queues[id]->lock);
+        if (!queues[id]->tasks.empty()) {
+            task = queues[id]->tasks.back();
+            queues[id]->tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t k = 1; k < queues.size(); k++) {
+        Queue *victim = queues[(id + k) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim->lock);
+        if (!victim->tasks.empty()) {
+            task = victim->tasks.front();
+            victim->tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+ThreadPool::worker(unsigned id)
+{
+    current_pool = this;
+    current_queue = id;
+
+    for (;;) {
+        std::function<void()> task;
+        if (take(id, task)) {
+            task();
+            if (--pending == 0) {
+                std::lock_guard<std::mutex> guard(idle_lock);
+                done_cv.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(idle_lock);
+        if (stopping)
+            return;
+        // re-check under the lock so a submit between take() and here is seen
+        bool queued = false;
+        for (size_t k = 0; k < queues.size() && !queued; k++) {
+            std::lock_guard<std::mutex> qguard(queues[k]->lock);
+            queued = !queues[k]->tasks.empty();
+        }
+        if (!queued)
+            work_cv.wait(guard);
+    }
+}
+
+void
+ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> guard(idle_lock);
+    while (pending > 0)
+        done_cv.wait(guard);
+}
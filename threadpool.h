@@ -0,0 +1,45 @@
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+// A small work-stealing thread pool. Every worker owns a task deque: tasks
+// submitted from a worker go to the back of its own deque and are taken LIFO,
+// idle workers steal FIFO from the front of the other deques. wait() blocks
+// until every submitted task (including tasks submitted by tasks) is done.
+class ThreadPool {
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<std::function<void()> > tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<Queue*> queues;
+    std::mutex idle_lock;
+    std::condition_variable work_cv;  // signalled when tasks are submitted
+    std::condition_variable done_cv;  // signalled when pending drops to zero
+    std::atomic<int> pending;         // submitted but not finished tasks
+    std::atomic<unsigned> next_queue; // round robin for external submits
+    bool stopping;
+
+    void worker(unsigned id);
+    bool take(unsigned id, std::function<void()>& task);
+
+public:
+    explicit ThreadPool(unsigned threads);
+    ~ThreadPool();
+    unsigned size() { return workers.size(); }
+    // queues a task; safe to call from inside a running task
+    void submit(std::function<void()> task);
+    // waits until all submitted tasks have finished
+    void wait();
+};
+
+#endif // __THREADPOOL_H__